@@ -0,0 +1,67 @@
+// Throughput of the PUT checksums against just writing the body to the page
+// cache, which is what they have to keep up with.
+//
+//   ./bench/checksum_bench [MiB]
+//
+// Each kernel hashes `MiB` of random data (default 1024) in 1 MiB updates,
+// the same granularity the server feeds them.
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/s3http/checksum.hpp"
+
+static constexpr size_t CHUNK = 1 << 20;
+
+static void run(const std::string& name, size_t chunks, const std::function<void(const uint8_t*, size_t)>& fn,
+                const std::vector<uint8_t>& data) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < chunks; ++i)
+        fn(data.data(), CHUNK);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double mbps = chunks / elapsed.count();
+    double us = elapsed.count() * 1e6 / chunks;
+    std::printf("%-12s %9.0f MiB/s %8.1f us/MiB\n", name.c_str(), mbps, us);
+}
+
+int main(int argc, char** argv) {
+    size_t chunks = argc > 1 ? std::stoul(argv[1]) : 1024;
+
+    std::vector<uint8_t> data(CHUNK);
+    std::mt19937_64 rng(42);
+    for (auto& b : data)
+        b = rng();
+
+    Md5 md5;
+    run("md5", chunks, [&](const uint8_t* p, size_t n) { md5.update(p, n); }, data);
+    uint32_t crc = 0;
+    run("crc32", chunks, [&](const uint8_t* p, size_t n) { crc = crc32_update(crc, p, n); }, data);
+    run("crc32c", chunks, [&](const uint8_t* p, size_t n) { crc = crc32c_update(crc, p, n); }, data);
+    Sha256 sha;
+    run("sha256", chunks, [&](const uint8_t* p, size_t n) { sha.update(p, n); }, data);
+    // What a PUT pays by default: the ETag plus the SDKs' default checksum
+    ObjectHasher put(true, ChecksumAlgo::crc32);
+    run("md5+crc32", chunks, [&](const uint8_t* p, size_t n) { put.update(p, n); }, data);
+
+    char path[] = "/tmp/lobos-checksum-bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        std::perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    run("write", chunks, [&](const uint8_t* p, size_t n) {
+        if (write(fd, p, n) != (ssize_t)n)
+            std::perror("write");
+    }, data);
+    close(fd);
+
+    // Keeps the compiler from dropping the work
+    std::cerr << "(" << crc << " " << put.has_md5() << ")" << std::endl;
+}
@@ -0,0 +1,85 @@
+// Memory and speed of the index backends, the default std::map against
+// --compact-index, on LMCache-like keys.
+//
+//   ./bench/index_memory_bench [keys]
+//
+// Inserts `keys` objects (default 10M) in random order, a third of them with
+// an ETag, then times point lookups and 1000 key listing pages from random
+// places. Memory is what malloc hands out for the index.
+#include <chrono>
+#include <cstdio>
+#include <malloc.h>
+#include <random>
+#include <string>
+
+#include "../src/index/index.hpp"
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// vllm@<model>@<world size>@<worker>@<chunk hash>
+static std::string key_for(uint64_t i) {
+    char buf[96];
+    std::snprintf(buf, sizeof(buf), "vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@%u@%016lx",
+                  (unsigned)(i % 4), (unsigned long)mix(i));
+    return buf;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+static void run(const char* name, bool compact, size_t keys) {
+    malloc_trim(0);
+    size_t before = mallinfo2().uordblks;
+    IndexStore store(0, "/nonexistent/", compact);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < keys; ++i) {
+        Object o{(size_t)(mix(i) % (16 << 20)), (time_t)(1760000000 + i % 86400), 'f'};
+        if (i % 3 == 0) {
+            o.has_md5 = true;
+            o.md5[0] = (uint8_t)i;
+        }
+        store.add_entry(key_for(i), o);
+    }
+    double insert = seconds_since(start);
+    size_t used = mallinfo2().uordblks - before;
+
+    std::mt19937_64 rng(42);
+    size_t lookups = std::min<size_t>(keys, 2000000), found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; ++i) {
+        Object o;
+        found += store.get(key_for(rng() % keys), o);
+    }
+    double lookup = seconds_since(start);
+
+    size_t pages = 1000, listed = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < pages; ++i) {
+        size_t n = 0;
+        store.for_each_prefix("vllm@", key_for(rng() % keys), [&](const std::string&, const Object&) {
+            return ++n < 1000;
+        });
+        listed += n;
+    }
+    double list = seconds_since(start);
+
+    if (found != lookups || store.size() != keys)
+        std::fprintf(stderr, "%s: %zu/%zu found, %zu/%zu indexed\n", name, found, lookups, store.size(), keys);
+    std::printf("%-8s %7.1f B/key %9.0f inserts/s %9.0f lookups/s %9.0f listed keys/s\n", name,
+                (double)used / keys, keys / insert, lookups / lookup, listed / list);
+}
+
+int main(int argc, char** argv) {
+    size_t keys = argc > 1 ? std::stoul(argv[1]) : 10000000;
+    std::printf("%zu keys, e.g. %s\n", keys, key_for(0).c_str());
+    run("map", false, keys);
+    run("compact", true, keys);
+}
@@ -0,0 +1,70 @@
+// Compares a cold crawl of a directory against loading the index snapshot.
+//
+//   ./bench/index_snapshot_bench [dir] [objects] [dirs]
+//
+// Populates `dir` with `objects` empty files spread over `dirs` directories
+// when it doesn't exist yet, so it can be pointed at a real bucket as well.
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "../src/index/index.hpp"
+
+namespace fs = std::filesystem;
+
+static double wait_ready(IndexStore& store, std::chrono::steady_clock::time_point start) {
+    while (!store.ready())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char** argv) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp/lobos-index-bench/";
+    size_t objects = argc > 2 ? std::stoul(argv[2]) : 200000;
+    size_t dirs = argc > 3 ? std::stoul(argv[3]) : 100;
+    int threads = std::thread::hardware_concurrency();
+
+    if (dir.back() != '/')
+        dir.push_back('/');
+
+    if (!fs::exists(dir)) {
+        std::cout << "Populating " << dir << " with " << objects << " objects in " << dirs << " directories" << std::endl;
+        for (size_t d = 0; d < dirs; ++d)
+            fs::create_directories(dir + "prefix-" + std::to_string(d));
+        for (size_t i = 0; i < objects; ++i)
+            std::ofstream(dir + "prefix-" + std::to_string(i % dirs) + "/object-" + std::to_string(i));
+    }
+
+    auto snapshot = fs::temp_directory_path() / "lobos-index-bench.snap";
+    fs::remove(snapshot);
+
+    double crawl, load;
+    size_t items;
+    {
+        IndexStore store(0, dir);
+        store.set_snapshot(snapshot.string(), 0);
+        auto start = std::chrono::steady_clock::now();
+        store.build(threads);
+        crawl = wait_ready(store, start);
+        items = store.size();
+        store.shutdown(); // writes the snapshot
+    }
+    {
+        IndexStore store(0, dir);
+        store.set_snapshot(snapshot.string(), 0);
+        auto start = std::chrono::steady_clock::now();
+        store.build(threads);
+        load = wait_ready(store, start);
+        if (store.size() != items)
+            std::cerr << "snapshot has " << store.size() << " items, crawl had " << items << std::endl;
+    }
+
+    std::cout << "items=" << items << " threads=" << threads << std::endl;
+    std::cout << "cold crawl:    " << crawl << "s" << std::endl;
+    std::cout << "snapshot load: " << load << "s" << std::endl;
+    fs::remove(snapshot);
+}
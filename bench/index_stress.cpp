@@ -0,0 +1,168 @@
+// Hammers IndexStore from many threads with PUT/GET/LIST/DELETE the way the
+// server drives it, and checks what must hold whatever the interleaving.
+//
+//   ./bench/index_stress [threads] [seconds]
+//
+// Each thread owns a prefix and keeps a model of what it wrote there, so a
+// get after an add must see it, a get after a delete must not, and a listing
+// of its own prefix must match the model key for key. Listings of the whole
+// index, racing with everyone, must still come out in strictly increasing
+// order. Once all threads are done size() and bytes() must add up to the
+// models. Runs both backends, exits non-zero on the first broken invariant.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/index/index.hpp"
+
+static std::atomic<bool> failed{false};
+
+static void fail(const char* what, const std::string& key) {
+    std::fprintf(stderr, "FAIL: %s: %s\n", what, key.c_str());
+    failed = true;
+}
+
+static std::string key_for(unsigned thread, uint64_t i) {
+    char buf[96];
+    std::snprintf(buf, sizeof(buf), "t%02u/vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@%u@%06lx.pt",
+                  thread, (unsigned)(i % 4), (unsigned long)i);
+    return buf;
+}
+
+struct Totals {
+    uint64_t ops = 0, keys = 0, bytes = 0;
+};
+
+static Totals worker(IndexStore& store, unsigned id, std::chrono::steady_clock::time_point deadline) {
+    std::mt19937_64 rng(id);
+    std::map<std::string, size_t> model;
+    char prefix[8];
+    std::snprintf(prefix, sizeof(prefix), "t%02u/", id);
+    Totals t;
+
+    while (!failed && std::chrono::steady_clock::now() < deadline) {
+        for (int n = 0; n < 1000; ++n, ++t.ops) {
+            auto key = key_for(id, rng() % 4096);
+            Object o;
+            switch (rng() % 10) {
+                case 0: case 1: case 2: case 3: { // PUT
+                    size_t size = rng() % (1 << 20);
+                    store.add_entry(key, Object{size, 1760000000, 'f'});
+                    model[key] = size;
+                    if (!store.get(key, o) || o.size != size)
+                        fail("get after add", key);
+                    break;
+                }
+                case 4: case 5: // DELETE
+                    store.remove_entry(key);
+                    model.erase(key);
+                    if (store.get(key, o))
+                        fail("get after delete", key);
+                    break;
+                case 6: { // DeleteObjects
+                    std::vector<std::string> batch;
+                    for (int i = 0; i < 8; ++i)
+                        batch.push_back(key_for(id, rng() % 4096));
+                    store.remove_entries(batch);
+                    for (auto& k : batch) {
+                        model.erase(k);
+                        if (store.contains(k))
+                            fail("contains after remove_entries", k);
+                    }
+                    break;
+                }
+                case 7: { // GET
+                    auto it = model.find(key);
+                    bool found = store.get(key, o);
+                    if (found != (it != model.end()) || (found && o.size != it->second))
+                        fail("get disagrees with model", key);
+                    break;
+                }
+                case 8: { // LIST of our own prefix, nobody else writes there
+                    auto it = model.lower_bound(key);
+                    size_t listed = 0;
+                    store.for_each_prefix(prefix, key, [&](const std::string& k, const Object& obj) {
+                        if (it == model.end() || k != it->first || obj.size != it->second) {
+                            fail("own listing disagrees with model", k);
+                            return false;
+                        }
+                        ++it;
+                        return ++listed < 1000;
+                    });
+                    if (listed < 1000 && it != model.end())
+                        fail("own listing stopped early at", it->first);
+                    break;
+                }
+                case 9: { // LIST across every thread's prefix
+                    std::string prev;
+                    size_t listed = 0;
+                    store.for_each_prefix("", key, [&](const std::string& k, const Object&) {
+                        if (listed && k <= prev) {
+                            fail("listing out of order", prev + " then " + k);
+                            return false;
+                        }
+                        prev = k;
+                        return ++listed < 1000;
+                    });
+                    break;
+                }
+            }
+        }
+    }
+
+    t.keys = model.size();
+    for (auto& [k, size] : model)
+        t.bytes += size;
+    return t;
+}
+
+static void run(bool compact, unsigned threads, int seconds) {
+    IndexStore store(0, "/nonexistent/", compact);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    std::vector<Totals> totals(threads);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; ++i)
+        workers.emplace_back([&, i] { totals[i] = worker(store, i, deadline); });
+    for (auto& w : workers)
+        w.join();
+
+    Totals sum;
+    for (auto& t : totals) {
+        sum.ops += t.ops;
+        sum.keys += t.keys;
+        sum.bytes += t.bytes;
+    }
+    if (store.size() != sum.keys)
+        fail("size() after the run", std::to_string(store.size()) + " != " + std::to_string(sum.keys));
+    if (store.bytes() != sum.bytes)
+        fail("bytes() after the run", std::to_string(store.bytes()) + " != " + std::to_string(sum.bytes));
+    size_t listed = 0;
+    std::string prev;
+    store.for_each_prefix("", [&](const std::string& k, const Object&) {
+        if (listed++ && k <= prev)
+            fail("final listing out of order", prev + " then " + k);
+        prev = k;
+        return true;
+    });
+    if (listed != sum.keys)
+        fail("final listing count", std::to_string(listed) + " != " + std::to_string(sum.keys));
+
+    std::printf("%-8s %2u threads %10lu ops %8.0f kops/s %8lu keys left\n", compact ? "compact" : "map", threads,
+                (unsigned long)sum.ops, sum.ops / 1e3 / seconds, (unsigned long)sum.keys);
+}
+
+int main(int argc, char** argv) {
+    unsigned threads = argc > 1 ? std::stoul(argv[1]) : std::max(std::thread::hardware_concurrency(), 2u);
+    int seconds = argc > 2 ? std::stoi(argv[2]) : 5;
+    run(false, threads, seconds);
+    run(true, threads, seconds);
+    if (failed) {
+        std::fprintf(stderr, "index_stress: invariants broken\n");
+        return 1;
+    }
+}
@@ -0,0 +1,477 @@
+// Closed-loop S3 load generator for lobos, JSON results so runs can be
+// compared from one commit to the next.
+//
+//   ./bench/loadgen [options]                 against a lobos already running
+//   ./bench/loadgen --spawn ./lobos [options] starts one on a scratch dir
+//
+// Every connection sends one request at a time, as fast as it gets answers,
+// for --duration seconds. Keys are picked uniformly among --keys keys, put
+// there first unless --no-prefill, sizes uniformly in the --size range.
+// Latencies are from sending the request to reading the whole response.
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <filesystem>
+#include <getopt.h>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+namespace beast = boost::beast;
+namespace http  = beast::http;
+namespace net   = boost::asio;
+using clock_type = std::chrono::steady_clock;
+
+enum Op { GET, PUT, HEAD, DELETE, LIST, OP_COUNT };
+static const char* op_names[] = {"get", "put", "head", "delete", "list"};
+
+struct Config {
+    std::string host = "127.0.0.1";
+    unsigned short port = 8080;
+    std::string bucket;
+    int threads = 2;
+    int connections = 64;
+    int duration = 10;
+    uint64_t keys = 10000;
+    std::string size_spec = "4K";
+    uint64_t min_size = 4096;
+    uint64_t max_size = 4096;
+    std::string mix_spec = "get=90,put=10";
+    std::array<unsigned, OP_COUNT> mix{};
+    bool prefill = true;
+    std::string spawn;
+    std::string lobos_args;
+    std::string dir;
+};
+
+// Latencies in ns, 32 linear buckets per power of two: within 3%
+struct Histogram {
+    static constexpr int sub_bits = 5;
+    std::vector<uint64_t> counts = std::vector<uint64_t>(64 << sub_bits);
+    uint64_t total = 0;
+
+    static size_t index(uint64_t v) {
+        if (v < (1u << sub_bits))
+            return v;
+        int p = std::bit_width(v) - 1;
+        return ((p - sub_bits + 1) << sub_bits) + ((v >> (p - sub_bits)) & ((1u << sub_bits) - 1));
+    }
+    static uint64_t lower_bound(size_t i) {
+        if (i < (1u << sub_bits))
+            return i;
+        int p = (i >> sub_bits) + sub_bits - 1;
+        return ((1ull << sub_bits) + (i & ((1u << sub_bits) - 1))) << (p - sub_bits);
+    }
+
+    void record(uint64_t ns) {
+        counts[index(ns)]++;
+        total++;
+    }
+    void merge(const Histogram& o) {
+        for (size_t i = 0; i < counts.size(); ++i)
+            counts[i] += o.counts[i];
+        total += o.total;
+    }
+    uint64_t percentile(double q) const {
+        uint64_t rank = std::max<uint64_t>(1, q * total + 0.5), seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank)
+                return (lower_bound(i) + lower_bound(i + 1)) / 2;
+        }
+        return 0;
+    }
+};
+
+struct OpStats {
+    Histogram latency;
+    uint64_t errors = 0;
+    uint64_t not_found = 0;
+    uint64_t bytes = 0;
+
+    void merge(const OpStats& o) {
+        latency.merge(o.latency);
+        errors += o.errors;
+        not_found += o.not_found;
+        bytes += o.bytes;
+    }
+};
+
+using Stats = std::array<OpStats, OP_COUNT>;
+
+static uint64_t parse_size(const std::string& s) {
+    size_t end;
+    uint64_t v = std::stoull(s, &end);
+    switch (end < s.size() ? s[end] : 0) {
+        case 'K': case 'k': return v << 10;
+        case 'M': case 'm': return v << 20;
+        case 'G': case 'g': return v << 30;
+        default: return v;
+    }
+}
+
+static void parse_mix(Config& cfg) {
+    std::stringstream ss(cfg.mix_spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        auto eq = item.find('=');
+        auto it = std::find(std::begin(op_names), std::end(op_names), item.substr(0, eq));
+        if (eq == std::string::npos || it == std::end(op_names)) {
+            std::cerr << "Error: bad --mix entry " << item << std::endl;
+            std::exit(EINVAL);
+        }
+        cfg.mix[it - std::begin(op_names)] = std::stoul(item.substr(eq + 1));
+    }
+    if (std::all_of(cfg.mix.begin(), cfg.mix.end(), [](unsigned w) { return w == 0; })) {
+        std::cerr << "Error: --mix has no operation" << std::endl;
+        std::exit(EINVAL);
+    }
+}
+
+// Reads a response, counting its body but not keeping it
+static net::awaitable<unsigned> read_response(beast::tcp_stream& stream, beast::flat_buffer& buffer,
+                                              bool head, uint64_t& bytes, bool& keep_alive) {
+    http::response_parser<http::buffer_body> parser;
+    parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+    parser.skip(head);
+    co_await http::async_read_header(stream, buffer, parser, net::use_awaitable);
+    static thread_local char scratch[1 << 16];
+    while (!parser.is_done()) {
+        parser.get().body().data = scratch;
+        parser.get().body().size = sizeof(scratch);
+        beast::error_code ec;
+        co_await http::async_read(stream, buffer, parser, net::redirect_error(net::use_awaitable, ec));
+        if (ec && ec != http::error::need_buffer)
+            throw beast::system_error(ec);
+        bytes += sizeof(scratch) - parser.get().body().size;
+    }
+    keep_alive = parser.get().keep_alive();
+    co_return parser.get().result_int();
+}
+
+static std::string key_target(const Config& cfg, uint64_t key) {
+    return "/" + cfg.bucket + "/loadgen/obj-" + std::to_string(key);
+}
+
+static net::awaitable<unsigned> send(const Config& cfg, beast::tcp_stream& stream, beast::flat_buffer& buffer,
+                                     Op op, uint64_t key, const std::string& payload, uint64_t size,
+                                     uint64_t& bytes, bool& keep_alive) {
+    if (op == PUT) {
+        http::request<http::buffer_body> req{http::verb::put, key_target(cfg, key), 11};
+        req.set(http::field::host, cfg.host);
+        req.body().data = const_cast<char*>(payload.data());
+        req.body().size = size;
+        req.body().more = false;
+        req.content_length(size);
+        co_await http::async_write(stream, req, net::use_awaitable);
+        bytes += size;
+        uint64_t received = 0;
+        co_return co_await read_response(stream, buffer, false, received, keep_alive);
+    }
+
+    http::verb verb = op == HEAD ? http::verb::head : op == DELETE ? http::verb::delete_ : http::verb::get;
+    auto target = op == LIST ? "/" + cfg.bucket + "?list-type=2&prefix=loadgen/&max-keys=100" : key_target(cfg, key);
+    http::request<http::empty_body> req{verb, target, 11};
+    req.set(http::field::host, cfg.host);
+    co_await http::async_write(stream, req, net::use_awaitable);
+    uint64_t received = 0;
+    auto status = co_await read_response(stream, buffer, op == HEAD, received, keep_alive);
+    if (op == GET)
+        bytes += received;
+    co_return status;
+}
+
+struct Connection {
+    const Config& cfg;
+    net::ip::tcp::endpoint ep;
+    Stats& stats;
+    const std::string& payload;
+    std::mt19937_64 rng;
+    // Prefill: the keys this connection puts, else run until the deadline
+    std::vector<uint64_t> prefill;
+    clock_type::time_point deadline{};
+};
+
+static net::awaitable<void> run_connection(Connection c) {
+    beast::tcp_stream stream(co_await net::this_coro::executor);
+    beast::flat_buffer buffer;
+    bool connected = false;
+    std::discrete_distribution<int> pick(c.cfg.mix.begin(), c.cfg.mix.end());
+    std::uniform_int_distribution<uint64_t> size_dist(c.cfg.min_size, c.cfg.max_size);
+    size_t next_prefill = 0;
+
+    for (;;) {
+        Op op;
+        uint64_t key;
+        if (c.deadline == clock_type::time_point{}) {
+            if (next_prefill == c.prefill.size())
+                break;
+            op = PUT;
+            key = c.prefill[next_prefill++];
+        } else {
+            if (clock_type::now() >= c.deadline)
+                break;
+            op = static_cast<Op>(pick(c.rng));
+            key = c.rng() % c.cfg.keys;
+        }
+
+        auto& s = c.stats[op];
+        auto start = clock_type::now();
+        try {
+            if (!connected) {
+                co_await stream.async_connect(c.ep, net::use_awaitable);
+                stream.socket().set_option(net::ip::tcp::no_delay(true));
+                connected = true;
+            }
+            bool keep_alive = true;
+            auto status = co_await send(c.cfg, stream, buffer, op, key, c.payload, size_dist(c.rng), s.bytes, keep_alive);
+            s.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count());
+            if (status == 404)
+                s.not_found++;
+            else if (status >= 400)
+                s.errors++;
+            if (!keep_alive) {
+                stream.close();
+                connected = false;
+            }
+        } catch (const std::exception&) {
+            s.errors++;
+            stream.close();
+            buffer.clear();
+            connected = false;
+        }
+    }
+    if (connected)
+        stream.socket().shutdown(net::ip::tcp::socket::shutdown_both);
+}
+
+// Runs the connections spread over cfg.threads io_contexts, `setup(i)`
+// makes connection i. Returns the stats of all of them.
+template<class Setup>
+static Stats run(const Config& cfg, Setup setup) {
+    std::vector<Stats> per_thread(cfg.threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < cfg.threads; ++t) {
+        threads.emplace_back([&, t] {
+            net::io_context ioc(1);
+            for (int i = t; i < cfg.connections; i += cfg.threads)
+                net::co_spawn(ioc, run_connection(setup(i, per_thread[t])), net::detached);
+            ioc.run();
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    Stats total;
+    for (auto& s : per_thread)
+        for (int op = 0; op < OP_COUNT; ++op)
+            total[op].merge(s[op]);
+    return total;
+}
+
+static void print_op(std::ostream& os, const OpStats& s, double secs) {
+    char buf[320];
+    std::snprintf(buf, sizeof(buf),
+                  "{\"requests\": %lu, \"errors\": %lu, \"not_found\": %lu, \"req_per_sec\": %.1f, "
+                  "\"mib_per_sec\": %.2f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+                  (unsigned long)s.latency.total, (unsigned long)s.errors, (unsigned long)s.not_found,
+                  s.latency.total / secs, s.bytes / secs / (1 << 20), s.latency.percentile(0.5) / 1e3,
+                  s.latency.percentile(0.99) / 1e3, s.latency.percentile(0.999) / 1e3);
+    os << buf;
+}
+
+static bool can_connect(const net::ip::tcp::endpoint& ep) {
+    net::io_context ioc;
+    net::ip::tcp::socket s(ioc);
+    beast::error_code ec;
+    s.connect(ep, ec);
+    return !ec;
+}
+
+// Starts `cfg.spawn` on cfg.dir and waits for it to accept connections
+static pid_t spawn_lobos(const Config& cfg, const net::ip::tcp::endpoint& ep) {
+    std::vector<std::string> args{cfg.spawn, "-d", cfg.dir, "-p", std::to_string(cfg.port)};
+    std::stringstream ss(cfg.lobos_args);
+    for (std::string a; ss >> a;)
+        args.push_back(a);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Keep stdout for the JSON
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        std::vector<char*> argv;
+        for (auto& a : args)
+            argv.push_back(a.data());
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        std::perror("execv");
+        _exit(127);
+    }
+    // The index may have to be built first
+    for (int i = 0; i < 1200; ++i) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            std::cerr << "Error: " << cfg.spawn << " exited before accepting connections" << std::endl;
+            std::exit(1);
+        }
+        if (can_connect(ep))
+            return pid;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    std::cerr << "Error: " << cfg.spawn << " isn't accepting connections on " << ep << std::endl;
+    kill(pid, SIGTERM);
+    std::exit(1);
+}
+
+static void print_help_and_exit() {
+    std::cout <<
+        "Usage: loadgen [options]\n"
+        "  -H, --host <ip>            lobos address (default: 127.0.0.1)\n"
+        "  -p, --port <port>          lobos port (default: 8080)\n"
+        "  -b, --bucket <name>        Bucket, the name of lobos' --dir\n"
+        "  -t, --threads <n>          Client threads (default: 2)\n"
+        "  -c, --connections <n>      Connections, spread over the threads (default: 64)\n"
+        "  -d, --duration <sec>       How long to run the mix for (default: 10)\n"
+        "  -k, --keys <n>             Key space (default: 10000)\n"
+        "  -s, --size <size>[-<size>] Object size or uniform range, K/M/G suffixes (default: 4K)\n"
+        "  -m, --mix <op=w,...>       Weights of get, put, head, delete and list\n"
+        "                             (default: get=90,put=10)\n"
+        "  -n, --no-prefill           Don't put every key before the run\n"
+        "  -S, --spawn <lobos>        Start this lobos binary for the run and stop it after\n"
+        "  -D, --dir <dir>            Its --dir (default: a scratch dir, removed after)\n"
+        "  -a, --lobos-args <args>    More options for it, e.g. \"-e -t 4\"\n";
+    std::exit(0);
+}
+
+int main(int argc, char** argv) {
+    Config cfg;
+    static struct option long_opts[] = {
+        {"help",        no_argument,       nullptr, 'h'},
+        {"host",        required_argument, nullptr, 'H'},
+        {"port",        required_argument, nullptr, 'p'},
+        {"bucket",      required_argument, nullptr, 'b'},
+        {"threads",     required_argument, nullptr, 't'},
+        {"connections", required_argument, nullptr, 'c'},
+        {"duration",    required_argument, nullptr, 'd'},
+        {"keys",        required_argument, nullptr, 'k'},
+        {"size",        required_argument, nullptr, 's'},
+        {"mix",         required_argument, nullptr, 'm'},
+        {"no-prefill",  no_argument,       nullptr, 'n'},
+        {"spawn",       required_argument, nullptr, 'S'},
+        {"dir",         required_argument, nullptr, 'D'},
+        {"lobos-args",  required_argument, nullptr, 'a'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hH:p:b:t:c:d:k:s:m:nS:D:a:", long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = std::atoi(optarg); break;
+            case 'b': cfg.bucket = optarg; break;
+            case 't': cfg.threads = std::max(std::atoi(optarg), 1); break;
+            case 'c': cfg.connections = std::max(std::atoi(optarg), 1); break;
+            case 'd': cfg.duration = std::max(std::atoi(optarg), 1); break;
+            case 'k': cfg.keys = std::max(std::stoull(optarg), 1ull); break;
+            case 's': cfg.size_spec = optarg; break;
+            case 'm': cfg.mix_spec = optarg; break;
+            case 'n': cfg.prefill = false; break;
+            case 'S': cfg.spawn = optarg; break;
+            case 'D': cfg.dir = optarg; break;
+            case 'a': cfg.lobos_args = optarg; break;
+            default: print_help_and_exit();
+        }
+    }
+    parse_mix(cfg);
+    auto dash = cfg.size_spec.find('-');
+    cfg.min_size = parse_size(cfg.size_spec.substr(0, dash));
+    cfg.max_size = dash == std::string::npos ? cfg.min_size : parse_size(cfg.size_spec.substr(dash + 1));
+    if (cfg.max_size < cfg.min_size)
+        std::swap(cfg.min_size, cfg.max_size);
+
+    bool scratch = false;
+    if (!cfg.spawn.empty() && cfg.dir.empty()) {
+        char tmpl[] = "/tmp/lobos-loadgen.XXXXXX";
+        if (!mkdtemp(tmpl)) {
+            std::perror("mkdtemp");
+            return 1;
+        }
+        cfg.dir = std::string(tmpl) + "/loadgen";
+        std::filesystem::create_directory(cfg.dir);
+        scratch = true;
+    }
+    if (cfg.bucket.empty())
+        cfg.bucket = std::filesystem::path(cfg.dir).filename().string();
+    if (cfg.bucket.empty()) {
+        std::cerr << "Error: must specify --bucket or --spawn" << std::endl;
+        return EINVAL;
+    }
+
+    net::ip::tcp::endpoint ep{net::ip::make_address(cfg.host), cfg.port};
+    pid_t lobos = cfg.spawn.empty() ? 0 : spawn_lobos(cfg, ep);
+
+    std::string payload(cfg.max_size, '\0');
+    std::mt19937_64 rng(42);
+    for (auto& c : payload)
+        c = rng();
+
+    if (cfg.prefill) {
+        run(cfg, [&](int i, Stats& s) {
+            Connection c{cfg, ep, s, payload, std::mt19937_64(i), {}};
+            for (uint64_t k = i; k < cfg.keys; k += cfg.connections)
+                c.prefill.push_back(k);
+            return c;
+        });
+    }
+
+    auto start = clock_type::now();
+    auto deadline = start + std::chrono::seconds(cfg.duration);
+    auto stats = run(cfg, [&](int i, Stats& s) {
+        Connection c{cfg, ep, s, payload, std::mt19937_64(1000 + i), {}};
+        c.deadline = deadline;
+        return c;
+    });
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+    if (lobos) {
+        kill(lobos, SIGTERM);
+        waitpid(lobos, nullptr, 0);
+    }
+    if (scratch)
+        std::filesystem::remove_all(std::filesystem::path(cfg.dir).parent_path());
+
+    OpStats total;
+    for (auto& s : stats)
+        total.merge(s);
+
+    auto& os = std::cout;
+    os << "{\n  \"config\": {\"threads\": " << cfg.threads << ", \"connections\": " << cfg.connections
+       << ", \"duration_s\": " << cfg.duration << ", \"keys\": " << cfg.keys << ", \"size\": \"" << cfg.size_spec
+       << "\", \"mix\": \"" << cfg.mix_spec << "\"},\n  \"elapsed_s\": " << elapsed.count() << ",\n  \"total\": ";
+    print_op(os, total, elapsed.count());
+    os << ",\n  \"ops\": {";
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        if (!stats[op].latency.total)
+            continue;
+        os << (first ? "\n" : ",\n") << "    \"" << op_names[op] << "\": ";
+        print_op(os, stats[op], elapsed.count());
+        first = false;
+    }
+    os << "\n  }\n}" << std::endl;
+}
@@ -0,0 +1,407 @@
+// CPU cost of the request path outside of the socket and the disk: target
+// parsing, headers, HEAD and GET through the server's handlers,
+// ListObjectsV2 rendering and index lookups/listings at a few index sizes,
+// with both index backends.
+//
+//   ./bench/request_bench [filter]
+//
+// Only cases whose name contains `filter` run. Each case is repeated until
+// it has run for 200ms, the time and heap allocations per call are averages.
+// Exits non-zero if a case that must not allocate did.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/beast/http.hpp>
+
+#include "../src/s3http/server.hpp"
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+
+static std::string_view filter;
+static int failures = 0;
+
+// Every operator new in the process, other threads' included
+static std::atomic<size_t> allocations{0};
+
+void* operator new(size_t n) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t n, std::align_val_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size_t a = static_cast<size_t>(align);
+    if (void* p = std::aligned_alloc(a, (n + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+// Keeps the compiler from dropping a result nobody reads
+template <class T>
+static void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static bool selected(const char* name) {
+    return std::string_view(name).find(filter) != std::string_view::npos;
+}
+
+// Prints the round of `iterations` calls once it ran for 200ms, false before
+// that. The earlier rounds warm up whatever gets recycled, with `no_allocs`
+// the last one must not have allocated at all.
+static bool report(const char* name, double seconds, size_t iterations, size_t allocated, bool no_allocs) {
+    if (seconds < 0.2)
+        return false;
+    std::printf("%-50s %10.1f ns %8.2f allocs %10zu runs\n", name, seconds * 1e9 / iterations,
+                double(allocated) / iterations, iterations);
+    if (no_allocs && allocated) {
+        std::fprintf(stderr, "FAIL: %s allocates\n", name);
+        ++failures;
+    }
+    return true;
+}
+
+// `fn` does one call per invocation
+template <class F>
+static void bench(const char* name, F&& fn, bool no_allocs = false) {
+    if (!selected(name))
+        return;
+    using clock = std::chrono::steady_clock;
+    size_t iterations = 1;
+    for (;;) {
+        size_t allocated = allocations;
+        auto start = clock::now();
+        for (size_t i = 0; i < iterations; ++i)
+            fn(i);
+        std::chrono::duration<double> elapsed = clock::now() - start;
+        if (report(name, elapsed.count(), iterations, allocations - allocated, no_allocs))
+            return;
+        iterations *= elapsed.count() < 0.02 ? 10 : 2;
+    }
+}
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// vllm@<model>@<world size>@<worker>@<chunk hash>, as LMCache writes them
+static std::string key_for(uint64_t i) {
+    char buf[96];
+    std::snprintf(buf, sizeof(buf), "vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@%u@%016lx.pt",
+                  (unsigned)(i % 4), (unsigned long)mix(i));
+    return buf;
+}
+
+static void parsing() {
+    static const std::string_view targets[][2] = {
+        {"QueryParams::parse/object", "/lmcache/vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@0@00c0ffee0badf00d.pt"},
+        {"QueryParams::parse/list", "/lmcache?list-type=2&prefix=vllm%40Qwen&delimiter=%2F&max-keys=1000"},
+        {"QueryParams::parse/upload_part", "/lmcache/big.bin?partNumber=17&uploadId=6d1f2a0c9b8e4f3a"},
+    };
+    RequestArena arena;
+    for (auto& [name, target] : targets) {
+        bench(std::string(name).c_str(), [&](size_t) {
+            arena.reset();
+            QueryParams params;
+            keep(params.parse(target, arena.resource()));
+        });
+    }
+
+    bench("target_key", [&](size_t) { keep(target_key(targets[0][1], "lmcache")); });
+
+    bench("parse_list_request", [&](size_t) {
+        arena.reset();
+        QueryParams params;
+        params.parse("/lmcache?list-type=2&prefix=vllm%40Qwen&delimiter=%2F&max-keys=1000"
+                     "&continuation-token=766c6c6d40517765", arena.resource());
+        ListRequest lr;
+        keep(parse_list_request(params, lr));
+    });
+}
+
+// Friend of S3HttpServer, hands it requests the way do_session does
+class RequestBench {
+    public:
+        static std::optional<S3HttpServer::response> read_now(S3HttpServer& server, arena_request<http::file_body>& req) {
+            return server.handle_read_now(req);
+        }
+        // Through handle_request's coroutine, on an io_context of its own
+        static S3HttpServer::response handle(S3HttpServer& server, arena_request<http::file_body>&& req) {
+            net::io_context ioc(1);
+            std::optional<S3HttpServer::response> res;
+            net::co_spawn(ioc, [&]() -> net::awaitable<void> {
+                res.emplace(co_await server.handle_request(std::move(req)));
+            }, [](std::exception_ptr e) {
+                if (e)
+                    std::rethrow_exception(e);
+            });
+            ioc.run();
+            return std::move(*res);
+        }
+};
+
+// The request as do_session has it once the header is read
+static arena_request<http::file_body> read_request(RequestArena& arena, std::string_view raw) {
+    arena_parser<http::file_body> parser{std::piecewise_construct, std::make_tuple(),
+                                         std::make_tuple(ArenaAllocator<char>(arena.resource()))};
+    beast::error_code ec;
+    parser.put(net::buffer(raw.data(), raw.size()), ec);
+    return parser.release();
+}
+
+// Serializes the headers of a HEAD or GET response, the payload would go
+// out with sendfile. 0 for anything but a 200 of those.
+static size_t header_bytes(S3HttpServer::response& r) {
+    return std::visit([](auto& res) -> size_t {
+        using T = std::decay_t<decltype(res)>;
+        if constexpr (std::is_same_v<T, arena_response<object_body>> || std::is_same_v<T, arena_response<http::empty_body>>) {
+            if (res.result() != http::status::ok)
+                return 0;
+            http::response_serializer<typename T::body_type, arena_fields> sr{res};
+            sr.split(true);
+            beast::error_code ec;
+            size_t bytes = 0;
+            do {
+                sr.next(ec, [&](beast::error_code&, const auto& buffers) {
+                    auto n = beast::buffer_bytes(buffers);
+                    bytes += n;
+                    sr.consume(n);
+                });
+            } while (!ec && !sr.is_header_done());
+            return bytes;
+        } else {
+            return 0;
+        }
+    }, r);
+}
+
+// Everything between the bytes of a HEAD or GET coming in and the bytes of
+// its response headers going out: the request parsed into the connection's
+// arena and answered by the server's handlers against a temp bucket holding
+// the object, once with the index and once on the filesystem with the stat
+// cache. A first request goes through handle_request to warm things up, the
+// ones after must be answered right away by handle_read_now. The arena is
+// reset between requests and the Date header is formatted once a second, so
+// none of them may allocate.
+static void dispatch() {
+    static const std::string_view requests[][2] = {
+        {"dispatch/head", "HEAD /lmcache/vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@0@00c0ffee0badf00d.pt HTTP/1.1\r\n"
+                          "Host: localhost:8000\r\n"
+                          "User-Agent: Boto3/1.40.0 md/Botocore#1.40.0 ua/2.1 os/linux\r\n"
+                          "X-Amz-Date: 20251017T120000Z\r\n"
+                          "X-Amz-Content-SHA256: UNSIGNED-PAYLOAD\r\n"
+                          "Authorization: AWS4-HMAC-SHA256 Credential=lobos/20251017/us-east-1/s3/aws4_request, "
+                          "SignedHeaders=host;x-amz-content-sha256;x-amz-date, Signature=0123456789abcdef\r\n"
+                          "\r\n"},
+        {"dispatch/get", "GET /lmcache/vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@0@00c0ffee0badf00d.pt?x-id=GetObject HTTP/1.1\r\n"
+                         "Host: localhost:8000\r\n"
+                         "User-Agent: Boto3/1.40.0 md/Botocore#1.40.0 ua/2.1 os/linux\r\n"
+                         "X-Amz-Date: 20251017T120000Z\r\n"
+                         "X-Amz-Content-SHA256: UNSIGNED-PAYLOAD\r\n"
+                         "Authorization: AWS4-HMAC-SHA256 Credential=lobos/20251017/us-east-1/s3/aws4_request, "
+                         "SignedHeaders=host;x-amz-content-sha256;x-amz-date, Signature=0123456789abcdef\r\n"
+                         "\r\n"},
+    };
+    struct Case {
+        std::string name;
+        std::string_view raw;
+        bool indexed;
+    };
+    std::vector<Case> cases;
+    for (bool indexed : {true, false}) {
+        for (auto& [name, raw] : requests) {
+            auto full = std::string(name) + (indexed ? "/index" : "/fs");
+            if (selected(full.c_str()))
+                cases.push_back({std::move(full), raw, indexed});
+        }
+    }
+    if (cases.empty())
+        return;
+
+    auto tmp = (std::filesystem::temp_directory_path() / "request_bench.XXXXXX").string();
+    if (!mkdtemp(tmp.data())) {
+        std::perror("mkdtemp");
+        ++failures;
+        return;
+    }
+    auto bucket = std::filesystem::path(tmp) / "lmcache";
+    std::filesystem::create_directory(bucket);
+    auto cwd = std::filesystem::current_path();
+    // The server works relative to its bucket
+    std::filesystem::current_path(bucket);
+    std::ofstream("vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@0@00c0ffee0badf00d.pt") << std::string(4096, 'x');
+
+    {
+        IndexStore store(0, bucket.string() + "/");
+        store.build(1);
+        while (!store.ready())
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        S3HttpServer indexed("127.0.0.1", 0, bucket.string(), &store);
+        ServerOptions opts;
+        opts.stat_cache_ttl = std::chrono::hours(1);
+        S3HttpServer fs("127.0.0.1", 0, bucket.string(), nullptr, opts);
+
+        for (auto& c : cases) {
+            auto& server = c.indexed ? indexed : fs;
+            RequestArena arena;
+            {
+                auto res = RequestBench::handle(server, read_request(arena, c.raw));
+                if (!header_bytes(res)) {
+                    std::fprintf(stderr, "FAIL: %s: not a 200\n", c.name.c_str());
+                    ++failures;
+                    continue;
+                }
+            }
+            size_t slow = 0;
+            bench(c.name.c_str(), [&](size_t) {
+                arena.reset();
+                auto req = read_request(arena, c.raw);
+                auto res = RequestBench::read_now(server, req);
+                if (!res) {
+                    ++slow;
+                    return;
+                }
+                keep(header_bytes(*res));
+            }, true);
+            if (slow) {
+                std::fprintf(stderr, "FAIL: %s: left to handle_request\n", c.name.c_str());
+                ++failures;
+            }
+        }
+        store.shutdown();
+    }
+
+    std::filesystem::current_path(cwd);
+    std::filesystem::remove_all(tmp);
+}
+
+static void headers() {
+    // First and last of the table, and what falls through all of it
+    static const std::string_view paths[][2] = {
+        {"mime_type/htm", "site/index.htm"},
+        {"mime_type/svgz", "icons/logo.svgz"},
+        {"mime_type/unknown", "vllm@Qwen_Qwen3-Coder-30B-A3B-Instruct@4@0@00c0ffee0badf00d.pt"},
+    };
+    for (auto& [name, path] : paths)
+        bench(std::string(name).c_str(), [&](size_t) { keep(mime_type(path)); });
+
+    bench("to_rfc1123", [](size_t i) { keep(to_rfc1123(1760000000 + i)); });
+    bench("to_iso8601", [](size_t i) { keep(to_iso8601(1760000000 + i)); });
+
+    Object o{4096, 1760000000, 'f'};
+    o.has_md5 = true;
+    bench("object_etag", [&](size_t) { keep(object_etag(o)); });
+}
+
+// A whole 1000 key ListObjectsV2 page, as the server sends it
+static size_t render(const IndexStore* index, std::optional<std::vector<FsListEntry>> entries, const std::string& prefix) {
+    ListRequest lr;
+    lr.prefix = lr.from = prefix;
+    auto next = list_objects_xml(index, "lmcache", std::move(lr), std::move(entries));
+    std::string out;
+    size_t bytes = 0;
+    bool more;
+    do {
+        more = next(out);
+        bytes += out.size();
+        out.clear();
+    } while (more);
+    return bytes;
+}
+
+static void index(size_t keys, bool compact) {
+    IndexStore store(0, "/nonexistent/", compact);
+    for (size_t i = 0; i < keys; ++i) {
+        Object o{(size_t)(mix(i) % (16 << 20)), (time_t)(1760000000 + i % 86400), 'f'};
+        o.has_md5 = i % 2;
+        store.add_entry(key_for(i), o);
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<std::string> hits, misses;
+    for (size_t i = 0; i < 4096; ++i) {
+        hits.push_back(key_for(rng() % keys));
+        misses.push_back(key_for(keys + i));
+    }
+
+    auto name = [&](const char* what) {
+        static std::string s;
+        s = std::string(what) + (compact ? "/compact/" : "/map/") + std::to_string(keys);
+        return s.c_str();
+    };
+    bench(name("IndexStore::get/hit"), [&](size_t i) {
+        Object o;
+        keep(store.get(hits[i % hits.size()], o));
+    });
+    bench(name("IndexStore::get/miss"), [&](size_t i) {
+        Object o;
+        keep(store.get(misses[i % misses.size()], o));
+    });
+    // 1000 keys from a random place, what a listing page walks
+    bench(name("IndexStore::for_each_prefix/1000"), [&](size_t i) {
+        size_t n = 0;
+        store.for_each_prefix("vllm@", hits[i % hits.size()], [&](const std::string&, const Object&) {
+            return ++n < 1000;
+        });
+        keep(n);
+    });
+    bench(name("list_objects_xml/index/1000"), [&](size_t) {
+        keep(render(&store, std::nullopt, "vllm@"));
+    });
+}
+
+static void listing() {
+    std::vector<FsListEntry> entries;
+    for (size_t i = 0; i < 1000; ++i)
+        entries.push_back({key_for(i), false, 4096, (time_t)1760000000, "\"0123456789abcdef0123456789abcdef\""});
+    std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return a.key < b.key; });
+    // Copying the entries in is part of the time, the server moves them
+    bench("list_objects_xml/fs/1000", [&](size_t) {
+        keep(render(nullptr, entries, ""));
+    });
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1)
+        filter = argv[1];
+    parsing();
+    dispatch();
+    headers();
+    listing();
+    for (size_t keys : {1000, 100000, 1000000}) {
+        index(keys, false);
+        index(keys, true);
+    }
+    if (failures) {
+        std::fprintf(stderr, "request_bench: %d cases failed\n", failures);
+        return 1;
+    }
+}
@@ -0,0 +1,191 @@
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "crawler.hpp"
+
+// glibc only got a getdents64 wrapper in 2.30
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+Crawler::Crawler(std::string root, int threads, emit_fn emit, const std::atomic<bool>* cancel, bool load_sums)
+    : root(std::move(root)), emit(std::move(emit)), cancel(cancel), load_sums(load_sums)
+{
+    if (threads < 1)
+        threads = 1;
+    workers.reserve(threads);
+    for (int i = 0; i < threads; ++i)
+        workers.emplace_back(std::make_unique<Worker>());
+}
+
+void Crawler::push_dir(size_t id, std::string dir) {
+    pending.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard lock(workers[id]->mtx);
+    workers[id]->queue.push_back(std::move(dir));
+}
+
+bool Crawler::next_dir(size_t id, std::string& dir) {
+    {
+        // depth first on our own queue, keeps the dirent cache warm
+        std::lock_guard lock(workers[id]->mtx);
+        if (!workers[id]->queue.empty()) {
+            dir = std::move(workers[id]->queue.back());
+            workers[id]->queue.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+        auto& victim = *workers[(id + i) % workers.size()];
+        std::lock_guard lock(victim.mtx);
+        if (!victim.queue.empty()) {
+            // steal the oldest, it's the closest to the root so likely the biggest subtree
+            dir = std::move(victim.queue.front());
+            victim.queue.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Crawler::scan_dir(size_t id, const std::string& dir) {
+    int fd = dir.empty()
+        ? openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+        : openat(root_fd, dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return; // removed under our feet, nothing to index
+
+    dirs_.fetch_add(1, std::memory_order_relaxed);
+    std::string prefix = dir.empty() ? dir : dir + '/';
+    alignas(linux_dirent64) char buf[64 * 1024];
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+
+        for (long off = 0; off < n;) {
+            auto* d = reinterpret_cast<linux_dirent64*>(buf + off);
+            off += d->d_reclen;
+
+            const char* name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (is_lobos_internal(name))
+                continue;
+            if (d->d_type != DT_DIR && d->d_type != DT_REG && d->d_type != DT_UNKNOWN)
+                continue; // skip anything else
+
+            unsigned int mask = STATX_MTIME;
+            if (d->d_type != DT_DIR)
+                mask |= STATX_SIZE | STATX_TYPE;
+
+            struct statx stx;
+            if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &stx) != 0)
+                continue;
+
+            Object o;
+            o.last_modified = stx.stx_mtime.tv_sec;
+            if (d->d_type == DT_DIR || (d->d_type == DT_UNKNOWN && S_ISDIR(stx.stx_mode))) {
+                o.size = 0;
+                o.type = 'd';
+            } else if (S_ISREG(stx.stx_mode)) {
+                o.size = stx.stx_size;
+                o.type = 'f';
+                files_.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                continue;
+            }
+
+            std::string key = prefix + name;
+            if (o.type == 'd') {
+                push_dir(id, key);
+            } else if (load_sums) {
+                // Relative to the directory we have open, the full path
+                // only on kernels that can't do that
+                static std::atomic<bool> no_getxattrat{false};
+                if (no_getxattrat.load(std::memory_order_relaxed)
+                    || (!load_object_md5_at(fd, name, stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec, o) && errno == ENOSYS)) {
+                    no_getxattrat.store(true, std::memory_order_relaxed);
+                    load_object_md5(-1, (root + key).c_str(), stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec, o);
+                }
+            }
+            emit(std::move(key), o);
+        }
+    }
+    close(fd);
+}
+
+void Crawler::worker_loop(size_t id) {
+    std::string dir;
+    for (;;) {
+        if (next_dir(id, dir)) {
+            if (!cancel || !cancel->load(std::memory_order_relaxed))
+                scan_dir(id, dir);
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+            continue;
+        }
+        if (pending.load(std::memory_order_acquire) == 0)
+            return;
+        // Someone is still scanning and may push more work
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+void Crawler::run(
+    std::string start,
+    int progress_sec,
+    const std::function<void(uint64_t dirs, uint64_t files)>& progress
+) {
+    root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        std::cerr << "Crawler: cannot open " << root << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+
+    push_dir(0, std::move(start));
+
+    std::mutex done_mtx;
+    std::condition_variable done_cv;
+    size_t running = workers.size();
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers.size());
+    for (size_t i = 0; i < workers.size(); ++i) {
+        threads.emplace_back([&, i] {
+            worker_loop(i);
+            std::lock_guard lock(done_mtx);
+            if (--running == 0)
+                done_cv.notify_one();
+        });
+    }
+
+    {
+        std::unique_lock lock(done_mtx);
+        if (!progress || progress_sec <= 0) {
+            done_cv.wait(lock, [&] { return running == 0; });
+        } else {
+            while (!done_cv.wait_for(lock, std::chrono::seconds(progress_sec), [&] { return running == 0; }))
+                progress(dirs(), files());
+        }
+    }
+
+    for (auto& t : threads)
+        t.join();
+
+    close(root_fd);
+    root_fd = -1;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "index.hpp"
+
+// Parallel directory walker used to (re)build the index.
+//
+// Every worker owns a deque of directories to scan. A worker pops from the
+// back of its own deque and steals from the front of the others when it runs
+// dry. Directories are read with getdents64 and each entry costs a single
+// statx, d_type tells us whether it's a directory so we never stat twice.
+class Crawler {
+    public:
+        // `name` is relative to the root, i.e. the object key
+        using emit_fn = std::function<void(std::string&& name, const Object& o)>;
+
+        // Setting `*cancel` to true makes the workers bail out early.
+        // `load_sums` reads the ETag of every file from its xattr.
+        Crawler(std::string root, int threads, emit_fn emit, const std::atomic<bool>* cancel = nullptr,
+                bool load_sums = true);
+        ~Crawler() {};
+
+        // Walks `start` (relative to root, empty for the root itself)
+        // Blocks until everything below it is scanned. `progress` is called
+        // from the calling thread about every `progress_sec` seconds.
+        void run(
+            std::string start = "",
+            int progress_sec = 5,
+            const std::function<void(uint64_t dirs, uint64_t files)>& progress = nullptr
+        );
+
+        uint64_t dirs() const { return dirs_.load(std::memory_order_relaxed); }
+        uint64_t files() const { return files_.load(std::memory_order_relaxed); }
+
+    private:
+        struct alignas(64) Worker {
+            std::mutex mtx;
+            std::deque<std::string> queue;
+        };
+
+        void worker_loop(size_t id);
+        bool next_dir(size_t id, std::string& dir);
+        void push_dir(size_t id, std::string dir);
+        void scan_dir(size_t id, const std::string& dir);
+
+        std::string root;
+        int root_fd = -1;
+        emit_fn emit;
+        const std::atomic<bool>* cancel;
+        bool load_sums;
+        std::vector<std::unique_ptr<Worker>> workers;
+
+        // directories queued or being scanned, the crawl is over at 0
+        std::atomic<uint64_t> pending{0};
+        std::atomic<uint64_t> dirs_{0};
+        std::atomic<uint64_t> files_{0};
+};
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include "evictor.hpp"
+
+// How often we look at the index size when nobody pokes us
+#define EVICTOR_POLL_MS 1000
+
+// Objects are ranked by their last GET, or their mtime when there's none
+static uint32_t coldness(const Object& o) {
+    auto t = o.last_access.load();
+    return t ? t : (uint32_t)o.last_modified;
+}
+
+// Histogram bucket for something `age` seconds cold: exact up to 16s, then
+// 16 buckets per power of two. Bounded at 976 buckets whatever the spread of
+// the mtimes, the exact order is only needed within the last bucket taken.
+static constexpr size_t age_buckets = 976;
+static size_t age_bucket(uint64_t age) {
+    if (age < 16)
+        return age;
+    int log = 63 - __builtin_clzll(age);
+    return (log - 3) * 16 + ((age >> (log - 4)) & 15);
+}
+
+Evictor::Evictor(IndexStore& store, uint64_t high, uint64_t low, evict_fn evict)
+    : store(store), high(high), low(std::min(low, high)), evict(std::move(evict))
+{
+    thread = std::thread([this] { run(); });
+}
+
+Evictor::~Evictor() {
+    {
+        std::lock_guard lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void Evictor::poke() {
+    if (store.bytes() > high)
+        cv.notify_one();
+}
+
+void Evictor::run() {
+    std::unique_lock lock(mtx);
+    while (!stopping) {
+        cv.wait_for(lock, std::chrono::milliseconds(EVICTOR_POLL_MS));
+        if (stopping)
+            break;
+        lock.unlock();
+        // Until the index is complete its size means nothing
+        if (store.ready() && store.bytes() > high)
+            evict_round();
+        lock.lock();
+    }
+}
+
+void Evictor::evict_round() {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t total = store.bytes();
+    uint64_t target = total - low;
+    uint32_t now = std::time(nullptr);
+    auto age_of = [now](const Object& o) -> uint64_t {
+        auto t = coldness(o);
+        return now > t ? now - t : 0;
+    };
+
+    // First pass, how cold do we have to go to free `target` bytes
+    std::array<uint64_t, age_buckets> histogram{};
+    store.scan([&](const std::string&, const Object& o) {
+        if (o.type == 'f')
+            histogram[age_bucket(age_of(o))] += o.size;
+    });
+    size_t cutoff = age_buckets;
+    uint64_t sum = 0;
+    while (cutoff > 0 && sum < target)
+        sum += histogram[--cutoff];
+
+    // Second pass, everything at least that cold, coldest first
+    struct Candidate {
+        uint32_t coldness;
+        std::string key;
+        Object o;
+    };
+    std::vector<Candidate> candidates;
+    store.scan([&](const std::string& key, const Object& o) {
+        if (o.type == 'f' && age_bucket(age_of(o)) >= cutoff)
+            candidates.push_back({coldness(o), key, o});
+    });
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return a.coldness < b.coldness;
+    });
+
+    uint64_t objects = 0, bytes = 0;
+    for (auto& c : candidates) {
+        // DELETEs and overwrites may have done part of the job meanwhile
+        if (stopping || store.bytes() <= low)
+            break;
+        if (!evict(c.key, c.o))
+            continue;
+        objects++;
+        bytes += c.o.size;
+    }
+
+    rounds.fetch_add(1, std::memory_order_relaxed);
+    evicted_objects.fetch_add(objects, std::memory_order_relaxed);
+    evicted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Evicted " << objects << " objects (" << (bytes >> 20) << " MiB) in "
+              << elapsed.count() << " seconds, " << (store.bytes() >> 20) << " MiB left" << std::endl;
+}
+
+void Evictor::print_stats(std::ostream& os) const {
+    os << "Evictor: rounds=" << rounds.load(std::memory_order_relaxed)
+       << " objects=" << evicted_objects.load(std::memory_order_relaxed)
+       << " bytes=" << evicted_bytes.load(std::memory_order_relaxed)
+       << " high=" << high << " low=" << low << std::endl;
+}
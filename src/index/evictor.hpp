@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include "index.hpp"
+
+// Keeps the bucket under a size bound for cache workloads (LMCache's remote
+// tier) instead of letting it grow until PUTs fail.
+//
+// Once the index accounts for more than `high` bytes the coldest objects are
+// deleted until it's back under `low`. Cold means the oldest last GET, or
+// mtime for objects not read since lobos started. Picking them takes two
+// passes over the index, one shard locked at a time: a histogram of bytes
+// per access second to find the cutoff, then the keys under it. Runs on its
+// own thread, requests never wait for it.
+class Evictor {
+    public:
+        // Deletes `key` which the index saw as `o`. Returns false when the
+        // object changed since and must be kept.
+        using evict_fn = std::function<bool(const std::string& key, const Object& o)>;
+
+        Evictor(IndexStore& store, uint64_t high, uint64_t low, evict_fn evict);
+        ~Evictor();
+
+        // Wakes the evictor up right away if we're over the high watermark,
+        // cheap enough for every PUT
+        void poke();
+
+        void print_stats(std::ostream& os) const;
+
+    private:
+        void run();
+        void evict_round();
+
+        IndexStore& store;
+        uint64_t high;
+        uint64_t low;
+        evict_fn evict;
+
+        std::atomic<uint64_t> evicted_objects{0};
+        std::atomic<uint64_t> evicted_bytes{0};
+        std::atomic<uint64_t> rounds{0};
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::atomic<bool> stopping{false};
+        std::thread thread;
+};
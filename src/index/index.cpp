@@ -1,46 +1,580 @@
-#include <boost/filesystem.hpp>
+#include <cerrno>
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <unistd.h>
 
 #include "index.hpp"
+#include "crawler.hpp"
+#include "watcher.hpp"
+
+// from linux/ioprio.h which isn't always installed
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+#define SUMS_XATTR "user.lobos.sums"
+
+bool store_object_sums(int fd, ObjectSums& sums) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+    sums.size = st.st_size;
+    sums.mtime_sec = st.st_mtim.tv_sec;
+    sums.mtime_nsec = st.st_mtim.tv_nsec;
+    // Not all filesystems do user xattrs, we just won't have ETags there
+    return fsetxattr(fd, SUMS_XATTR, &sums, sizeof(sums), 0) == 0;
+}
+
+bool load_object_sums(int fd, const char* path, uint64_t size, int64_t mtime_sec, int64_t mtime_nsec, ObjectSums& sums) {
+    ssize_t n = fd >= 0 ? fgetxattr(fd, SUMS_XATTR, &sums, sizeof(sums))
+                        : lgetxattr(path, SUMS_XATTR, &sums, sizeof(sums));
+    return n == sizeof(sums) && sums.size == size && sums.mtime_sec == mtime_sec && sums.mtime_nsec == mtime_nsec;
+}
 
-namespace fs = boost::filesystem;
+// Whether `a` and `b` describe the same copy of an object
+static bool same_entry(const Object& a, const Object& b) {
+    return a.type == b.type && a.size == b.size && a.last_modified == b.last_modified
+        && a.segment == b.segment && a.offset == b.offset && a.has_md5 == b.has_md5
+        && a.md5 == b.md5 && a.etag_parts == b.etag_parts;
+}
+
+static bool md5_from_sums(bool found, const ObjectSums& sums, Object& o) {
+    o.has_md5 = found && sums.has_md5;
+    if (o.has_md5) {
+        std::copy(std::begin(sums.md5), std::end(sums.md5), o.md5.begin());
+        o.etag_parts = sums.etag_parts;
+    }
+    return o.has_md5;
+}
 
+bool load_object_md5(int fd, const char* path, int64_t mtime_sec, int64_t mtime_nsec, Object& o) {
+    ObjectSums sums;
+    return md5_from_sums(load_object_sums(fd, path, o.size, mtime_sec, mtime_nsec, sums), sums, o);
+}
+
+// getxattrat(2) has no glibc wrapper yet, same number on every arch
+#ifndef SYS_getxattrat
+#define SYS_getxattrat 464
+#endif
+
+bool load_object_md5_at(int dirfd, const char* name, int64_t mtime_sec, int64_t mtime_nsec, Object& o) {
+    ObjectSums sums;
+    // struct xattr_args from linux/xattr.h
+    struct {
+        uint64_t value;
+        uint32_t size;
+        uint32_t flags;
+    } args{reinterpret_cast<uintptr_t>(&sums), sizeof(sums), 0};
+    errno = 0;
+    long n = syscall(SYS_getxattrat, dirfd, name, AT_SYMLINK_NOFOLLOW, SUMS_XATTR, &args, sizeof(args));
+    bool found = n == sizeof(sums) && sums.size == o.size && sums.mtime_sec == mtime_sec && sums.mtime_nsec == mtime_nsec;
+    return md5_from_sums(found, sums, o);
+}
 
-// this is bad
-bool IndexStore::build_index_from_fs(std::string path_start) {
+IndexStore::IndexStore(int refresh_interval, std::string path_start, bool compact)
+    : path_start(std::move(path_start)), refresh_interval_sec(refresh_interval)
+{
+    for (auto& shard : shards)
+        shard.index = make_shard_index(compact);
+}
+
+IndexStore::~IndexStore() {
+    shutdown();
+}
+
+void IndexStore::set_snapshot(std::string path, int interval_sec) {
+    snapshot_path = std::move(path);
+    snapshot_interval_sec = interval_sec;
+}
+
+void IndexStore::shutdown() {
+    {
+        std::lock_guard lock(stop_mtx);
+        if (stopping)
+            return;
+        stopping = true;
+    }
+    stop_cv.notify_all();
+    if (build_thread.joinable())
+        build_thread.join();
+    if (watcher)
+        watcher->stop();
+    save_snapshot();
+}
+
+void IndexStore::request_reconcile() {
+    {
+        std::lock_guard lock(stop_mtx);
+        reconcile_requested = true;
+    }
+    stop_cv.notify_all();
+}
+
+void IndexStore::build(int threads) {
     build_in_progress = true;
-    path_start = path_start + '/';
-    for (const auto& entry : fs::recursive_directory_iterator(path_start)) {
-        auto name = entry.path().string().substr(path_start.length());
 
-        char type;
-        if (fs::is_directory(entry.path())) {
-            type = 'd';
+    // Watch before crawling so nothing slips between the crawl and the watches
+    if (refresh_interval_sec > 0) {
+        watcher = std::make_unique<Watcher>(*this, path_start);
+        if (!watcher->start())
+            watcher.reset();
+    }
+
+    build_thread = std::thread([this, threads] {
+        auto start = std::chrono::steady_clock::now();
+
+        if (!snapshot_path.empty() && load_snapshot()) {
+            if (watcher) {
+                // One shard locked at a time and no syscall under the lock,
+                // PUTs and DELETEs keep updating the index meanwhile
+                for (auto& shard : shards) {
+                    std::vector<std::string> dirs;
+                    {
+                        std::shared_lock lock(shard.mtx);
+                        for (auto c = shard.index->seek(""); c->valid(); c->next())
+                            if (c->value().type == 'd')
+                                dirs.push_back(c->key());
+                    }
+                    for (auto& d : dirs)
+                        watcher->add_watch(d);
+                }
+            }
+            finish_build();
+            std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start;
+            std::cout << "Index loaded from snapshot " << snapshot_path << " in "
+                      << elapsed_seconds.count() << " seconds with " << size() << " items" << std::endl;
+        } else if (build_index_from_fs(threads)) {
+            finish_build();
+            // A fresh crawl is always worth saving
+            saved_generation = ~0ULL;
+            std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start;
+            std::cout << "Index built in " << elapsed_seconds.count() << " seconds with " << size() << " items" << std::endl;
+        } else {
+            return;
         }
-        else if (fs::is_regular_file(entry.path())) {
-            type = 'f';
+
+        background_loop();
+    });
+}
+
+void IndexStore::background_loop() {
+    using clock = std::chrono::steady_clock;
+    bool snapshots = !snapshot_path.empty() && snapshot_interval_sec > 0;
+    bool refresh = refresh_interval_sec > 0;
+    auto next_snapshot = clock::now() + std::chrono::seconds(snapshot_interval_sec);
+    auto next_reconcile = clock::now() + std::chrono::seconds(refresh_interval_sec);
+
+    if (refresh) {
+        // Reconciliation is a safety net, stay out of the way of the server
+        pid_t tid = syscall(SYS_gettid);
+        setpriority(PRIO_PROCESS, tid, 19);
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    }
+
+    std::unique_lock lock(stop_mtx);
+    while (!stopping) {
+        auto wake = [this] { return stopping.load() || reconcile_requested.load(); };
+        if (!snapshots && !refresh) {
+            stop_cv.wait(lock, wake);
         } else {
-            // skip anything else
-            continue;
+            auto deadline = clock::time_point::max();
+            if (snapshots)
+                deadline = std::min(deadline, next_snapshot);
+            if (refresh)
+                deadline = std::min(deadline, next_reconcile);
+            stop_cv.wait_until(lock, deadline, wake);
         }
+        if (stopping)
+            break;
 
-        Object e;
-        e.last_modified = fs::last_write_time(entry);
-        if (type == 'f')
-            e.size = fs::file_size(entry.path());
-        else
-            e.size = 0; //for dirs we don't care about size?
+        auto now = clock::now();
+        bool do_reconcile = reconcile_requested.exchange(false) || (refresh && now >= next_reconcile);
+        bool do_snapshot = snapshots && now >= next_snapshot;
+        lock.unlock();
+        if (do_reconcile) {
+            reconcile();
+            next_reconcile = clock::now() + std::chrono::seconds(refresh_interval_sec);
+        }
+        if (do_snapshot) {
+            save_snapshot();
+            next_snapshot = clock::now() + std::chrono::seconds(snapshot_interval_sec);
+        }
+        lock.lock();
+    }
+}
+
+void IndexStore::reconcile() {
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::lock_guard lock(deleted_mtx);
+        build_in_progress = true;
+    }
 
-        e.type = type;
-        // e.path = fs::absolute(entry.path().lexically_normal()).string();
+    // Only keep a hash per key seen, a copy of every key would double
+    // the memory footprint of the index
+    std::mutex seen_mtx;
+    std::vector<size_t> seen;
+    seen.reserve(size());
+    std::atomic<uint64_t> updated{0};
 
-        index.emplace(name, e);
+    Crawler crawler(path_start, 2, [&](std::string&& name, const Object& o) {
+        Object cur;
+        bool known = get(name, cur);
+        // A file next to a packed object is a leftover of the PUT that
+        // replaced it, about to go away
+        bool packed = known && cur.segment;
+        if (!packed && (!known || cur.type != o.type || cur.size != o.size
+            || (o.type == 'f' && cur.last_modified != o.last_modified)
+            || (load_sums && (cur.has_md5 != o.has_md5 || cur.md5 != o.md5)))) {
+            // The crawl's stat may predate a PUT that landed since we
+            // looked, only replace the entry we compared against
+            bool had;
+            Object prev;
+            bool replaced = replace_entry_if(name, o, had, prev, [&](bool found, const Object& now) {
+                return found == known && (!found || same_entry(now, cur));
+            });
+            if (replaced) {
+                if (!known && o.type == 'd' && watcher)
+                    watcher->add_watch(name);
+                updated.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        size_t h = std::hash<std::string_view>{}(name);
+        std::lock_guard lock(seen_mtx);
+        seen.push_back(h);
+    }, &stopping, load_sums);
+    crawler.run("", 0);
+    if (stopping)
+        return;
+
+    // Whatever wasn't seen is gone, unless it showed up after the crawl went
+    // through its directory. Stat again before dropping it to be sure.
+    std::sort(seen.begin(), seen.end());
+    std::vector<std::string> gone;
+    for (auto& shard : shards) {
+        std::shared_lock lock(shard.mtx);
+        for (auto c = shard.index->seek(""); c->valid(); c->next()) {
+            if (!std::binary_search(seen.begin(), seen.end(), std::hash<std::string_view>{}(c->key())))
+                gone.push_back(c->key());
+        }
+    }
+    uint64_t removed = 0;
+    for (auto& name : gone) {
+        struct stat st;
+        if (fstatat(AT_FDCWD, (path_start + name).c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0
+            && remove_file_entry(name))
+            removed++;
     }
 
-    build_in_progress = false;
+    finish_build();
+
+    if (updated || removed) {
+        std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start;
+        std::cout << "Index reconciled in " << elapsed_seconds.count() << " seconds: "
+                  << updated.load() << " updated, " << removed << " removed" << std::endl;
+    }
+}
+
+bool IndexStore::build_index_from_fs(int threads) {
+    Crawler crawler(path_start, threads, [this](std::string&& name, const Object& o) {
+        if (watcher && o.type == 'd')
+            watcher->add_watch(name);
+        add_entry_if_absent(std::move(name), o);
+    }, &stopping, load_sums);
+    crawler.run("", 5, [](uint64_t dirs, uint64_t files) {
+        std::cout << "Index build in progress: " << dirs << " directories, "
+                  << files << " objects so far" << std::endl;
+    });
+    return !stopping;
+}
+
+void IndexStore::finish_build() {
+    // Anything deleted during the build might have been re-added by it
+    std::unordered_set<std::string> deleted;
+    {
+        std::lock_guard lock(deleted_mtx);
+        build_in_progress = false;
+        deleted.swap(deleted_during_build);
+    }
+    for (auto& name : deleted) {
+        struct stat st;
+        if (fstatat(AT_FDCWD, (path_start + name).c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+            remove_file_entry(name);
+    }
+
+    ready_.store(true, std::memory_order_release);
+}
+
+IndexStore::Shard& IndexStore::shard_for(std::string_view object) {
+    return shards[std::hash<std::string_view>{}(object) % shard_count];
+}
+
+const IndexStore::Shard& IndexStore::shard_for(std::string_view object) const {
+    return shards[std::hash<std::string_view>{}(object) % shard_count];
+}
+
+bool IndexStore::get(std::string_view object, Object& o) const {
+    auto& shard = shard_for(object);
+    std::shared_lock lock(shard.mtx);
+    return shard.index->get(object, o);
+}
+
+bool IndexStore::contains(std::string_view object) const {
+    auto& shard = shard_for(object);
+    std::shared_lock lock(shard.mtx);
+    Object o;
+    return shard.index->get(object, o);
+}
+
+void IndexStore::add_entry(std::string_view object, Object o) {
+    Object old;
+    replace_entry(object, std::move(o), old);
+}
+
+bool IndexStore::replace_entry(std::string_view object, Object o, Object& old) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    // PUTs overwrite existing objects so the entry must be replaced
+    bool found = shard.index->put(object, o, &old);
+    if (found)
+        account(old, -1);
+    account(o, 1);
+    generation.fetch_add(1, std::memory_order_relaxed);
+    return found;
+}
+
+bool IndexStore::replace_entry_if(std::string_view object, Object o, bool& found, Object& old,
+                                  const std::function<bool(bool, const Object&)>& commit) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    found = shard.index->get(object, old);
+    if (!commit(found, old))
+        return false;
+    shard.index->put(object, o, nullptr);
+    if (found)
+        account(old, -1);
+    account(o, 1);
+    generation.fetch_add(1, std::memory_order_relaxed);
     return true;
 }
 
-void IndexStore::add_entry(std::string object, Object o) {
-    index.insert(std::pair<std::string, Object>(object, o));
-}
\ No newline at end of file
+void IndexStore::with_lock(std::string_view object, const std::function<void()>& fn) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    fn();
+}
+
+void IndexStore::add_entry_if_absent(std::string&& object, Object o) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    if (shard.index->put_if_absent(object, o)) {
+        account(o, 1);
+        generation.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool IndexStore::remove_entry(std::string_view object) {
+    if (build_in_progress.load(std::memory_order_acquire)) {
+        std::lock_guard lock(deleted_mtx);
+        if (build_in_progress)
+            deleted_during_build.emplace(object);
+    }
+
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    bool removed = shard.index->update(object, [&](Object& o) {
+        account(o, -1);
+        return ShardIndex::edit::erase;
+    });
+    if (removed)
+        generation.fetch_add(1, std::memory_order_relaxed);
+    return removed;
+}
+
+bool IndexStore::remove_file_entry(std::string_view object) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    bool removed = false;
+    shard.index->update(object, [&](Object& o) {
+        if (o.segment)
+            return ShardIndex::edit::keep;
+        account(o, -1);
+        removed = true;
+        return ShardIndex::edit::erase;
+    });
+    if (removed)
+        generation.fetch_add(1, std::memory_order_relaxed);
+    return removed;
+}
+
+bool IndexStore::relocate(std::string_view object, uint32_t from_segment, uint64_t from_offset,
+                          uint32_t to_segment, uint64_t to_offset) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    bool moved = false;
+    shard.index->update(object, [&](Object& o) {
+        if (o.segment == from_segment && o.offset == from_offset) {
+            o.segment = to_segment;
+            o.offset = to_offset;
+            moved = true;
+        }
+        return ShardIndex::edit::keep;
+    });
+    return moved;
+}
+
+bool IndexStore::remove_entry_at(std::string_view object, uint32_t segment, uint64_t offset,
+                                 const std::function<void()>& on_removed) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    bool removed = false;
+    shard.index->update(object, [&](Object& o) {
+        if (o.segment != segment || o.offset != offset)
+            return ShardIndex::edit::keep;
+        account(o, -1);
+        removed = true;
+        return ShardIndex::edit::erase;
+    });
+    if (removed) {
+        generation.fetch_add(1, std::memory_order_relaxed);
+        if (on_removed)
+            on_removed();
+    }
+    return removed;
+}
+
+bool IndexStore::remove_file_entry_if(std::string_view object, size_t size, time_t mtime) {
+    auto& shard = shard_for(object);
+    std::unique_lock lock(shard.mtx);
+    bool removed = false;
+    shard.index->update(object, [&](Object& o) {
+        if (o.type != 'f' || o.segment || o.size != size || o.last_modified != mtime)
+            return ShardIndex::edit::keep;
+        account(o, -1);
+        removed = true;
+        return ShardIndex::edit::erase;
+    });
+    if (removed)
+        generation.fetch_add(1, std::memory_order_relaxed);
+    return removed;
+}
+
+void IndexStore::touch(std::string_view object, uint32_t now) const {
+    auto& shard = shard_for(object);
+    std::shared_lock lock(shard.mtx);
+    shard.index->touch(object, now);
+}
+
+void IndexStore::remove_entries(const std::vector<std::string>& objects) {
+    if (build_in_progress.load(std::memory_order_acquire)) {
+        std::lock_guard lock(deleted_mtx);
+        if (build_in_progress)
+            deleted_during_build.insert(objects.begin(), objects.end());
+    }
+
+    std::array<std::vector<const std::string*>, shard_count> by_shard;
+    for (auto& object : objects)
+        by_shard[std::hash<std::string_view>{}(object) % shard_count].push_back(&object);
+
+    for (size_t i = 0; i < shard_count; ++i) {
+        if (by_shard[i].empty())
+            continue;
+        std::unique_lock lock(shards[i].mtx);
+        size_t removed = 0;
+        for (auto* object : by_shard[i]) {
+            if (shards[i].index->update(*object, [&](Object& o) {
+                    account(o, -1);
+                    return ShardIndex::edit::erase;
+                }))
+                removed++;
+        }
+        if (removed)
+            generation.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void IndexStore::remove_prefix(std::string_view prefix) {
+    for (auto& shard : shards) {
+        std::unique_lock lock(shard.mtx);
+        size_t removed = shard.index->erase_prefix(prefix, [&](const Object& o) {
+            if (o.segment)
+                return false;
+            account(o, -1);
+            return true;
+        });
+        if (removed)
+            generation.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void IndexStore::scan(const std::function<void(const std::string&, const Object&)>& fn) const {
+    for (auto& shard : shards) {
+        std::shared_lock lock(shard.mtx);
+        for (auto c = shard.index->seek(""); c->valid(); c->next())
+            fn(c->key(), c->value());
+    }
+}
+
+size_t IndexStore::size() const {
+    size_t total = 0;
+    for (auto& shard : shards) {
+        std::shared_lock lock(shard.mtx);
+        total += shard.index->size();
+    }
+    return total;
+}
+
+void IndexStore::for_each_prefix(
+    std::string_view prefix,
+    std::string_view from,
+    const std::function<bool(const std::string&, const Object&)>& fn
+) const {
+    if (from < prefix)
+        from = prefix;
+
+    using cursor = std::unique_ptr<ShardIndex::Cursor>;
+    auto cmp = [](const cursor& a, const cursor& b) {
+        return a->key() > b->key();
+    };
+
+    // Shards are always locked in the same order and writers only ever hold
+    // a single shard so this can't deadlock.
+    std::vector<std::shared_lock<std::shared_mutex>> locks;
+    locks.reserve(shard_count);
+    std::vector<cursor> heap;
+    heap.reserve(shard_count);
+
+    for (auto& shard : shards) {
+        locks.emplace_back(shard.mtx);
+        auto c = shard.index->seek(from);
+        if (c->valid())
+            heap.push_back(std::move(c));
+    }
+    std::make_heap(heap.begin(), heap.end(), cmp);
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), cmp);
+        auto& c = heap.back();
+        if (c->key().compare(0, prefix.size(), prefix) != 0) {
+            heap.pop_back(); // this shard is past the prefix, drop it
+            continue;
+        }
+        if (!fn(c->key(), c->value()))
+            return;
+        c->next();
+        if (c->valid())
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        else
+            heap.pop_back();
+    }
+}
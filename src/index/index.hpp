@@ -1,24 +1,235 @@
+#pragma once
+
 #include <cstdlib>
-#include <string>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "shard_index.hpp"
+
+class Watcher;
+
+// Last GET of an object in seconds since the epoch, 0 when it wasn't read
+// since lobos started. GETs bump it under the shard's shared lock hence the
+// relaxed atomic, copies just take its current value.
+struct AccessTime {
+    mutable std::atomic<uint32_t> v{0};
+
+    AccessTime() = default;
+    AccessTime(const AccessTime& o) : v(o.load()) {}
+    AccessTime& operator=(const AccessTime& o) {
+        store(o.load());
+        return *this;
+    }
+    uint32_t load() const { return v.load(std::memory_order_relaxed); }
+    void store(uint32_t t) const { v.store(t, std::memory_order_relaxed); }
+};
 
 struct Object {
     size_t size;
     time_t last_modified;
     char type; // d -> directory; f -> file
+    bool has_md5 = false;
+    uint32_t etag_parts = 0; // multipart ETags are "<md5>-<parts>"
+    std::array<uint8_t, 16> md5{};
+    AccessTime last_access{};
+    // Packed objects (--pack-max-kb) live in segment file `segment` at
+    // `offset` instead of in a file of their own, 0 for plain files
+    uint32_t segment = 0;
+    uint64_t offset = 0;
     // std::string path;
 };
 
+// What lobos computed over an object's content when writing it, kept in the
+// user.lobos.sums xattr so ETags survive restarts and reindexing. Only valid
+// for the size and mtime it was recorded at: anything rewriting the file in
+// place changes its mtime and the stale sums are ignored.
+struct ObjectSums {
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint8_t  md5[16];
+    uint32_t etag_parts;
+    char     checksum_algo[8]; // x-amz-checksum-<algo>, empty when none
+    uint8_t  has_md5;
+    uint8_t  checksum_len;
+    uint8_t  checksum[32];
+};
+
+// Records `sums` for the file open at `fd`, size and mtime are taken from it
+bool store_object_sums(int fd, ObjectSums& sums);
+// Reads the sums of the file open at `fd`, or of `path` when `fd` is -1,
+// false if there are none or they don't match `size` and the mtime
+bool load_object_sums(int fd, const char* path, uint64_t size, int64_t mtime_sec, int64_t mtime_nsec, ObjectSums& sums);
+// Same but only fills the ETag part of `o`, `o.size` must be set
+bool load_object_md5(int fd, const char* path, int64_t mtime_sec, int64_t mtime_nsec, Object& o);
+// Same for `name` in the directory open at `dirfd`, without resolving the
+// whole path again. Fails with errno ENOSYS before Linux 6.13.
+bool load_object_md5_at(int dirfd, const char* name, int64_t mtime_sec, int64_t mtime_nsec, Object& o);
+
+// Names lobos keeps next to the objects for itself (in-flight PUTs, multipart
+// staging). They're never objects: not indexed, watched or listed.
+inline bool is_lobos_internal(std::string_view name) {
+    return name.starts_with(".lobos-");
+}
+
+// The index is split in shards keyed by the hash of the object name so that
+// every beast thread can hit it concurrently. Point lookups only lock a single
+// shard. Prefix walks lock all shards in shared mode and merge them back in
+// key order.
 class IndexStore {
     public:
-        IndexStore(int refresh_interval, std::string path_start) {
-            build_index_from_fs(path_start);
-        };
-        ~IndexStore() {};
-        std::map<std::string, Object, std::less<>> index;
-        void add_entry(std::string object, Object o);
+        // A non-zero `refresh_interval` keeps the index in sync with changes
+        // made by other applications: inotify events are applied as they
+        // come and a low priority crawl reconciles everything every
+        // `refresh_interval` seconds in case we missed some. `compact`
+        // picks the CompactIndex backend for the shards, see shard_index.hpp.
+        IndexStore(int refresh_interval, std::string path_start, bool compact = false);
+        ~IndexStore();
+
+        // Crawls the directory in the background with `threads` workers.
+        // Until ready() returns true the index is incomplete and lookups
+        // must go to the filesystem, writes can (and must) still be applied.
+        void build(int threads);
+        bool ready() const { return ready_.load(std::memory_order_acquire); }
+
+        // When set, build() first tries to load the index from the snapshot
+        // at `path` and only crawls if it's missing or stale. The snapshot is
+        // then rewritten every `interval_sec` seconds if the index changed.
+        void set_snapshot(std::string path, int interval_sec);
+        // Whether crawls read ETags from the files' sums xattr, an extra
+        // syscall per file that --disable-etags does without. Set before
+        // build().
+        void set_load_sums(bool on) { load_sums = on; }
+        bool loads_sums() const { return load_sums; }
+        bool save_snapshot();
+        // Stops the background work and writes a last snapshot
+        void shutdown();
+
+        bool get(std::string_view object, Object& o) const;
+        bool contains(std::string_view object) const;
+        void add_entry(std::string_view object, Object o);
+        // Same, returns whether there was an entry and hands it back in `old`
+        bool replace_entry(std::string_view object, Object o, Object& old);
+        // Only inserts if missing, used by the crawler so it never clobbers
+        // a fresher entry written by a PUT
+        void add_entry_if_absent(std::string&& object, Object o);
+        bool remove_entry(std::string_view object);
+        // Same but keeps packed objects, for callers that only know about
+        // the files: a missing file says nothing about those
+        bool remove_file_entry(std::string_view object);
+        // Points `object` to its new place in the segments if it's still at
+        // (`from_segment`, `from_offset`), false if it changed meanwhile
+        bool relocate(std::string_view object, uint32_t from_segment, uint64_t from_offset,
+                      uint32_t to_segment, uint64_t to_offset);
+        // Same, but only if `commit` agrees when called under the shard lock,
+        // with whether there was an entry and what it was. `found` and `old`
+        // are filled either way, returns whether `object` was replaced.
+        bool replace_entry_if(std::string_view object, Object o, bool& found, Object& old,
+                              const std::function<bool(bool found, const Object& old)>& commit);
+        // Runs `fn` with the shard of `object` locked for writing. The segment
+        // store numbers its records there so that their order is the order
+        // the index changes in; `fn` must not call back into the index.
+        void with_lock(std::string_view object, const std::function<void()>& fn);
+        // Removes `object` if it's still the packed copy at (`segment`,
+        // `offset`), `on_removed` is called under the shard lock if it was
+        bool remove_entry_at(std::string_view object, uint32_t segment, uint64_t offset,
+                             const std::function<void()>& on_removed = nullptr);
+        // Same for a plain file, if it's still `size` bytes modified at `mtime`
+        bool remove_file_entry_if(std::string_view object, size_t size, time_t mtime);
+        // Records a GET of `object` at `now` for the evictor, no-op when
+        // it's not indexed
+        void touch(std::string_view object, uint32_t now) const;
+        // Same for a batch, every shard is locked once
+        void remove_entries(const std::vector<std::string>& objects);
+        // Drops every entry starting with `prefix`, for directories going
+        // away. Packed objects don't live there and are kept.
+        void remove_prefix(std::string_view prefix);
+        size_t size() const;
+        // Sum of the indexed objects' sizes
+        uint64_t bytes() const { return total_bytes.load(std::memory_order_relaxed); }
+
+        // Asks the background thread for a reconciliation crawl asap
+        void request_reconcile();
+
+        // Calls `fn` on every entry starting with `prefix` in lexicographic
+        // order, beginning at the first key >= `from`. Stops as soon as `fn`
+        // returns false.
+        void for_each_prefix(
+            std::string_view prefix,
+            std::string_view from,
+            const std::function<bool(const std::string&, const Object&)>& fn
+        ) const;
+        void for_each_prefix(
+            std::string_view prefix,
+            const std::function<bool(const std::string&, const Object&)>& fn
+        ) const {
+            for_each_prefix(prefix, prefix, fn);
+        }
+
+        // Calls `fn` on every entry, in no particular order. Unlike
+        // for_each_prefix only one shard is locked at a time, writers are
+        // barely held back but it's not a consistent view of the index.
+        void scan(const std::function<void(const std::string&, const Object&)>& fn) const;
 
     private:
-        bool build_index_from_fs(std::string path_start);
-        bool build_in_progress;
-};
\ No newline at end of file
+        static constexpr size_t shard_count = 64;
+
+        void account(const Object& o, int64_t sign) {
+            if (o.type == 'f')
+                total_bytes.fetch_add(sign * (int64_t)o.size, std::memory_order_relaxed);
+        }
+
+        struct alignas(64) Shard {
+            mutable std::shared_mutex mtx;
+            std::unique_ptr<ShardIndex> index;
+        };
+
+        Shard& shard_for(std::string_view object);
+        const Shard& shard_for(std::string_view object) const;
+
+        bool build_index_from_fs(int threads);
+        bool load_snapshot();
+        void finish_build();
+        void background_loop();
+        void reconcile();
+
+        std::string path_start;
+        std::array<Shard, shard_count> shards;
+        std::atomic<uint64_t> total_bytes{0};
+
+        std::thread build_thread;
+        std::atomic<bool> ready_{false};
+        std::atomic<bool> build_in_progress{false};
+        // Keys deleted while the crawler runs, the crawler may have read
+        // them before the DELETE and re-added them behind our back
+        std::mutex deleted_mtx;
+        std::unordered_set<std::string> deleted_during_build;
+
+        std::string snapshot_path;
+        int snapshot_interval_sec = 0;
+        // bumped on every change so we don't rewrite identical snapshots
+        std::atomic<uint64_t> generation{0};
+        uint64_t saved_generation = 0;
+        std::mutex snapshot_mtx;
+
+        int refresh_interval_sec;
+        bool load_sums = true;
+        std::unique_ptr<Watcher> watcher;
+        std::atomic<bool> reconcile_requested{false};
+
+        std::atomic<bool> stopping{false};
+        std::mutex stop_mtx;
+        std::condition_variable stop_cv;
+};
@@ -0,0 +1,486 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include "index.hpp"
+#include "shard_index.hpp"
+
+namespace {
+
+class TreeIndex final : public ShardIndex {
+        using map_iter = std::map<std::string, Object, std::less<>>::const_iterator;
+
+    public:
+        class TreeCursor final : public Cursor {
+            public:
+                TreeCursor(map_iter it, map_iter end) : it(it), end(end) {}
+                bool valid() const override { return it != end; }
+                const std::string& key() const override { return it->first; }
+                const Object& value() const override { return it->second; }
+                void next() override { ++it; }
+
+            private:
+                map_iter it;
+                map_iter end;
+        };
+
+        size_t size() const override { return index.size(); }
+
+        bool get(std::string_view key, Object& o) const override {
+            auto it = index.find(key);
+            if (it == index.end())
+                return false;
+            o = it->second;
+            return true;
+        }
+
+        bool put(std::string_view key, const Object& o, Object* old) override {
+            auto it = index.find(key);
+            if (it == index.end()) {
+                index.emplace(std::string(key), o);
+                return false;
+            }
+            if (old)
+                *old = it->second;
+            it->second = o;
+            return true;
+        }
+
+        bool put_if_absent(std::string_view key, const Object& o) override {
+            // Snapshot loads and crawls mostly come in order, try the end first
+            if (index.empty() || index.rbegin()->first < key) {
+                index.emplace_hint(index.end(), std::string(key), o);
+                return true;
+            }
+            return index.try_emplace(std::string(key), o).second;
+        }
+
+        bool update(std::string_view key, const std::function<edit(Object&)>& fn) override {
+            auto it = index.find(key);
+            if (it == index.end())
+                return false;
+            if (fn(it->second) == edit::erase)
+                index.erase(it);
+            return true;
+        }
+
+        void touch(std::string_view key, uint32_t now) const override {
+            auto it = index.find(key);
+            // Hot objects are read many times a second, don't dirty the line for nothing
+            if (it != index.end() && it->second.last_access.load() != now)
+                it->second.last_access.store(now);
+        }
+
+        size_t erase_prefix(std::string_view prefix, const std::function<bool(const Object&)>& fn) override {
+            size_t removed = 0;
+            auto it = index.lower_bound(prefix);
+            while (it != index.end() && it->first.starts_with(prefix)) {
+                if (!fn(it->second)) {
+                    ++it;
+                    continue;
+                }
+                it = index.erase(it);
+                removed++;
+            }
+            return removed;
+        }
+
+        std::unique_ptr<Cursor> seek(std::string_view from) const override {
+            return std::make_unique<TreeCursor>(index.lower_bound(from), index.end());
+        }
+
+    private:
+        std::map<std::string, Object, std::less<>> index;
+};
+
+void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+uint64_t get_varint(const char*& p) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+}
+
+// Sorted blocks of at most block_entries keys. Each key is stored as the
+// length of the prefix it shares with the one before it, then the rest of
+// it, then whatever of its Object doesn't fit in Meta. The first key of a
+// block shares nothing so a lookup is a binary search on those and a walk
+// through a single block.
+//
+// Inserts and erases only re-encode the entries next to them, a full block
+// is split in two by re-encoding the first key of the second half.
+class CompactIndex final : public ShardIndex {
+    public:
+        size_t size() const override { return count; }
+
+        bool get(std::string_view key, Object& o) const override {
+            size_t b;
+            Walker w;
+            if (!locate(key, b, w))
+                return false;
+            o = w.object();
+            return true;
+        }
+
+        bool put(std::string_view key, const Object& o, Object* old) override {
+            size_t b;
+            Walker w;
+            bool found = locate(key, b, w);
+            if (found && old)
+                *old = w.object();
+            write(b, w, found, key, o);
+            return found;
+        }
+
+        bool put_if_absent(std::string_view key, const Object& o) override {
+            size_t b;
+            Walker w;
+            if (locate(key, b, w))
+                return false;
+            write(b, w, false, key, o);
+            return true;
+        }
+
+        bool update(std::string_view key, const std::function<edit(Object&)>& fn) override {
+            size_t b;
+            Walker w;
+            if (!locate(key, b, w))
+                return false;
+            Object o = w.object();
+            if (fn(o) == edit::erase)
+                erase(b, w);
+            else
+                write(b, w, true, key, o);
+            return true;
+        }
+
+        void touch(std::string_view key, uint32_t now) const override {
+            size_t b;
+            Walker w;
+            if (!locate(key, b, w))
+                return;
+            // Same as the map, only the shared lock is held
+            std::atomic_ref<uint32_t> last_access(const_cast<uint32_t&>(blocks[b].meta[w.i].last_access));
+            if (last_access.load(std::memory_order_relaxed) != now)
+                last_access.store(now, std::memory_order_relaxed);
+        }
+
+        size_t erase_prefix(std::string_view prefix, const std::function<bool(const Object&)>& fn) override {
+            std::vector<std::string> doomed;
+            for (auto c = seek(prefix); c->valid() && c->key().starts_with(prefix); c->next())
+                if (fn(c->value()))
+                    doomed.push_back(c->key());
+            for (auto& key : doomed)
+                update(key, [](Object&) { return edit::erase; });
+            return doomed.size();
+        }
+
+        std::unique_ptr<Cursor> seek(std::string_view from) const override {
+            auto c = std::make_unique<CompactCursor>(*this);
+            if (locate(from, c->b, c->w) || !c->w.done)
+                c->load();
+            else
+                c->next_block();
+            return c;
+        }
+
+    private:
+        static constexpr size_t block_entries = 64;
+
+        enum : uint8_t {
+            DIRECTORY = 1,
+            HAS_MD5 = 2,   // followed by the MD5 and a varint etag_parts
+            PACKED = 4,    // followed by varint segment and offset
+        };
+
+        // The fixed part of an Object: 48 bits of size, mtime and last
+        // access in seconds until 2106
+        struct Meta {
+            uint32_t size_lo;
+            uint16_t size_hi;
+            uint8_t flags;
+            uint8_t unused;
+            uint32_t mtime;
+            uint32_t last_access;
+        };
+        static_assert(sizeof(Meta) == 16);
+
+        struct Block {
+            std::string data;
+            std::vector<Meta> meta;
+        };
+
+        // Decodes a block one entry at a time
+        struct Walker {
+            const Block* block = nullptr;
+            size_t i = SIZE_MAX;
+            // Bytes of entry `i`, its extras start at `extras`
+            size_t start = 0;
+            size_t extras = 0;
+            size_t end = 0;
+            std::string key;
+            std::string prev;
+            // Walked past the last entry, `key` is still the last key
+            bool done = false;
+
+            void reset(const Block& b) {
+                block = &b;
+                i = SIZE_MAX;
+                start = extras = end = 0;
+                key.clear();
+                prev.clear();
+                done = false;
+            }
+
+            bool next() {
+                if (end >= block->data.size()) {
+                    done = true;
+                    return false;
+                }
+                std::swap(prev, key);
+                ++i;
+                start = end;
+                const char* base = block->data.data();
+                const char* p = base + start;
+                size_t shared = get_varint(p);
+                size_t len = get_varint(p);
+                key.assign(prev, 0, shared);
+                key.append(p, len);
+                p += len;
+                extras = p - base;
+                uint8_t flags = block->meta[i].flags;
+                if (flags & HAS_MD5) {
+                    p += 16;
+                    get_varint(p);
+                }
+                if (flags & PACKED) {
+                    get_varint(p);
+                    get_varint(p);
+                }
+                end = p - base;
+                return true;
+            }
+
+            std::string_view extras_bytes() const {
+                return std::string_view(block->data).substr(extras, end - extras);
+            }
+
+            Object object() const {
+                auto& m = block->meta[i];
+                Object o{(size_t)m.size_hi << 32 | m.size_lo, (time_t)m.mtime, m.flags & DIRECTORY ? 'd' : 'f'};
+                o.last_access.store(std::atomic_ref<uint32_t>(const_cast<uint32_t&>(m.last_access))
+                                        .load(std::memory_order_relaxed));
+                const char* p = block->data.data() + extras;
+                if (m.flags & HAS_MD5) {
+                    o.has_md5 = true;
+                    std::copy(p, p + 16, o.md5.begin());
+                    p += 16;
+                    o.etag_parts = get_varint(p);
+                }
+                if (m.flags & PACKED) {
+                    o.segment = get_varint(p);
+                    o.offset = get_varint(p);
+                }
+                return o;
+            }
+        };
+
+        class CompactCursor final : public Cursor {
+            public:
+                explicit CompactCursor(const CompactIndex& index) : index(index) {}
+                bool valid() const override { return valid_; }
+                const std::string& key() const override { return w.key; }
+                const Object& value() const override { return o; }
+                void next() override {
+                    if (w.next())
+                        load();
+                    else
+                        next_block();
+                }
+
+            private:
+                friend class CompactIndex;
+
+                void load() {
+                    valid_ = true;
+                    o = w.object();
+                }
+                void next_block() {
+                    valid_ = false;
+                    if (++b >= index.blocks.size())
+                        return;
+                    w.reset(index.blocks[b]);
+                    w.next();
+                    load();
+                }
+
+                const CompactIndex& index;
+                size_t b = 0;
+                Walker w;
+                Object o{};
+                bool valid_ = false;
+        };
+
+        static std::string_view first_key(const Block& b) {
+            const char* p = b.data.data();
+            get_varint(p);
+            size_t len = get_varint(p);
+            return {p, len};
+        }
+
+        static Meta make_meta(const Object& o) {
+            Meta m{};
+            m.size_lo = (uint32_t)o.size;
+            m.size_hi = (uint16_t)((uint64_t)o.size >> 32);
+            m.flags = (o.type == 'd' ? DIRECTORY : 0) | (o.has_md5 ? HAS_MD5 : 0) | (o.segment ? PACKED : 0);
+            m.mtime = (uint32_t)std::clamp<int64_t>(o.last_modified, 0, UINT32_MAX);
+            m.last_access = o.last_access.load();
+            return m;
+        }
+
+        static std::string make_extras(const Object& o) {
+            std::string extras;
+            if (o.has_md5) {
+                extras.append((const char*)o.md5.data(), o.md5.size());
+                put_varint(extras, o.etag_parts);
+            }
+            if (o.segment) {
+                put_varint(extras, o.segment);
+                put_varint(extras, o.offset);
+            }
+            return extras;
+        }
+
+        static void encode(std::string& out, std::string_view prev, std::string_view key, std::string_view extras) {
+            auto diff = std::mismatch(prev.begin(), prev.end(), key.begin(), key.end());
+            size_t shared = diff.first - prev.begin();
+            put_varint(out, shared);
+            put_varint(out, key.size() - shared);
+            out.append(key.substr(shared));
+            out.append(extras);
+        }
+
+        // Replaces bytes [from, to) of `b`, into a string of the exact size
+        // since blocks are long lived
+        static void splice(Block& b, size_t from, size_t to, std::string_view with) {
+            std::string data;
+            data.reserve(b.data.size() - (to - from) + with.size());
+            data.append(b.data, 0, from);
+            data.append(with);
+            data.append(b.data, to);
+            b.data = std::move(data);
+        }
+
+        // The block that holds `key` or would: the last one starting at or
+        // before it. `w` ends up on the first entry >= `key` or done.
+        bool locate(std::string_view key, size_t& b, Walker& w) const {
+            auto it = std::upper_bound(blocks.begin(), blocks.end(), key, [](std::string_view k, const Block& blk) {
+                return k < first_key(blk);
+            });
+            b = it == blocks.begin() ? 0 : it - blocks.begin() - 1;
+            if (blocks.empty()) {
+                w.done = true;
+                return false;
+            }
+            w.reset(blocks[b]);
+            while (w.next()) {
+                int c = w.key.compare(key);
+                if (c >= 0)
+                    return c == 0;
+            }
+            return false;
+        }
+
+        // Stores `o` where locate() left `w`: over its entry when `found`,
+        // else right before it
+        void write(size_t b, Walker& w, bool found, std::string_view key, const Object& o) {
+            auto extras = make_extras(o);
+            if (blocks.empty()) {
+                blocks.emplace_back();
+                encode(blocks[0].data, "", key, extras);
+                blocks[0].meta.push_back(make_meta(o));
+                count++;
+                return;
+            }
+            auto& block = blocks[b];
+            std::string bytes;
+            if (found) {
+                encode(bytes, w.prev, key, extras);
+                splice(block, w.start, w.end, bytes);
+                block.meta[w.i] = make_meta(o);
+                return;
+            }
+            if (w.done) {
+                encode(bytes, w.key, key, extras);
+                splice(block, block.data.size(), block.data.size(), bytes);
+                block.meta.push_back(make_meta(o));
+            } else {
+                // The entry after the new one is now relative to it
+                encode(bytes, w.prev, key, extras);
+                encode(bytes, key, w.key, w.extras_bytes());
+                splice(block, w.start, w.end, bytes);
+                block.meta.insert(block.meta.begin() + w.i, make_meta(o));
+            }
+            count++;
+            if (block.meta.size() > block_entries)
+                split(b);
+        }
+
+        void erase(size_t b, Walker& w) {
+            auto& block = blocks[b];
+            size_t i = w.i;
+            size_t start = w.start;
+            std::string prev = w.prev;
+            if (w.next()) {
+                std::string bytes;
+                encode(bytes, prev, w.key, w.extras_bytes());
+                splice(block, start, w.end, bytes);
+            } else {
+                splice(block, start, block.data.size(), "");
+            }
+            block.meta.erase(block.meta.begin() + i);
+            count--;
+            if (block.meta.empty())
+                blocks.erase(blocks.begin() + b);
+        }
+
+        void split(size_t b) {
+            auto& block = blocks[b];
+            size_t mid = block.meta.size() / 2;
+            Walker w;
+            w.reset(block);
+            while (w.next() && w.i < mid)
+                ;
+            Block second;
+            encode(second.data, "", w.key, w.extras_bytes());
+            second.data.append(block.data, w.end);
+            second.meta.assign(block.meta.begin() + mid, block.meta.end());
+            block.data.resize(w.start);
+            block.data.shrink_to_fit();
+            block.meta.resize(mid);
+            block.meta.shrink_to_fit();
+            blocks.insert(blocks.begin() + b + 1, std::move(second));
+        }
+
+        std::vector<Block> blocks;
+        size_t count = 0;
+};
+
+} // namespace
+
+std::unique_ptr<ShardIndex> make_shard_index(bool compact) {
+    if (compact)
+        return std::make_unique<CompactIndex>();
+    return std::make_unique<TreeIndex>();
+}
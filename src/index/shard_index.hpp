@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct Object;
+
+// What a shard of the index keeps its entries in, the caller does the
+// locking.
+//
+// The default is a std::map: quick to update, but every entry is a 128 byte
+// tree node plus a separate allocation for any key over 15 characters.
+// Keys of a bucket share long prefixes (LMCache's are all
+// "vllm@<model>@<rank>@<worker>@<hash>"), so --compact-index stores them
+// front-coded in sorted blocks instead, with 16 bytes of metadata per entry
+// and the ETag only for objects that have one.
+class ShardIndex {
+    public:
+        enum class edit { keep, erase };
+
+        // Walks the entries in key order, invalidated by any change
+        class Cursor {
+            public:
+                virtual ~Cursor() = default;
+                virtual bool valid() const = 0;
+                virtual const std::string& key() const = 0;
+                virtual const Object& value() const = 0;
+                virtual void next() = 0;
+        };
+
+        virtual ~ShardIndex() = default;
+
+        virtual size_t size() const = 0;
+        virtual bool get(std::string_view key, Object& o) const = 0;
+        // Inserts or replaces `key`. Returns whether it was there, with its
+        // previous value in `old` when not null.
+        virtual bool put(std::string_view key, const Object& o, Object* old) = 0;
+        // Returns false and leaves the entry alone when `key` is there
+        virtual bool put_if_absent(std::string_view key, const Object& o) = 0;
+        // Hands the entry of `key` to `fn` which may change it or ask for it
+        // to be erased. False when there's no such entry.
+        virtual bool update(std::string_view key, const std::function<edit(Object&)>& fn) = 0;
+        // Bumps the last access of `key`, only needs the shared lock
+        virtual void touch(std::string_view key, uint32_t now) const = 0;
+        // Erases the entries starting with `prefix` that `fn` returns true
+        // for, returns how many
+        virtual size_t erase_prefix(std::string_view prefix, const std::function<bool(const Object&)>& fn) = 0;
+        // Cursor on the first key >= `from`
+        virtual std::unique_ptr<Cursor> seek(std::string_view from) const = 0;
+};
+
+std::unique_ptr<ShardIndex> make_shard_index(bool compact);
@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.hpp"
+
+// On-disk snapshot of the index.
+//
+//   [header][record * count][keys blob]
+//
+// Records are sorted by key and point into the keys blob. Directories keep
+// the nanosecond mtime they had when the snapshot was taken: any file created,
+// removed or renamed in a directory bumps its mtime so stat'ing every directory
+// on load is enough to tell if the snapshot still matches what's on disk.
+// In-place rewrites of existing files by other applications aren't caught,
+// that's what the refresh is for.
+
+namespace {
+
+constexpr char snapshot_magic[8] = {'L', 'O', 'B', 'O', 'S', 'I', 'D', 'X'};
+constexpr uint32_t snapshot_version = 2;
+
+struct SnapshotHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t keys_offset;
+    uint64_t keys_size;
+    int64_t  root_mtime_sec;
+    int64_t  root_mtime_nsec;
+    uint64_t reserved;
+};
+static_assert(sizeof(SnapshotHeader) == 64);
+
+struct SnapshotRecord {
+    uint64_t key_offset;
+    uint32_t key_len;
+    uint32_t mtime_nsec; // directories only
+    uint64_t size;
+    int64_t  mtime_sec;
+    char     type;
+    uint8_t  has_md5;
+    char     pad[2];
+    uint32_t etag_parts;
+    uint8_t  md5[16];
+};
+static_assert(sizeof(SnapshotRecord) == 56);
+
+bool stat_mtime(const std::string& path, int64_t& sec, int64_t& nsec) {
+    struct statx stx;
+    if (statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW, STATX_MTIME, &stx) != 0)
+        return false;
+    sec = stx.stx_mtime.tv_sec;
+    nsec = stx.stx_mtime.tv_nsec;
+    return true;
+}
+
+bool write_all(int fd, const void* data, size_t len) {
+    auto p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+}
+
+bool IndexStore::save_snapshot() {
+    if (snapshot_path.empty() || !ready())
+        return false;
+
+    std::lock_guard guard(snapshot_mtx);
+    uint64_t gen = generation.load(std::memory_order_relaxed);
+    if (gen == saved_generation)
+        return true;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Directory mtimes are taken *before* copying the entries. A change racing
+    // with the copy then shows up as a newer mtime on load and the snapshot is
+    // thrown away instead of silently missing an object.
+    SnapshotHeader hdr{};
+    std::memcpy(hdr.magic, snapshot_magic, sizeof(hdr.magic));
+    hdr.version = snapshot_version;
+    hdr.record_size = sizeof(SnapshotRecord);
+    if (!stat_mtime(path_start, hdr.root_mtime_sec, hdr.root_mtime_nsec))
+        return false;
+
+    std::unordered_map<std::string, std::pair<int64_t, int64_t>> dir_mtimes;
+    for (auto& shard : shards) {
+        std::vector<std::string> dirs;
+        {
+            std::shared_lock lock(shard.mtx);
+            for (auto c = shard.index->seek(""); c->valid(); c->next())
+                if (c->value().type == 'd')
+                    dirs.push_back(c->key());
+        }
+        for (auto& d : dirs) {
+            int64_t sec, nsec;
+            if (stat_mtime(path_start + d, sec, nsec))
+                dir_mtimes.emplace(std::move(d), std::pair{sec, nsec});
+        }
+    }
+
+    std::vector<std::pair<std::string, Object>> entries;
+    for (auto& shard : shards) {
+        std::shared_lock lock(shard.mtx);
+        for (auto c = shard.index->seek(""); c->valid(); c->next())
+            entries.emplace_back(c->key(), c->value());
+    }
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
+    std::vector<SnapshotRecord> records;
+    records.reserve(entries.size());
+    std::string keys;
+    for (auto& [key, o] : entries) {
+        // Packed objects are recovered from their segments
+        if (o.segment)
+            continue;
+        SnapshotRecord r{};
+        r.key_offset = keys.size();
+        r.key_len = key.size();
+        r.size = o.size;
+        r.mtime_sec = o.last_modified;
+        r.type = o.type;
+        r.has_md5 = o.has_md5;
+        r.etag_parts = o.etag_parts;
+        std::copy(o.md5.begin(), o.md5.end(), r.md5);
+        if (o.type == 'd') {
+            auto it = dir_mtimes.find(key);
+            // Unknown mtime, can't ever validate so force a crawl on load
+            if (it == dir_mtimes.end()) {
+                r.mtime_sec = -1;
+            } else {
+                r.mtime_sec = it->second.first;
+                r.mtime_nsec = it->second.second;
+            }
+        }
+        keys.append(key);
+        records.push_back(r);
+    }
+
+    hdr.count = records.size();
+    hdr.keys_offset = sizeof(hdr) + records.size() * sizeof(SnapshotRecord);
+    hdr.keys_size = keys.size();
+
+    // Write aside and rename so a crash never leaves a torn snapshot behind
+    std::string tmp = snapshot_path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to write index snapshot " << tmp << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = write_all(fd, &hdr, sizeof(hdr))
+        && write_all(fd, records.data(), records.size() * sizeof(SnapshotRecord))
+        && write_all(fd, keys.data(), keys.size())
+        && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), snapshot_path.c_str()) != 0) {
+        std::cerr << "Failed to write index snapshot " << snapshot_path << ": " << std::strerror(errno) << std::endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    saved_generation = gen;
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start;
+    std::cout << "Index snapshot with " << hdr.count << " items written to " << snapshot_path
+              << " in " << elapsed_seconds.count() << " seconds" << std::endl;
+    return true;
+}
+
+bool IndexStore::load_snapshot() {
+    int fd = open(snapshot_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t len = st.st_size;
+    void* map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    auto fail = [&](const char* why) {
+        std::cout << "Ignoring index snapshot " << snapshot_path << ": " << why << std::endl;
+        munmap(map, len);
+        return false;
+    };
+
+    auto base = static_cast<const char*>(map);
+    auto hdr = reinterpret_cast<const SnapshotHeader*>(base);
+    if (std::memcmp(hdr->magic, snapshot_magic, sizeof(hdr->magic)) != 0
+        || hdr->version != snapshot_version
+        || hdr->record_size != sizeof(SnapshotRecord))
+        return fail("unknown format");
+    if (hdr->count > (len - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord)
+        || hdr->keys_offset != sizeof(SnapshotHeader) + hdr->count * sizeof(SnapshotRecord)
+        || hdr->keys_size > len - hdr->keys_offset)
+        return fail("truncated");
+
+    auto records = reinterpret_cast<const SnapshotRecord*>(base + sizeof(SnapshotHeader));
+    const char* keys = base + hdr->keys_offset;
+
+    // Cheap validation, one stat per directory
+    int64_t sec, nsec;
+    if (!stat_mtime(path_start, sec, nsec) || sec != hdr->root_mtime_sec || nsec != hdr->root_mtime_nsec)
+        return fail("bucket root changed");
+
+    std::array<std::vector<uint64_t>, shard_count> per_shard;
+    for (uint64_t i = 0; i < hdr->count; ++i) {
+        auto& r = records[i];
+        if (r.key_offset > hdr->keys_size || r.key_len > hdr->keys_size - r.key_offset)
+            return fail("corrupted record");
+        std::string_view key(keys + r.key_offset, r.key_len);
+        if (r.type == 'd') {
+            if (!stat_mtime(path_start + std::string(key), sec, nsec)
+                || sec != r.mtime_sec || nsec != r.mtime_nsec)
+                return fail("directory changed since snapshot");
+        }
+        per_shard[std::hash<std::string_view>{}(key) % shard_count].push_back(i);
+    }
+
+    // Records are sorted so each shard gets its keys in order, insert at the end
+    for (size_t s = 0; s < shard_count; ++s) {
+        auto& shard = shards[s];
+        std::unique_lock lock(shard.mtx);
+        for (auto i : per_shard[s]) {
+            auto& r = records[i];
+            Object o{r.size, (time_t)r.mtime_sec, r.type, r.has_md5 != 0, r.etag_parts};
+            std::copy(std::begin(r.md5), std::end(r.md5), o.md5.begin());
+            if (shard.index->put_if_absent(std::string_view(keys + r.key_offset, r.key_len), o))
+                account(o, 1);
+        }
+    }
+
+    munmap(map, len);
+    std::lock_guard guard(snapshot_mtx);
+    saved_generation = generation.load(std::memory_order_relaxed);
+    return true;
+}
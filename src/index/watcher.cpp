@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "watcher.hpp"
+#include "crawler.hpp"
+#include "index.hpp"
+
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM \
+                    | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+Watcher::Watcher(IndexStore& store, std::string root)
+    : store(store), root(std::move(root))
+{
+}
+
+Watcher::~Watcher() {
+    stop();
+}
+
+bool Watcher::start() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotify_fd < 0 || stop_fd < 0) {
+        std::cerr << "Index watcher disabled: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    add_watch("");
+    thread = std::thread([this] { run(); });
+    return true;
+}
+
+void Watcher::stop() {
+    if (thread.joinable()) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) < 0)
+            std::cerr << "Failed to stop index watcher: " << std::strerror(errno) << std::endl;
+        thread.join();
+    }
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    if (stop_fd >= 0)
+        close(stop_fd);
+    inotify_fd = stop_fd = -1;
+}
+
+void Watcher::add_watch(const std::string& dir) {
+    if (inotify_fd < 0)
+        return;
+
+    std::string path = root + dir;
+    int wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_MASK);
+    int err = errno;
+
+    std::lock_guard lock(mtx);
+    if (wd < 0) {
+        if (err == ENOSPC && !out_of_watches) {
+            // Only the periodic crawl will catch changes below this point
+            out_of_watches = true;
+            std::cerr << "Out of inotify watches (fs.inotify.max_user_watches), "
+                      << "some directories will only be refreshed by the periodic crawl" << std::endl;
+        }
+        return;
+    }
+    watches[wd] = dir;
+}
+
+void Watcher::handle_event(int wd, uint32_t mask, const char* name) {
+    if (mask & IN_Q_OVERFLOW) {
+        // We lost events, only a crawl can tell what changed
+        store.request_reconcile();
+        return;
+    }
+
+    std::string dir;
+    {
+        std::lock_guard lock(mtx);
+        auto it = watches.find(wd);
+        if (it == watches.end())
+            return;
+        if (mask & IN_IGNORED) {
+            watches.erase(it);
+            return;
+        }
+        dir = it->second;
+    }
+
+    if (name == nullptr || name[0] == '\0' || is_lobos_internal(name))
+        return;
+
+    std::string key = dir.empty() ? std::string(name) : dir + '/' + name;
+
+    // Don't trust the event, apply what's on disk right now
+    struct statx stx;
+    if (statx(AT_FDCWD, (root + key).c_str(), AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) != 0) {
+        store.remove_file_entry(key);
+        store.remove_prefix(key + '/');
+        return;
+    }
+
+    if (S_ISREG(stx.stx_mode)) {
+        Object o{stx.stx_size, (time_t)stx.stx_mtime.tv_sec, 'f'};
+        if (store.loads_sums())
+            load_object_md5(-1, (root + key).c_str(), stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec, o);
+        store.add_entry(key, o);
+    } else if (S_ISDIR(stx.stx_mode)) {
+        store.add_entry(key, Object{0, (time_t)stx.stx_mtime.tv_sec, 'd'});
+        if (mask & (IN_CREATE | IN_MOVED_TO)) {
+            // New or moved in directory, whatever is already in it won't
+            // generate events so index it now
+            add_watch(key);
+            Crawler crawler(root, 1, [this](std::string&& name, const Object& o) {
+                if (o.type == 'd')
+                    add_watch(name);
+                store.add_entry_if_absent(std::move(name), o);
+            }, nullptr, store.loads_sums());
+            crawler.run(key, 0);
+        }
+    }
+}
+
+void Watcher::run() {
+    alignas(struct inotify_event) char buf[64 * 1024];
+    pollfd fds[2] = {
+        {inotify_fd, POLLIN, 0},
+        {stop_fd, POLLIN, 0},
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Index watcher poll failed: " << std::strerror(errno) << std::endl;
+            return;
+        }
+        if (fds[1].revents)
+            return;
+
+        for (;;) {
+            ssize_t n = read(inotify_fd, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            for (ssize_t off = 0; off < n;) {
+                auto* ev = reinterpret_cast<struct inotify_event*>(buf + off);
+                off += sizeof(struct inotify_event) + ev->len;
+                handle_event(ev->wd, ev->mask, ev->len ? ev->name : nullptr);
+            }
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+class IndexStore;
+
+// Keeps the index in sync with changes made by other applications.
+//
+// One inotify watch per directory, events are applied on a dedicated thread.
+// Every event re-stats the path and applies whatever is on disk so the order
+// events come in (or lobos' own writes racing with them) doesn't matter.
+// When the kernel queue overflows or we run out of watches the store is asked
+// for a reconciliation crawl.
+class Watcher {
+    public:
+        Watcher(IndexStore& store, std::string root);
+        ~Watcher();
+
+        bool start();
+        void stop();
+
+        // `dir` is relative to the root, empty for the root itself
+        void add_watch(const std::string& dir);
+
+    private:
+        void run();
+        void handle_event(int wd, uint32_t mask, const char* name);
+
+        IndexStore& store;
+        std::string root;
+        int inotify_fd = -1;
+        int stop_fd = -1;
+        bool out_of_watches = false;
+
+        std::mutex mtx;
+        std::unordered_map<int, std::string> watches;
+        std::thread thread;
+};
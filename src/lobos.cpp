@@ -4,16 +4,40 @@
 #include <cstdlib>
 #include <iostream>
 #include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 
 #include "s3http/server.hpp"
 
 struct Config {
     bool lobos_index_enabled = false;
     int  lobos_index_refresh_sec = 0;
+    bool compact_index = false;
+    std::string index_snapshot;
+    int  index_snapshot_sec = 300;
     std::string lobos_dir;
     int port = 8080;
+    int metrics_port = 0;
+    int slow_request_ms = 0;
+    std::string trace_file;
+    int trace_sample = 100;
     int threads = 8;
     bool pin_threads = false;
+    bool zero_copy = true;
+    bool io_uring = false;
+    int blocking_threads = 4;
+    int blocking_queue_depth = 1024;
+    int cache_mb = 0;
+    int cache_max_object_kb = 1024;
+    int stat_cache_ms = 0;
+    Durability durability = Durability::none;
+    int durability_batch_ms = 5;
+    bool fallocate = false;
+    bool etags = true;
+    uint64_t max_bytes = 0;
+    int evict_low_pct = 90;
+    int pack_max_kb = 0;
 };
 
 void print_help_and_exit() {
@@ -27,6 +51,19 @@ void print_help_and_exit() {
         "      Directory for lobos to transform into a S3 bucket\n"
         "  -p, --port\n"
         "      Port to the HTTP server should listen on (default 8080)\n"
+        "  -P, --metrics-port <port>\n"
+        "      Serve Prometheus metrics at /metrics on this port: request\n"
+        "      latencies and bytes per S3 operation, connections, index and\n"
+        "      cache stats (default 0: disabled)\n"
+        "  -w, --slow-request-ms <ms>\n"
+        "      Log requests that took longer than <ms> to stderr with the time\n"
+        "      spent reading, committing, handling and answering them\n"
+        "      (default 0: disabled)\n"
+        "  -o, --trace-file <path>\n"
+        "      Write the phases of sampled requests to <path> as a Chrome trace,\n"
+        "      for chrome://tracing or ui.perfetto.dev\n"
+        "  -O, --trace-sample <n>\n"
+        "      Trace one request in <n> with --trace-file (default: 100)\n"
         "  -t, --threads\n"
         "      Number of threads to use. Too many threads will have a\n"
         "      detrimental impact on perf. (default: 8)\n"
@@ -35,9 +72,66 @@ void print_help_and_exit() {
         "  -e, --enable-lobos-index\n"
         "      (In development) Enable Lobos index\n"
         "  -r, --lobos-index-refresh-sec <sec>\n"
-        "      (Not implemented) Refresh interval in seconds\n"
-        "      This will re-sync the index while lobos is running to keep\n"
-        "      up with any changes made by other applications\n";
+        "      Keep the index in sync with changes made by other applications.\n"
+        "      Changes are picked up as they happen with inotify and the whole\n"
+        "      directory is re-crawled every <sec> seconds in case some were\n"
+        "      missed (default 0: disabled)\n"
+        "  -C, --compact-index\n"
+        "      Store the index in prefix-compressed blocks, several times smaller\n"
+        "      than the default tree for buckets with millions of objects.\n"
+        "      Needs --enable-lobos-index\n"
+        "  -z, --disable-zero-copy\n"
+        "      Send GetObject payloads through userspace instead of sendfile(2)\n"
+        "  -u, --io-uring\n"
+        "      Read and write object bodies through io_uring, one ring per thread.\n"
+        "      Requires a build with `make IO_URING=1`, falls back to regular\n"
+        "      file I/O when io_uring isn't available\n"
+        "  -b, --blocking-threads <n>\n"
+        "      Threads running blocking filesystem calls (mkdir, stat, unlink,\n"
+        "      readdir) off the server threads (default: 4)\n"
+        "  -q, --blocking-queue-depth <n>\n"
+        "      Max calls waiting for a blocking thread, past that they run on\n"
+        "      the server thread (default: 1024)\n"
+        "  -m, --cache-mb <MiB>\n"
+        "      Keep up to <MiB> of small objects in memory for GetObject.\n"
+        "      PUT/DELETE through lobos invalidate them, changes made by other\n"
+        "      applications aren't seen until the entry is evicted (default 0: disabled)\n"
+        "  -M, --cache-max-object-kb <KiB>\n"
+        "      Largest object the cache holds (default: 1024)\n"
+        "  -T, --stat-cache-ms <ms>\n"
+        "      Without the index, remember HEAD/GET stat results (404s included)\n"
+        "      for <ms>. Changes made by other applications can go unnoticed for\n"
+        "      that long (default 0: disabled)\n"
+        "  -D, --durability <none|batch|sync>\n"
+        "      PUTs are always written aside and renamed into place. What's on\n"
+        "      disk before they're acknowledged: none leaves it to the page cache,\n"
+        "      batch group-commits all PUTs with one syncfs every few ms, sync\n"
+        "      fsyncs every PUT (default: none)\n"
+        "  -B, --durability-batch-ms <ms>\n"
+        "      Group commit interval for --durability=batch (default: 5)\n"
+        "  -F, --fallocate\n"
+        "      Preallocate PUTs from their Content-Length\n"
+        "  -E, --disable-etags\n"
+        "      Don't compute MD5 ETags on PUT. Checksums clients ask for\n"
+        "      (x-amz-checksum-*, Content-MD5) are still computed and verified\n"
+        "  -x, --max-bytes <size>\n"
+        "      Cache mode: once the objects add up to <size> (K, M, G or T\n"
+        "      suffix) the least recently read ones are deleted. Needs\n"
+        "      --enable-lobos-index (default 0: unbounded)\n"
+        "  -l, --evict-low-pct <pct>\n"
+        "      Eviction stops once the bucket is back under <pct>% of\n"
+        "      --max-bytes (default: 90)\n"
+        "  -k, --pack-max-kb <KiB>\n"
+        "      Append PUTs up to <KiB> to large segment files in .lobos-segments/\n"
+        "      instead of creating a file per object. Packed objects are only\n"
+        "      visible through lobos. Needs --enable-lobos-index, serving starts\n"
+        "      once the index is built (default 0: disabled)\n"
+        "  -s, --index-snapshot <path>\n"
+        "      Load the index from this snapshot on start if it's still valid\n"
+        "      and write it back periodically and on shutdown. Must live\n"
+        "      outside of --dir\n"
+        "  -S, --index-snapshot-sec <sec>\n"
+        "      Snapshot interval in seconds, 0 only writes on shutdown (default: 300)\n";
     std::exit(0);
 }
 
@@ -73,6 +167,47 @@ void validate_lobos_dir(std::string& dir) {
         dir.push_back('/');
 }
 
+void validate_index_snapshot(std::string& snapshot, const std::string& dir) {
+    // We chdir into the bucket later on
+    snapshot = std::filesystem::absolute(snapshot).lexically_normal().string();
+
+    // Writing the snapshot would change the bucket and invalidate itself
+    auto bucket = std::filesystem::absolute(dir).lexically_normal().string();
+    if (snapshot.starts_with(bucket)) {
+        std::cerr << "Error: --index-snapshot must be outside of " << dir << std::endl;
+        std::exit(EINVAL);
+    }
+}
+
+Durability parse_durability(const std::string& mode) {
+    if (mode == "none")
+        return Durability::none;
+    if (mode == "batch")
+        return Durability::batch;
+    if (mode == "sync")
+        return Durability::sync;
+    std::cerr << "Error: --durability must be none, batch or sync" << std::endl;
+    std::exit(EINVAL);
+}
+
+// Bytes, with an optional K, M, G or T suffix (powers of 1024)
+uint64_t parse_size(const std::string& size) {
+    char* end;
+    uint64_t v = std::strtoull(size.c_str(), &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; ++end; break;
+        case 'M': case 'm': shift = 20; ++end; break;
+        case 'G': case 'g': shift = 30; ++end; break;
+        case 'T': case 't': shift = 40; ++end; break;
+    }
+    if (end == size.c_str() || *end != '\0') {
+        std::cerr << "Error: invalid size " << size << std::endl;
+        std::exit(EINVAL);
+    }
+    return v << shift;
+}
+
 Config parse_args(int argc, char** argv) {
     Config cfg;
 
@@ -80,15 +215,36 @@ Config parse_args(int argc, char** argv) {
         {"help",                    no_argument,       nullptr, 'h'},
         {"dir",                     required_argument, nullptr, 'd'},
         {"port",                    required_argument, nullptr, 'p'},
+        {"metrics-port",            required_argument, nullptr, 'P'},
+        {"slow-request-ms",         required_argument, nullptr, 'w'},
+        {"trace-file",              required_argument, nullptr, 'o'},
+        {"trace-sample",            required_argument, nullptr, 'O'},
         {"enable-lobos-index",      no_argument,       nullptr, 'e'},
         {"lobos-index-refresh-sec", required_argument, nullptr, 'r'},
+        {"compact-index",           no_argument,       nullptr, 'C'},
         {"threads",                 required_argument, nullptr, 't'},
         {"pin-threads-to-cpus",     no_argument,       nullptr, 'c'},
+        {"disable-zero-copy",       no_argument,       nullptr, 'z'},
+        {"io-uring",                no_argument,       nullptr, 'u'},
+        {"blocking-threads",        required_argument, nullptr, 'b'},
+        {"blocking-queue-depth",    required_argument, nullptr, 'q'},
+        {"cache-mb",                required_argument, nullptr, 'm'},
+        {"cache-max-object-kb",     required_argument, nullptr, 'M'},
+        {"stat-cache-ms",           required_argument, nullptr, 'T'},
+        {"durability",              required_argument, nullptr, 'D'},
+        {"durability-batch-ms",     required_argument, nullptr, 'B'},
+        {"fallocate",               no_argument,       nullptr, 'F'},
+        {"disable-etags",           no_argument,       nullptr, 'E'},
+        {"max-bytes",               required_argument, nullptr, 'x'},
+        {"evict-low-pct",           required_argument, nullptr, 'l'},
+        {"pack-max-kb",             required_argument, nullptr, 'k'},
+        {"index-snapshot",          required_argument, nullptr, 's'},
+        {"index-snapshot-sec",      required_argument, nullptr, 'S'},
         {nullptr, 0, nullptr, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "hd:p:er:t:c", long_opts, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hd:p:P:w:o:O:er:Ct:czub:q:m:M:T:D:B:FEx:l:k:s:S:", long_opts, nullptr)) != -1) {
         switch (opt) {
             case 'h':
                 print_help_and_exit();
@@ -99,23 +255,114 @@ Config parse_args(int argc, char** argv) {
             case 'p':
                 cfg.port = std::atoi(optarg);
                 break;
+            case 'P':
+                cfg.metrics_port = std::atoi(optarg);
+                break;
+            case 'w':
+                cfg.slow_request_ms = std::atoi(optarg);
+                break;
+            case 'o':
+                cfg.trace_file = std::string(optarg);
+                break;
+            case 'O':
+                cfg.trace_sample = std::atoi(optarg);
+                break;
             case 'e':
                 cfg.lobos_index_enabled = true;
                 break;
             case 'r':
                 cfg.lobos_index_refresh_sec = std::atoi(optarg);
                 break;
+            case 'C':
+                cfg.compact_index = true;
+                break;
             case 't':
                 cfg.threads = std::atoi(optarg);
                 break;
             case 'c':
                 cfg.pin_threads = true;
                 break;
+            case 'z':
+                cfg.zero_copy = false;
+                break;
+            case 'u':
+                cfg.io_uring = true;
+                break;
+            case 'b':
+                cfg.blocking_threads = std::atoi(optarg);
+                break;
+            case 'q':
+                cfg.blocking_queue_depth = std::atoi(optarg);
+                break;
+            case 'm':
+                cfg.cache_mb = std::atoi(optarg);
+                break;
+            case 'M':
+                cfg.cache_max_object_kb = std::atoi(optarg);
+                break;
+            case 'T':
+                cfg.stat_cache_ms = std::atoi(optarg);
+                break;
+            case 'D':
+                cfg.durability = parse_durability(optarg);
+                break;
+            case 'B':
+                cfg.durability_batch_ms = std::atoi(optarg);
+                break;
+            case 'F':
+                cfg.fallocate = true;
+                break;
+            case 'E':
+                cfg.etags = false;
+                break;
+            case 'x':
+                cfg.max_bytes = parse_size(optarg);
+                break;
+            case 'l':
+                cfg.evict_low_pct = std::atoi(optarg);
+                break;
+            case 'k':
+                cfg.pack_max_kb = std::atoi(optarg);
+                break;
+            case 's':
+                cfg.index_snapshot = std::string(optarg);
+                break;
+            case 'S':
+                cfg.index_snapshot_sec = std::atoi(optarg);
+                break;
             default:
                 print_help_and_exit();
         }
     }
     validate_lobos_dir(cfg.lobos_dir);
+    if (!cfg.index_snapshot.empty())
+        validate_index_snapshot(cfg.index_snapshot, cfg.lobos_dir);
+    // Eviction picks its victims from the index
+    if (cfg.max_bytes && !cfg.lobos_index_enabled) {
+        std::cerr << "Error: --max-bytes needs --enable-lobos-index" << std::endl;
+        std::exit(EINVAL);
+    }
+    // Packed objects only exist in the index
+    if (cfg.pack_max_kb > 0 && !cfg.lobos_index_enabled) {
+        std::cerr << "Error: --pack-max-kb needs --enable-lobos-index" << std::endl;
+        std::exit(EINVAL);
+    }
+    if (cfg.metrics_port < 0 || cfg.metrics_port > 65535 || (cfg.metrics_port && cfg.metrics_port == cfg.port)) {
+        std::cerr << "Error: --metrics-port must be a valid port other than --port" << std::endl;
+        std::exit(EINVAL);
+    }
+    if (cfg.trace_sample < 1) {
+        std::cerr << "Error: --trace-sample must be at least 1" << std::endl;
+        std::exit(EINVAL);
+    }
+    if (cfg.compact_index && !cfg.lobos_index_enabled) {
+        std::cerr << "Error: --compact-index needs --enable-lobos-index" << std::endl;
+        std::exit(EINVAL);
+    }
+    if (cfg.evict_low_pct < 1 || cfg.evict_low_pct > 100) {
+        std::cerr << "Error: --evict-low-pct must be between 1 and 100" << std::endl;
+        std::exit(EINVAL);
+    }
 
     return cfg;
 }
@@ -126,11 +373,26 @@ int main(int argc, char **argv) {
 
     std::cout << "====== OPTIONS ======== " << std::endl;
     std::cout << "port=" << cfg.port << std::endl;
+    std::cout << "metrics_port=" << cfg.metrics_port << std::endl;
+    std::cout << "slow_request_ms=" << cfg.slow_request_ms << std::endl;
+    std::cout << "trace_file=" << cfg.trace_file << std::endl;
     std::cout << "lobos_dir=" << cfg.lobos_dir << std::endl;
     std::cout << "lobos_index_enabled=" << cfg.lobos_index_enabled << std::endl;
     std::cout << "lobos_index_refresh_sec=" << cfg.lobos_index_refresh_sec << std::endl;
+    std::cout << "compact_index=" << cfg.compact_index << std::endl;
+    std::cout << "index_snapshot=" << cfg.index_snapshot << std::endl;
     std::cout << "beast threads=" << cfg.threads << std::endl;
     std::cout << "thread pinning=" << cfg.pin_threads << std::endl;
+    std::cout << "zero copy=" << cfg.zero_copy << std::endl;
+    std::cout << "io_uring=" << cfg.io_uring << std::endl;
+    std::cout << "blocking threads=" << cfg.blocking_threads << std::endl;
+    std::cout << "cache_mb=" << cfg.cache_mb << std::endl;
+    std::cout << "stat_cache_ms=" << cfg.stat_cache_ms << std::endl;
+    std::cout << "durability=" << (cfg.durability == Durability::sync ? "sync" :
+                                   cfg.durability == Durability::batch ? "batch" : "none") << std::endl;
+    std::cout << "etags=" << cfg.etags << std::endl;
+    std::cout << "max_bytes=" << cfg.max_bytes << std::endl;
+    std::cout << "pack_max_kb=" << cfg.pack_max_kb << std::endl;
     std::cout << "======================= " << std::endl;
 
     // Change CWD to lobos_dir
@@ -138,15 +400,46 @@ int main(int argc, char **argv) {
 
     std::unique_ptr<IndexStore> index_store;
     if(cfg.lobos_index_enabled) {
-        auto start = std::chrono::steady_clock::now();
-        std::cout << "Recursively building index from " << cfg.lobos_dir << " down... This can take a while" << std::endl;
-        index_store = std::make_unique<IndexStore>(cfg.lobos_index_refresh_sec, cfg.lobos_dir);
-        auto end = std::chrono::steady_clock::now();
-        std::chrono::duration<double> elapsed_seconds = end - start;
-        std::cout << "Index built in " << elapsed_seconds.count() << " seconds with " << index_store->index.size() << " items" << std::endl;
+        // The server starts right away and falls back to the filesystem
+        // until the index is complete
+        std::cout << "Recursively building index from " << cfg.lobos_dir << " down in the background" << std::endl;
+        index_store = std::make_unique<IndexStore>(cfg.lobos_index_refresh_sec, cfg.lobos_dir, cfg.compact_index);
+        if (!cfg.index_snapshot.empty())
+            index_store->set_snapshot(cfg.index_snapshot, cfg.index_snapshot_sec);
+        index_store->set_load_sums(cfg.etags);
+        index_store->build(cfg.threads);
+        // Without the index a packed object would look missing
+        if (cfg.pack_max_kb > 0) {
+            while (!index_store->ready())
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
     }
 
-    S3HttpServer server("127.0.0.1", cfg.port, cfg.lobos_dir, index_store.get());
+    ServerOptions opts;
+    opts.zero_copy = cfg.zero_copy;
+    opts.io_uring = cfg.io_uring;
+    opts.blocking_threads = std::max(cfg.blocking_threads, 0);
+    opts.blocking_queue_depth = std::max(cfg.blocking_queue_depth, 0);
+    opts.cache_bytes = (size_t)std::max(cfg.cache_mb, 0) << 20;
+    opts.cache_max_object = (size_t)std::max(cfg.cache_max_object_kb, 0) << 10;
+    opts.stat_cache_ttl = std::chrono::milliseconds(std::max(cfg.stat_cache_ms, 0));
+    opts.durability = cfg.durability;
+    opts.batch_interval = std::chrono::milliseconds(std::max(cfg.durability_batch_ms, 0));
+    opts.fallocate = cfg.fallocate;
+    opts.etags = cfg.etags;
+    opts.max_bytes = cfg.max_bytes;
+    opts.evict_low_pct = cfg.evict_low_pct;
+    opts.pack_max_bytes = (size_t)std::max(cfg.pack_max_kb, 0) << 10;
+    opts.metrics_port = (unsigned short)std::max(cfg.metrics_port, 0);
+    opts.slow_request = std::chrono::milliseconds(std::max(cfg.slow_request_ms, 0));
+    opts.trace_file = cfg.trace_file;
+    opts.trace_sample = cfg.trace_sample;
+
+    S3HttpServer server("127.0.0.1", cfg.port, cfg.lobos_dir, index_store.get(), opts);
     server.start(cfg.threads, cfg.pin_threads);
+
+    std::cout << "Shutting down" << std::endl;
+    if (index_store)
+        index_store->shutdown();
 }
 
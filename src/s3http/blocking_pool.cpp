@@ -0,0 +1,105 @@
+#include "blocking_pool.hpp"
+
+BlockingPool::BlockingPool(int threads, size_t max_queued)
+    : max_queued(max_queued)
+{
+    this->threads.reserve(threads);
+    for (int i = 0; i < threads; ++i)
+        this->threads.emplace_back([this] { worker(); });
+}
+
+BlockingPool::~BlockingPool() {
+    {
+        std::lock_guard lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+bool BlockingPool::submit(BlockingOp op, std::function<void()>& fn) {
+    auto& c = counters[static_cast<size_t>(op)];
+    {
+        std::lock_guard lock(mtx);
+        if (threads.empty() || queue.size() >= max_queued)
+            return false;
+        queue.push_back(Task{op, clock::now(), std::move(fn)});
+
+        auto depth = c.queued.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (depth > c.max_queued.load(std::memory_order_relaxed))
+            c.max_queued.store(depth, std::memory_order_relaxed);
+    }
+    cv.notify_one();
+    return true;
+}
+
+void BlockingPool::record(BlockingOp op, clock::duration wait, clock::duration run) {
+    auto& c = counters[static_cast<size_t>(op)];
+    auto run_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(run).count();
+    c.completed.fetch_add(1, std::memory_order_relaxed);
+    c.wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count(), std::memory_order_relaxed);
+    c.run_ns.fetch_add(run_ns, std::memory_order_relaxed);
+    auto max = c.max_run_ns.load(std::memory_order_relaxed);
+    while (run_ns > max && !c.max_run_ns.compare_exchange_weak(max, run_ns, std::memory_order_relaxed))
+        ;
+}
+
+void BlockingPool::worker() {
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock lock(mtx);
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            // Drain what's left so no session is left hanging
+            if (queue.empty())
+                return;
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+        counters[static_cast<size_t>(task.op)].queued.fetch_sub(1, std::memory_order_relaxed);
+        task.fn();
+    }
+}
+
+BlockingPool::OpStats BlockingPool::stats(BlockingOp op) const {
+    auto& c = counters[static_cast<size_t>(op)];
+    return OpStats{
+        c.completed.load(std::memory_order_relaxed),
+        c.inline_runs.load(std::memory_order_relaxed),
+        c.queued.load(std::memory_order_relaxed),
+        c.max_queued.load(std::memory_order_relaxed),
+        c.wait_ns.load(std::memory_order_relaxed),
+        c.run_ns.load(std::memory_order_relaxed),
+        c.max_run_ns.load(std::memory_order_relaxed),
+    };
+}
+
+const char* BlockingPool::op_name(BlockingOp op) {
+    switch (op) {
+        case BlockingOp::mkdir:  return "mkdir";
+        case BlockingOp::stat:   return "stat";
+        case BlockingOp::remove: return "remove";
+        case BlockingOp::list:   return "list";
+        case BlockingOp::rename: return "rename";
+        case BlockingOp::sync:   return "sync";
+        case BlockingOp::copy:   return "copy";
+        default:                 return "unknown";
+    }
+}
+
+void BlockingPool::print_stats(std::ostream& os) const {
+    for (size_t i = 0; i < counters.size(); ++i) {
+        auto op = static_cast<BlockingOp>(i);
+        auto s = stats(op);
+        if (s.completed == 0)
+            continue;
+        os << "Blocking pool " << op_name(op)
+           << ": completed=" << s.completed
+           << " inline=" << s.inline_runs
+           << " max_queued=" << s.max_queued
+           << " avg_wait_us=" << s.wait_ns / s.completed / 1000
+           << " avg_run_us=" << s.run_ns / s.completed / 1000
+           << " max_run_us=" << s.max_run_ns / 1000 << std::endl;
+    }
+}
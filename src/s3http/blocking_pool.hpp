@@ -0,0 +1,169 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+// What a blocking task does, stats are kept per op
+enum class BlockingOp { mkdir, stat, remove, list, rename, sync, copy, count };
+
+// Runs the filesystem calls that have no async counterpart (mkdir, stat,
+// unlink, readdir, rename, fsync, file copies) off the network threads.
+// Sessions co_await `run` and their io_context keeps serving other
+// connections meanwhile.
+//
+// The queue is bounded: when it's full the task runs inline on the caller, a
+// metadata storm then slows down the requests causing it instead of growing
+// the queue forever. `inline_runs` going up means the pool is too small or the
+// filesystem can't keep up.
+class BlockingPool {
+    public:
+        struct OpStats {
+            uint64_t completed;
+            uint64_t inline_runs;
+            uint64_t queued;      // right now
+            uint64_t max_queued;
+            uint64_t wait_ns;     // total time spent in the queue
+            uint64_t run_ns;      // total time spent running
+            uint64_t max_run_ns;
+        };
+
+        BlockingPool(int threads, size_t max_queued);
+        ~BlockingPool();
+
+        // Runs `f` on the pool and resumes the caller on its own executor
+        // with the result. Exceptions thrown by `f` are rethrown there.
+        template<class F>
+        boost::asio::awaitable<std::invoke_result_t<F&>> run(BlockingOp op, F f);
+        // Runs f(0) .. f(n - 1) in parallel on the pool and resumes the
+        // caller once they're all done. `f` must not throw.
+        template<class F>
+        boost::asio::awaitable<void> run_each(BlockingOp op, size_t n, F f);
+
+        OpStats stats(BlockingOp op) const;
+        void print_stats(std::ostream& os) const;
+        static const char* op_name(BlockingOp op);
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct Task {
+            BlockingOp op;
+            clock::time_point queued_at;
+            std::function<void()> fn;
+        };
+
+        struct alignas(64) Counters {
+            std::atomic<uint64_t> completed{0};
+            std::atomic<uint64_t> inline_runs{0};
+            std::atomic<uint64_t> queued{0};
+            std::atomic<uint64_t> max_queued{0};
+            std::atomic<uint64_t> wait_ns{0};
+            std::atomic<uint64_t> run_ns{0};
+            std::atomic<uint64_t> max_run_ns{0};
+        };
+
+        // False when the queue is full, the caller runs `fn` itself then
+        bool submit(BlockingOp op, std::function<void()>& fn);
+        void record(BlockingOp op, clock::duration wait, clock::duration run);
+        void worker();
+
+        size_t max_queued;
+        std::array<Counters, static_cast<size_t>(BlockingOp::count)> counters;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<Task> queue;
+        bool stopping = false;
+        std::vector<std::thread> threads;
+};
+
+template<class F>
+boost::asio::awaitable<std::invoke_result_t<F&>> BlockingPool::run(BlockingOp op, F f) {
+    namespace net = boost::asio;
+    using R = std::invoke_result_t<F&>;
+
+    return net::async_initiate<const net::use_awaitable_t<>, void(std::exception_ptr, R)>(
+        [this, op](auto handler, F f) {
+            // std::function wants something copyable, the handler isn't
+            auto h = std::make_shared<decltype(handler)>(std::move(handler));
+            auto queued_at = clock::now();
+            std::function<void()> task = [this, op, h, f = std::move(f), queued_at]() mutable {
+                auto start = clock::now();
+                std::exception_ptr e;
+                R r{};
+                try {
+                    r = f();
+                } catch (...) {
+                    e = std::current_exception();
+                }
+                record(op, start - queued_at, clock::now() - start);
+
+                auto ex = net::get_associated_executor(*h);
+                net::post(ex, [h, e, r = std::move(r)]() mutable {
+                    (*h)(e, std::move(r));
+                });
+            };
+            if (!submit(op, task)) {
+                counters[static_cast<size_t>(op)].inline_runs.fetch_add(1, std::memory_order_relaxed);
+                task();
+            }
+        },
+        net::use_awaitable, std::move(f));
+}
+
+template<class F>
+boost::asio::awaitable<void> BlockingPool::run_each(BlockingOp op, size_t n, F f) {
+    namespace net = boost::asio;
+
+    return net::async_initiate<const net::use_awaitable_t<>, void()>(
+        [this, op, n](auto handler, F f) {
+            using Handler = decltype(handler);
+            struct State {
+                Handler h;
+                F f;
+                std::atomic<size_t> left;
+            };
+            auto state = std::shared_ptr<State>(new State{std::move(handler), std::move(f), {n}});
+            auto done = [state] {
+                auto ex = net::get_associated_executor(state->h);
+                net::post(ex, [state]() mutable { std::move(state->h)(); });
+            };
+            if (n == 0) {
+                done();
+                return;
+            }
+            auto queued_at = clock::now();
+            for (size_t i = 0; i < n; ++i) {
+                std::function<void()> task = [this, op, state, done, i, queued_at] {
+                    auto start = clock::now();
+                    state->f(i);
+                    record(op, start - queued_at, clock::now() - start);
+                    if (state->left.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                        done();
+                };
+                if (!submit(op, task)) {
+                    counters[static_cast<size_t>(op)].inline_runs.fetch_add(1, std::memory_order_relaxed);
+                    task();
+                }
+            }
+        },
+        net::use_awaitable, std::move(f));
+}
@@ -0,0 +1,473 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "checksum.hpp"
+
+namespace {
+
+// Slice-by-8 tables, t[0] is the classic byte at a time table
+struct CrcTables {
+    uint32_t t[8][256];
+};
+
+constexpr CrcTables make_crc_tables(uint32_t poly) {
+    CrcTables tab{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+        tab.t[0][i] = c;
+    }
+    for (int k = 1; k < 8; ++k)
+        for (int i = 0; i < 256; ++i)
+            tab.t[k][i] = (tab.t[k - 1][i] >> 8) ^ tab.t[0][tab.t[k - 1][i] & 0xff];
+    return tab;
+}
+
+constexpr CrcTables crc32_tables = make_crc_tables(0xedb88320);
+constexpr CrcTables crc32c_tables = make_crc_tables(0x82f63b78);
+
+// `crc` is the internal (inverted) state, little endian only
+uint32_t crc_slice8(const CrcTables& tab, uint32_t crc, const uint8_t* p, size_t len) {
+    auto& t = tab.t;
+    while (len && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        uint32_t lo = (uint32_t)v ^ crc;
+        uint32_t hi = v >> 32;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+struct CpuFeatures {
+    bool sse42 = false;
+    bool pclmul = false;
+    bool sha = false;
+
+    CpuFeatures() {
+        unsigned eax, ebx, ecx, edx;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            sse42 = ecx & bit_SSE4_2;
+            pclmul = (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+            bool ssse3 = ecx & bit_SSSE3;
+            if (ssse3 && (ecx & bit_SSE4_1) && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+                sha = ebx & bit_SHA;
+        }
+    }
+};
+
+const CpuFeatures cpu;
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* p, size_t len) {
+    uint64_t c = crc;
+    while (len && (reinterpret_cast<uintptr_t>(p) & 7)) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+
+// Folds 64 bytes at a time with carry-less multiplies then Barrett reduces
+// to 32 bits, see Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ". `len` must be >= 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(uint32_t crc, const uint8_t* p, size_t len) {
+    alignas(16) static const uint64_t k1k2[2] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[2] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[2] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[2] = {0x01db710641, 0x01f7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    p += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    // Fold the 4 lanes into one
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    for (__m128i next : {x2, x3, x4}) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+    }
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)p)), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+constexpr uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+inline uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+inline uint32_t load_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void sha256_blocks_generic(uint32_t state[8], const uint8_t* p, size_t blocks) {
+    for (; blocks; --blocks, p += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = load_be32(p + 4 * i);
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// Two rounds per sha256rnds2, the message schedule is done by
+// sha256msg1/sha256msg2 four words at a time
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256_blocks_shani(uint32_t state[8], const uint8_t* p, size_t blocks) {
+    const __m128i shuf = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF/CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; blocks; --blocks, p += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[4];
+        for (int i = 0; i < 16; ++i) {
+            __m128i& cur = w[i % 4];
+            if (i < 4) {
+                cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16 * i)), shuf);
+            } else {
+                // w[i-4] + sigma0(w[i-3]) + w[i-1:i-2 shifted] then sigma1
+                cur = _mm_sha256msg1_epu32(cur, w[(i - 3) % 4]);
+                cur = _mm_add_epi32(cur, _mm_alignr_epi8(w[(i - 1) % 4], w[(i - 2) % 4], 4));
+                cur = _mm_sha256msg2_epu32(cur, w[(i - 1) % 4]);
+            }
+            __m128i msg = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i*)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+#endif
+
+void sha256_blocks(uint32_t state[8], const uint8_t* p, size_t blocks) {
+#if defined(__x86_64__)
+    if (cpu.sha)
+        return sha256_blocks_shani(state, p, blocks);
+#endif
+    sha256_blocks_generic(state, p, blocks);
+}
+
+constexpr uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+constexpr int md5_shift[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+
+// Fully unrolled by the compiler, the variable rotation disappears
+void md5_blocks(uint32_t state[4], const uint8_t* p, size_t blocks) {
+    for (; blocks; --blocks, p += 64) {
+        uint32_t m[16];
+        std::memcpy(m, p, 64); // little endian only
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+
+#pragma GCC unroll 64
+        for (int i = 0; i < 64; ++i) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = d ^ (b & (c ^ d));
+                g = i;
+            } else if (i < 32) {
+                f = c ^ (d & (b ^ c));
+                g = (5 * i + 1) & 15;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) & 15;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) & 15;
+            }
+            uint32_t next = b + rotl(a + f + md5_k[i] + m[g], md5_shift[i / 16][i % 4]);
+            a = d;
+            d = c;
+            c = b;
+            b = next;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    }
+}
+
+// Block buffering shared by MD5 and SHA-256
+template<class Blocks>
+void buffered_update(uint8_t block[64], uint64_t& total, const void* data, size_t len, Blocks blocks) {
+    auto p = static_cast<const uint8_t*>(data);
+    size_t used = total % 64;
+    total += len;
+    if (used) {
+        size_t n = std::min(len, 64 - used);
+        std::memcpy(block + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        blocks(block, 1);
+    }
+    blocks(p, len / 64);
+    p += len / 64 * 64;
+    std::memcpy(block, p, len % 64);
+}
+
+// Padding up to 8 bytes short of a block
+size_t pad_length(uint64_t total) {
+    return (total % 64 < 56 ? 56 : 120) - total % 64;
+}
+
+const uint8_t padding[128] = {0x80};
+
+} // namespace
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len) {
+    auto p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (cpu.pclmul && len >= 64) {
+        size_t n = len & ~size_t(15);
+        crc = crc32_pclmul(crc, p, n);
+        p += n;
+        len -= n;
+    }
+#endif
+    return ~crc_slice8(crc32_tables, crc, p, len);
+}
+
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t len) {
+    auto p = static_cast<const uint8_t*>(data);
+#if defined(__x86_64__)
+    if (cpu.sse42)
+        return ~crc32c_sse42(~crc, p, len);
+#endif
+    return ~crc_slice8(crc32c_tables, ~crc, p, len);
+}
+
+void Md5::update(const void* data, size_t len) {
+    buffered_update(block, total, data, len, [this](const uint8_t* p, size_t n) { md5_blocks(state, p, n); });
+}
+
+Md5::digest Md5::finish() {
+    uint64_t bits = total * 8;
+    uint8_t len[8];
+    std::memcpy(len, &bits, 8);
+    update(padding, pad_length(total));
+    update(len, 8);
+
+    digest out;
+    std::memcpy(out.data(), state, 16);
+    return out;
+}
+
+void Sha256::update(const void* data, size_t len) {
+    buffered_update(block, total, data, len, [this](const uint8_t* p, size_t n) { sha256_blocks(state, p, n); });
+}
+
+Sha256::digest Sha256::finish() {
+    uint64_t bits = total * 8;
+    uint8_t len[8];
+    for (int i = 0; i < 8; ++i)
+        len[i] = bits >> (56 - 8 * i);
+    update(padding, pad_length(total));
+    update(len, 8);
+
+    digest out;
+    for (int i = 0; i < 8; ++i)
+        for (int j = 0; j < 4; ++j)
+            out[4 * i + j] = state[i] >> (24 - 8 * j);
+    return out;
+}
+
+const char* checksum_name(ChecksumAlgo algo) {
+    switch (algo) {
+        case ChecksumAlgo::crc32:  return "crc32";
+        case ChecksumAlgo::crc32c: return "crc32c";
+        case ChecksumAlgo::sha256: return "sha256";
+        case ChecksumAlgo::none:   break;
+    }
+    return "none";
+}
+
+std::string base64_encode(const uint8_t* data, size_t len) {
+    static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((len + 2) / 3 * 4);
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < len)
+            v |= data[i + 1] << 8;
+        if (i + 2 < len)
+            v |= data[i + 2];
+        out.push_back(alphabet[v >> 18]);
+        out.push_back(alphabet[(v >> 12) & 63]);
+        out.push_back(i + 1 < len ? alphabet[(v >> 6) & 63] : '=');
+        out.push_back(i + 2 < len ? alphabet[v & 63] : '=');
+    }
+    return out;
+}
+
+std::string hex_digest(const uint8_t* data, size_t len) {
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(len * 2);
+    for (size_t i = 0; i < len; ++i) {
+        out.push_back(digits[data[i] >> 4]);
+        out.push_back(digits[data[i] & 15]);
+    }
+    return out;
+}
+
+ObjectHasher::ObjectHasher(bool md5, ChecksumAlgo algo)
+    : md5_enabled(md5), algo_(algo) {}
+
+void ObjectHasher::update(const void* data, size_t len) {
+    if (md5_enabled)
+        md5_.update(data, len);
+    switch (algo_) {
+        case ChecksumAlgo::crc32:  crc = crc32_update(crc, data, len); break;
+        case ChecksumAlgo::crc32c: crc = crc32c_update(crc, data, len); break;
+        case ChecksumAlgo::sha256: sha256.update(data, len); break;
+        case ChecksumAlgo::none:   break;
+    }
+}
+
+void ObjectHasher::finish() {
+    if (md5_enabled)
+        md5_digest = md5_.finish();
+    if (algo_ == ChecksumAlgo::crc32 || algo_ == ChecksumAlgo::crc32c) {
+        for (int i = 0; i < 4; ++i)
+            checksum_[i] = crc >> (24 - 8 * i);
+        checksum_size_ = 4;
+    } else if (algo_ == ChecksumAlgo::sha256) {
+        auto d = sha256.finish();
+        std::copy(d.begin(), d.end(), checksum_.begin());
+        checksum_size_ = d.size();
+    }
+}
+
+std::string ObjectHasher::etag() const {
+    return "\"" + hex_digest(md5_digest.data(), md5_digest.size()) + "\"";
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Checksums computed over PUT bodies as they're written: MD5 for the ETag
+// and whichever x-amz-checksum-* the client uses. All of them are streaming,
+// the data is never read twice.
+//
+// The CRCs pick the best kernel for the CPU at runtime (SSE4.2 crc32 for
+// crc32c, PCLMUL folding for crc32) and fall back to slice-by-8 tables.
+// SHA-256 uses the SHA extensions when available. MD5 can't be vectorized
+// for a single stream, it's a plain but tight implementation.
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t len);
+
+class Md5 {
+    public:
+        using digest = std::array<uint8_t, 16>;
+
+        void update(const void* data, size_t len);
+        digest finish();
+
+    private:
+        uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+        uint64_t total = 0;
+        uint8_t block[64];
+};
+
+class Sha256 {
+    public:
+        using digest = std::array<uint8_t, 32>;
+
+        void update(const void* data, size_t len);
+        digest finish();
+
+    private:
+        uint32_t state[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+        uint64_t total = 0;
+        uint8_t block[64];
+};
+
+enum class ChecksumAlgo { none, crc32, crc32c, sha256 };
+
+// "crc32" for ChecksumAlgo::crc32 etc, as in x-amz-checksum-<name>
+const char* checksum_name(ChecksumAlgo algo);
+
+std::string base64_encode(const uint8_t* data, size_t len);
+std::string hex_digest(const uint8_t* data, size_t len);
+
+// Everything lobos computes over one PUT body
+class ObjectHasher {
+    public:
+        // `md5` for the ETag, `algo` for the additional checksum if any
+        ObjectHasher(bool md5, ChecksumAlgo algo);
+
+        void update(const void* data, size_t len);
+        // Call once, after the last update
+        void finish();
+
+        bool has_md5() const { return md5_enabled; }
+        const Md5::digest& md5() const { return md5_digest; }
+        // Quoted hex MD5, as sent in ETag headers
+        std::string etag() const;
+
+        ChecksumAlgo algo() const { return algo_; }
+        // Raw checksum, big-endian for the CRCs
+        const uint8_t* checksum_data() const { return checksum_.data(); }
+        size_t checksum_size() const { return checksum_size_; }
+        // Base64 of it, as in x-amz-checksum-* headers
+        std::string checksum() const { return base64_encode(checksum_.data(), checksum_size_); }
+
+    private:
+        bool md5_enabled;
+        ChecksumAlgo algo_;
+        Md5 md5_;
+        Md5::digest md5_digest{};
+        uint32_t crc = 0;
+        Sha256 sha256;
+        std::array<uint8_t, 32> checksum_{};
+        size_t checksum_size_ = 0;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <utility>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+
+// A body produced lazily, one piece at a time, meant to be sent with chunked
+// transfer encoding. `next` appends the next piece to the buffer and returns
+// false once there's nothing left. Nothing but the current piece is ever
+// held in memory.
+struct generator_body {
+    struct value_type {
+        std::function<bool(std::string&)> next;
+    };
+
+    class writer {
+        public:
+            using const_buffers_type = boost::asio::const_buffer;
+
+            template<bool isRequest, class Fields>
+            writer(boost::beast::http::header<isRequest, Fields>&, value_type& body)
+                : body_(body) {}
+
+            void init(boost::beast::error_code& ec) {
+                ec = {};
+            }
+
+            boost::optional<std::pair<const_buffers_type, bool>> get(boost::beast::error_code& ec) {
+                ec = {};
+                buf_.clear();
+                while (more_ && buf_.empty())
+                    more_ = body_.next && body_.next(buf_);
+                if (buf_.empty())
+                    return boost::none;
+                return {{const_buffers_type(buf_.data(), buf_.size()), more_}};
+            }
+
+        private:
+            value_type& body_;
+            std::string buf_;
+            bool more_ = true;
+    };
+};
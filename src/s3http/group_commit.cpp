@@ -0,0 +1,70 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "group_commit.hpp"
+
+GroupCommit::GroupCommit(const std::string& dir, std::chrono::milliseconds interval)
+    : interval(interval)
+{
+    fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error: can't open " << dir << " for group commit: " << std::strerror(errno) << std::endl;
+        std::exit(errno);
+    }
+    thread = std::thread([this] { run(); });
+}
+
+GroupCommit::~GroupCommit() {
+    {
+        std::lock_guard lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+    close(fd);
+}
+
+void GroupCommit::run() {
+    std::unique_lock lock(mtx);
+    for (;;) {
+        cv.wait(lock, [this] { return stopping || !waiters.empty(); });
+        // Flush whoever is still waiting before leaving
+        if (waiters.empty())
+            return;
+
+        // Give other writers a chance to join this commit
+        if (!stopping) {
+            lock.unlock();
+            std::this_thread::sleep_for(interval);
+            lock.lock();
+        }
+
+        auto batch = std::move(waiters);
+        waiters.clear();
+        lock.unlock();
+
+        boost::system::error_code ec;
+        if (syncfs(fd) != 0)
+            ec.assign(errno, boost::system::system_category());
+        for (auto& w : batch)
+            w(ec);
+
+        lock.lock();
+        commits++;
+        committed += batch.size();
+    }
+}
+
+void GroupCommit::print_stats(std::ostream& os) const {
+    std::lock_guard lock(mtx);
+    os << "Group commit: syncfs=" << commits
+       << " waiters=" << committed;
+    if (commits)
+        os << " avg_batch=" << committed / commits;
+    os << std::endl;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/system/error_code.hpp>
+
+// Group commit for --durability=batch.
+//
+// Writers co_await `wait` once their changes are made. A single syncfs(2) on
+// the bucket's filesystem then covers everybody who showed up during the
+// last `interval`, instead of one fsync per PUT. `wait` only completes with a
+// syncfs that started after it was called, so whatever the caller wrote
+// before is on disk by then.
+class GroupCommit {
+    public:
+        GroupCommit(const std::string& dir, std::chrono::milliseconds interval);
+        ~GroupCommit();
+
+        boost::asio::awaitable<boost::system::error_code> wait();
+
+        void print_stats(std::ostream& os) const;
+
+    private:
+        using waiter = std::function<void(boost::system::error_code)>;
+
+        void run();
+
+        int fd = -1;
+        std::chrono::milliseconds interval;
+
+        mutable std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<waiter> waiters;
+        bool stopping = false;
+        uint64_t commits = 0;
+        uint64_t committed = 0;
+        std::thread thread;
+};
+
+inline boost::asio::awaitable<boost::system::error_code> GroupCommit::wait() {
+    namespace net = boost::asio;
+
+    return net::async_initiate<const net::use_awaitable_t<>, void(std::exception_ptr, boost::system::error_code)>(
+        [this](auto handler) {
+            auto h = std::make_shared<decltype(handler)>(std::move(handler));
+            waiter w = [h](boost::system::error_code ec) {
+                auto ex = net::get_associated_executor(*h);
+                net::post(ex, [h, ec]() mutable {
+                    (*h)(nullptr, ec);
+                });
+            };
+            {
+                std::lock_guard lock(mtx);
+                waiters.push_back(std::move(w));
+            }
+            cv.notify_one();
+        },
+        net::use_awaitable);
+}
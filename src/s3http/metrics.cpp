@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+#include "metrics.hpp"
+
+thread_local Metrics::ThreadMetrics* Metrics::current = nullptr;
+
+size_t LatencyHistogram::bucket(uint64_t us) {
+    if (us < 2)
+        return us;
+    // [2^p, 1.5 * 2^p) then [1.5 * 2^p, 2^(p + 1))
+    size_t p = std::bit_width(us) - 1;
+    size_t i = 2 * p + ((us >> (p - 1)) & 1);
+    return std::min(i, buckets - 1);
+}
+
+uint64_t LatencyHistogram::upper_bound_us(size_t i) {
+    if (i < 2)
+        return i + 1;
+    size_t p = i / 2;
+    return i % 2 ? 2ull << p : 3ull << (p - 1);
+}
+
+Metrics::Metrics(int threads) {
+    // Slot 0 doubles as the one for unbound threads
+    for (int i = 0; i < std::max(threads, 1); ++i)
+        this->threads.push_back(std::make_unique<ThreadMetrics>());
+}
+
+void Metrics::bind_thread(int i) {
+    current = threads[i % threads.size()].get();
+}
+
+const char* Metrics::op_name(S3Op op) {
+    switch (op) {
+        case S3Op::get:    return "get";
+        case S3Op::head:   return "head";
+        case S3Op::put:    return "put";
+        case S3Op::copy:   return "copy";
+        case S3Op::remove: return "delete";
+        case S3Op::list:   return "list";
+        case S3Op::post:   return "post";
+        default:           return "other";
+    }
+}
+
+static void appendf(std::string& out, const char* fmt, auto... args) {
+    char buf[256];
+    int n = std::snprintf(buf, sizeof(buf), fmt, args...);
+    out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+void Metrics::render(std::string& out) const {
+    out += "# HELP lobos_request_duration_seconds From a request's header being read to its response being sent\n"
+           "# TYPE lobos_request_duration_seconds histogram\n";
+    for (size_t op = 0; op < static_cast<size_t>(S3Op::count); ++op) {
+        auto name = op_name(static_cast<S3Op>(op));
+        uint64_t total = 0, sum = 0;
+        for (size_t i = 0; i < LatencyHistogram::buckets; ++i) {
+            for (auto& t : threads)
+                total += t->latency[op].count(i);
+            if (i + 1 < LatencyHistogram::buckets)
+                appendf(out, "lobos_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n",
+                        name, LatencyHistogram::upper_bound_us(i) / 1e6, (unsigned long)total);
+        }
+        for (auto& t : threads)
+            sum += t->latency[op].sum();
+        appendf(out, "lobos_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", name, (unsigned long)total);
+        appendf(out, "lobos_request_duration_seconds_sum{op=\"%s\"} %.6f\n", name, sum / 1e6);
+        appendf(out, "lobos_request_duration_seconds_count{op=\"%s\"} %lu\n", name, (unsigned long)total);
+    }
+
+    uint64_t in = 0, sent = 0;
+    for (auto& t : threads) {
+        in += t->bytes_in.load(std::memory_order_relaxed);
+        sent += t->bytes_out.load(std::memory_order_relaxed);
+    }
+    out += "# HELP lobos_received_bytes_total Request headers and bodies\n"
+           "# TYPE lobos_received_bytes_total counter\n";
+    appendf(out, "lobos_received_bytes_total %lu\n", (unsigned long)in);
+    out += "# HELP lobos_sent_bytes_total Response headers and bodies\n"
+           "# TYPE lobos_sent_bytes_total counter\n";
+    appendf(out, "lobos_sent_bytes_total %lu\n", (unsigned long)sent);
+
+    out += "# HELP lobos_connections Open client connections per server thread\n"
+           "# TYPE lobos_connections gauge\n";
+    for (size_t i = 0; i < threads.size(); ++i)
+        appendf(out, "lobos_connections{thread=\"%zu\"} %ld\n", i,
+                (long)threads[i]->connections.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// S3 operations requests are counted and timed under
+enum class S3Op { get, head, put, copy, remove, list, post, other, count };
+
+// Request latencies, HDR style: two buckets per power of two from 1us to
+// ~67s so any value is known within 50%, whatever its magnitude. Written by
+// a single thread: increments are a load and a store, no locked instruction.
+class LatencyHistogram {
+    public:
+        // The last one is everything over 2^26us
+        static constexpr size_t buckets = 53;
+
+        void record(uint64_t us) {
+            bump(counts[bucket(us)], 1);
+            bump(sum_us, us);
+        }
+
+        uint64_t count(size_t i) const { return counts[i].load(std::memory_order_relaxed); }
+        uint64_t sum() const { return sum_us.load(std::memory_order_relaxed); }
+
+        static size_t bucket(uint64_t us);
+        // Values in bucket `i` are below that
+        static uint64_t upper_bound_us(size_t i);
+
+    private:
+        static void bump(std::atomic<uint64_t>& c, uint64_t n) {
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        std::array<std::atomic<uint64_t>, buckets> counts{};
+        std::atomic<uint64_t> sum_us{0};
+};
+
+// What /metrics on --metrics-port reports about requests.
+//
+// Each server thread records into its own ThreadMetrics, nothing on the
+// request path is shared between threads. A scrape walks all of them and
+// adds them up, it may see a request counted but its bytes not yet, which
+// Prometheus doesn't mind.
+class Metrics {
+    public:
+        explicit Metrics(int threads);
+
+        // Ties the calling server thread to slot `i`, before it records anything
+        void bind_thread(int i);
+
+        // From bound threads only
+        void record(S3Op op, std::chrono::steady_clock::duration latency, uint64_t bytes_in) {
+            auto& t = local();
+            t.latency[static_cast<size_t>(op)].record(
+                std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+            bump(t.bytes_in, bytes_in);
+        }
+        void add_bytes_out(uint64_t n) { bump(local().bytes_out, n); }
+        void connection_opened() { bump(local().connections, 1); }
+        void connection_closed() { bump(local().connections, -1); }
+
+        // Appends the request metrics in Prometheus' text format
+        void render(std::string& out) const;
+
+        static const char* op_name(S3Op op);
+
+    private:
+        struct alignas(64) ThreadMetrics {
+            std::array<LatencyHistogram, static_cast<size_t>(S3Op::count)> latency;
+            std::atomic<uint64_t> bytes_in{0};
+            std::atomic<uint64_t> bytes_out{0};
+            std::atomic<uint64_t> connections{0};
+        };
+
+        static void bump(std::atomic<uint64_t>& c, uint64_t n) {
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        ThreadMetrics& local() { return current ? *current : *threads[0]; }
+
+        std::vector<std::unique_ptr<ThreadMetrics>> threads;
+        static thread_local ThreadMetrics* current;
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+
+// Body for GetObject: an open fd and the byte range of it to send. Packed
+// objects are a slice of their segment file starting at `base`.
+//
+// The session sends it with sendfile(2) straight from the page cache to the
+// socket. When that's disabled Beast serializes it like any other body
+// through the pread based writer below.
+struct object_body {
+    class value_type {
+        public:
+            value_type() = default;
+            ~value_type() { close(); }
+
+            value_type(value_type&& other) noexcept
+                : fd_(std::exchange(other.fd_, -1)),
+                  file_size_(other.file_size_),
+                  last_modified_(other.last_modified_),
+                  last_modified_nsec_(other.last_modified_nsec_),
+                  base_(other.base_),
+                  offset_(other.offset_),
+                  length_(other.length_) {}
+
+            value_type& operator=(value_type&& other) noexcept {
+                if (this != &other) {
+                    close();
+                    fd_ = std::exchange(other.fd_, -1);
+                    file_size_ = other.file_size_;
+                    last_modified_ = other.last_modified_;
+                    last_modified_nsec_ = other.last_modified_nsec_;
+                    base_ = other.base_;
+                    offset_ = other.offset_;
+                    length_ = other.length_;
+                }
+                return *this;
+            }
+
+            // Opens `path` and stats it, the whole file is selected
+            void open(const char* path, boost::beast::error_code& ec) {
+                close();
+                fd_ = ::open(path, O_RDONLY | O_CLOEXEC);
+                if (fd_ < 0) {
+                    ec.assign(errno, boost::system::system_category());
+                    return;
+                }
+                struct stat st;
+                if (fstat(fd_, &st) != 0) {
+                    ec.assign(errno, boost::system::system_category());
+                    close();
+                    return;
+                }
+                if (!S_ISREG(st.st_mode)) {
+                    // GET on a "directory" is a missing key as far as S3 goes
+                    ec.assign(EISDIR, boost::system::system_category());
+                    close();
+                    return;
+                }
+                posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+                file_size_ = st.st_size;
+                last_modified_ = st.st_mtime;
+                last_modified_nsec_ = st.st_mtim.tv_nsec;
+                base_ = 0;
+                offset_ = 0;
+                length_ = file_size_;
+                ec = {};
+            }
+
+            // Takes `fd`, the object is the `size` bytes at `base`
+            void open_packed(int fd, std::uint64_t base, std::uint64_t size, time_t last_modified) {
+                close();
+                fd_ = fd;
+                file_size_ = size;
+                last_modified_ = last_modified;
+                last_modified_nsec_ = 0;
+                base_ = base;
+                offset_ = base;
+                length_ = size;
+            }
+
+            // Restricts the body to [offset, offset + length) of the object
+            void set_range(std::uint64_t offset, std::uint64_t length) {
+                offset_ = base_ + offset;
+                length_ = length;
+            }
+
+            void close() {
+                if (fd_ >= 0)
+                    ::close(fd_);
+                fd_ = -1;
+            }
+
+            bool is_open() const { return fd_ >= 0; }
+            int native_handle() const { return fd_; }
+            std::uint64_t file_size() const { return file_size_; }
+            time_t last_modified() const { return last_modified_; }
+            long last_modified_nsec() const { return last_modified_nsec_; }
+            // Where the object starts in the file
+            std::uint64_t base() const { return base_; }
+            // Where the selected bytes start in the file
+            std::uint64_t offset() const { return offset_; }
+            std::uint64_t length() const { return length_; }
+
+        private:
+            int fd_ = -1;
+            std::uint64_t file_size_ = 0;
+            time_t last_modified_ = 0;
+            long last_modified_nsec_ = 0;
+            std::uint64_t base_ = 0;
+            std::uint64_t offset_ = 0;
+            std::uint64_t length_ = 0;
+    };
+
+    static std::uint64_t size(value_type const& body) {
+        return body.length();
+    }
+
+    class writer {
+        public:
+            using const_buffers_type = boost::asio::const_buffer;
+
+            template<bool isRequest, class Fields>
+            writer(boost::beast::http::header<isRequest, Fields>&, value_type const& body)
+                : body_(body) {}
+
+            void init(boost::beast::error_code& ec) {
+                pos_ = body_.offset();
+                remain_ = body_.length();
+                ec = {};
+            }
+
+            boost::optional<std::pair<const_buffers_type, bool>> get(boost::beast::error_code& ec) {
+                if (remain_ == 0) {
+                    ec = {};
+                    return boost::none;
+                }
+                auto want = static_cast<size_t>(std::min<std::uint64_t>(remain_, sizeof(buf_)));
+                ssize_t n = pread(body_.native_handle(), buf_, want, pos_);
+                if (n < 0) {
+                    ec.assign(errno, boost::system::system_category());
+                    return boost::none;
+                }
+                if (n == 0) {
+                    // The file got truncated under us
+                    ec = boost::beast::http::error::short_read;
+                    return boost::none;
+                }
+                pos_ += n;
+                remain_ -= n;
+                ec = {};
+                return {{const_buffers_type(buf_, n), remain_ > 0}};
+            }
+
+        private:
+            value_type const& body_;
+            std::uint64_t pos_ = 0;
+            std::uint64_t remain_ = 0;
+            char buf_[64 * 1024];
+    };
+};
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <iterator>
+
+#include "object_cache.hpp"
+
+ObjectCache::ObjectCache(size_t capacity, size_t max_object_size)
+    : shard_capacity(capacity / shard_count),
+      max_object_size_(std::min(max_object_size, capacity / shard_count))
+{
+}
+
+std::shared_ptr<const CachedObject> ObjectCache::get(std::string_view key) {
+    auto& shard = shard_for(key);
+    std::lock_guard lock(shard.mtx);
+    auto it = shard.map.find(key);
+    if (it == shard.map.end()) {
+        shard.misses++;
+        return nullptr;
+    }
+    shard.hits++;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->obj;
+}
+
+uint64_t ObjectCache::generation(std::string_view key) const {
+    return shard_for(key).generation.load(std::memory_order_acquire);
+}
+
+void ObjectCache::put(std::string_view key, std::shared_ptr<const CachedObject> obj, uint64_t generation) {
+    size_t bytes = key.size() + obj->header.size() + obj->body.size();
+    if (obj->body.size() > max_object_size_ || bytes > shard_capacity)
+        return;
+
+    auto& shard = shard_for(key);
+    std::lock_guard lock(shard.mtx);
+    // Invalidated while it was being read, what we have may be stale
+    if (shard.generation.load(std::memory_order_relaxed) != generation)
+        return;
+
+    auto it = shard.map.find(key);
+    if (it != shard.map.end())
+        erase(shard, it->second);
+
+    while (shard.bytes + bytes > shard_capacity && !shard.lru.empty()) {
+        erase(shard, std::prev(shard.lru.end()));
+        shard.evictions++;
+    }
+
+    shard.lru.push_front(Entry{std::string(key), std::move(obj), bytes});
+    shard.map.emplace(shard.lru.front().key, shard.lru.begin());
+    shard.bytes += bytes;
+    shard.inserts++;
+}
+
+void ObjectCache::invalidate(std::string_view key) {
+    auto& shard = shard_for(key);
+    std::lock_guard lock(shard.mtx);
+    shard.generation.fetch_add(1, std::memory_order_release);
+    auto it = shard.map.find(key);
+    if (it != shard.map.end()) {
+        erase(shard, it->second);
+        shard.invalidations++;
+    }
+}
+
+void ObjectCache::erase(Shard& shard, std::list<Entry>::iterator it) {
+    shard.bytes -= it->bytes;
+    shard.map.erase(it->key);
+    shard.lru.erase(it);
+}
+
+ObjectCache::Stats ObjectCache::stats() const {
+    Stats s{};
+    for (auto& shard : shards) {
+        std::lock_guard lock(shard.mtx);
+        s.hits += shard.hits;
+        s.misses += shard.misses;
+        s.inserts += shard.inserts;
+        s.evictions += shard.evictions;
+        s.invalidations += shard.invalidations;
+        s.entries += shard.map.size();
+        s.bytes += shard.bytes;
+    }
+    return s;
+}
+
+void ObjectCache::print_stats(std::ostream& os) const {
+    auto s = stats();
+    os << "Object cache: hits=" << s.hits
+       << " misses=" << s.misses
+       << " inserts=" << s.inserts
+       << " evictions=" << s.evictions
+       << " invalidations=" << s.invalidations
+       << " entries=" << s.entries
+       << " bytes=" << s.bytes << std::endl;
+}
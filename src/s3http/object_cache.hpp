@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// A GetObject response kept in memory: the header block is rendered once
+// when the object is loaded, only the Date and Connection headers and the
+// final CRLF are added when it's sent.
+struct CachedObject {
+    std::string header;
+    std::string body;
+    // What conditional GETs are checked against
+    std::string etag;
+    time_t last_modified = 0;
+};
+
+// Byte bounded LRU of small, hot objects keyed by object path.
+//
+// Sharded by key hash with a mutex per shard, each shard gets an equal slice
+// of the capacity. Lobos' own PUT/DELETE invalidate entries, changes made by
+// other applications are only picked up once the entry gets evicted.
+//
+// Fills race with invalidations: a GET reading the file while a PUT replaces
+// it must not insert the old content after the PUT invalidated the key. Every
+// shard has a generation bumped on invalidation, a fill takes it before
+// reading the file and `put` drops the object if it changed since.
+class ObjectCache {
+    public:
+        struct Stats {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t inserts;
+            uint64_t evictions;
+            uint64_t invalidations;
+            uint64_t entries;
+            uint64_t bytes;
+        };
+
+        ObjectCache(size_t capacity, size_t max_object_size);
+
+        size_t max_object_size() const { return max_object_size_; }
+
+        std::shared_ptr<const CachedObject> get(std::string_view key);
+        uint64_t generation(std::string_view key) const;
+        void put(std::string_view key, std::shared_ptr<const CachedObject> obj, uint64_t generation);
+        void invalidate(std::string_view key);
+
+        Stats stats() const;
+        void print_stats(std::ostream& os) const;
+
+    private:
+        static constexpr size_t shard_count = 64;
+
+        struct Entry {
+            std::string key;
+            std::shared_ptr<const CachedObject> obj;
+            size_t bytes;
+        };
+
+        struct alignas(64) Shard {
+            mutable std::mutex mtx;
+            // Most recently used first. List nodes don't move so the map
+            // keys point straight into them
+            std::list<Entry> lru;
+            std::unordered_map<std::string_view, std::list<Entry>::iterator> map;
+            size_t bytes = 0;
+            std::atomic<uint64_t> generation{0};
+
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t inserts = 0;
+            uint64_t evictions = 0;
+            uint64_t invalidations = 0;
+        };
+
+        Shard& shard_for(std::string_view key) {
+            return shards[std::hash<std::string_view>{}(key) % shard_count];
+        }
+        const Shard& shard_for(std::string_view key) const {
+            return shards[std::hash<std::string_view>{}(key) % shard_count];
+        }
+        void erase(Shard& shard, std::list<Entry>::iterator it);
+
+        size_t shard_capacity;
+        size_t max_object_size_;
+        std::array<Shard, shard_count> shards;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/file_body.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/optional.hpp>
+
+#include "checksum.hpp"
+
+// Body for PutObject: Beast's file_body, plus every buffer written to the
+// file goes through the object's checksums on the way. They're computed while
+// the data is still in cache instead of reading the file back.
+struct put_body {
+    struct value_type {
+        boost::beast::http::file_body::value_type file;
+        ObjectHasher* hasher = nullptr;
+    };
+
+    class reader {
+        public:
+            template<bool isRequest, class Fields>
+            reader(boost::beast::http::header<isRequest, Fields>& h, value_type& body)
+                : file_(h, body.file), hasher_(body.hasher) {}
+
+            void init(boost::optional<std::uint64_t> const& length, boost::beast::error_code& ec) {
+                file_.init(length, ec);
+            }
+
+            template<class ConstBufferSequence>
+            std::size_t put(ConstBufferSequence const& buffers, boost::beast::error_code& ec) {
+                auto n = file_.put(buffers, ec);
+                if (!hasher_)
+                    return n;
+                // Only what made it to the file
+                size_t left = n;
+                for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                     left > 0 && it != boost::asio::buffer_sequence_end(buffers); ++it) {
+                    boost::asio::const_buffer b = *it;
+                    auto len = std::min(left, b.size());
+                    hasher_->update(b.data(), len);
+                    left -= len;
+                }
+                return n;
+            }
+
+            void finish(boost::beast::error_code& ec) {
+                file_.finish(ec);
+            }
+
+        private:
+            boost::beast::http::file_body::reader file_;
+            ObjectHasher* hasher_;
+    };
+};
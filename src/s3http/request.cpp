@@ -0,0 +1,481 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <ctime>
+
+#include <boost/url.hpp>
+
+#include "request.hpp"
+#include "xml.hpp"
+
+static constexpr char hex_digits[] = "0123456789abcdef";
+
+// Perfect hash of the extensions below: lowercased length, first and last
+// letter. The table is built at compile time, which fails if two collide.
+struct MimeType {
+    std::string_view ext;
+    std::string_view type;
+};
+
+static constexpr MimeType mime_types[] = {
+    {"htm", "text/html"},
+    {"html", "text/html"},
+    {"php", "text/html"},
+    {"css", "text/css"},
+    {"txt", "text/plain"},
+    {"js", "application/javascript"},
+    {"json", "application/json"},
+    {"xml", "application/xml"},
+    {"swf", "application/x-shockwave-flash"},
+    {"flv", "video/x-flv"},
+    {"png", "image/png"},
+    {"jpe", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"bmp", "image/bmp"},
+    {"ico", "image/vnd.microsoft.icon"},
+    {"tiff", "image/tiff"},
+    {"tif", "image/tiff"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+};
+
+static constexpr char ascii_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+static constexpr size_t mime_slot(std::string_view ext) {
+    return (ext.size() + ascii_lower(ext.front()) * 29 + ascii_lower(ext.back()) * 14) % 32;
+}
+
+static constexpr auto mime_table = [] {
+    std::array<int8_t, 32> table{};
+    table.fill(-1);
+    for (size_t i = 0; i < std::size(mime_types); ++i) {
+        auto& slot = table[mime_slot(mime_types[i].ext)];
+        if (slot != -1)
+            throw "mime_types collide, change mime_slot()";
+        slot = i;
+    }
+    return table;
+}();
+
+// Return a reasonable mime type based on the extension of a file.
+std::string_view mime_type(std::string_view path) {
+    auto pos = path.rfind('.');
+    if (pos == std::string_view::npos || pos + 1 == path.size() || path.size() - pos > 5)
+        return "application/text";
+    auto ext = path.substr(pos + 1);
+    int i = mime_table[mime_slot(ext)];
+    if (i < 0 || !std::ranges::equal(ext, mime_types[i].ext, [](char a, char b) { return ascii_lower(a) == b; }))
+        return "application/text";
+    return mime_types[i].type;
+}
+
+// Days since 1970-01-01 to a proleptic Gregorian date, see
+// https://howardhinnant.github.io/date_algorithms.html#civil_from_days
+static void civil_from_days(int64_t z, int64_t& y, unsigned& m, unsigned& d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = z - era * 146097;
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yoe + era * 400 + (m <= 2);
+}
+
+static void put2(char* p, unsigned v) {
+    p[0] = '0' + v / 10 % 10;
+    p[1] = '0' + v % 10;
+}
+
+HttpDate to_rfc1123(time_t t) {
+    static constexpr char days[] = "ThuFriSatSunMonTueWed";
+    static constexpr char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    int64_t day = t >= 0 ? t / 86400 : (t - 86399) / 86400;
+    unsigned secs = t - day * 86400;
+    int64_t y;
+    unsigned m, d;
+    civil_from_days(day, y, m, d);
+    y = std::clamp<int64_t>(y, 0, 9999);
+
+    HttpDate out;
+    char* p = out.buf;
+    std::copy_n(days + (day % 7 + 7) % 7 * 3, 3, p);
+    p[3] = ',';
+    p[4] = ' ';
+    put2(p + 5, d);
+    p[7] = ' ';
+    std::copy_n(months + (m - 1) * 3, 3, p + 8);
+    p[11] = ' ';
+    put2(p + 12, y / 100);
+    put2(p + 14, y % 100);
+    p[16] = ' ';
+    put2(p + 17, secs / 3600);
+    p[19] = ':';
+    put2(p + 20, secs / 60 % 60);
+    p[22] = ':';
+    put2(p + 23, secs % 60);
+    std::copy_n(" GMT", 4, p + 25);
+    return out;
+}
+
+// Every response of a second carries the same Date
+struct DateLine {
+    time_t second = -1;
+    char line[6 + sizeof(HttpDate::buf) + 2] = "Date: ";
+};
+
+static const DateLine& date_line_now() {
+    static thread_local DateLine cached;
+    time_t now = std::time(nullptr);
+    if (now != cached.second) {
+        auto date = to_rfc1123(now);
+        std::copy_n(date.buf, sizeof(date.buf), cached.line + 6);
+        std::copy_n("\r\n", 2, cached.line + 6 + sizeof(date.buf));
+        cached.second = now;
+    }
+    return cached;
+}
+
+std::string_view http_date_now() {
+    return std::string_view(date_line_now().line, sizeof(DateLine::line)).substr(6, sizeof(HttpDate::buf));
+}
+
+std::string_view http_date_line_now() {
+    return std::string_view(date_line_now().line, sizeof(DateLine::line));
+}
+
+std::string to_iso8601(time_t t) {
+    std::tm tm{};
+    gmtime_r(&t, &tm);
+
+    char buf[32];
+    std::strftime(buf, sizeof(buf),
+                  "%Y-%m-%dT%H:%M:%S.000Z",
+                  &tm);
+    return buf;
+}
+
+// Continuation tokens are the hex encoded key to resume the listing from
+std::string hex_encode(std::string_view s) {
+    std::string out;
+    out.reserve(s.size() * 2);
+    for (unsigned char c : s) {
+        out.push_back(hex_digits[c >> 4]);
+        out.push_back(hex_digits[c & 0xf]);
+    }
+    return out;
+}
+
+bool hex_decode(std::string_view s, std::string& out) {
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    };
+    if (s.size() % 2)
+        return false;
+    out.clear();
+    for (size_t i = 0; i < s.size(); i += 2) {
+        int hi = nibble(s[i]), lo = nibble(s[i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        out.push_back((char)(hi << 4 | lo));
+    }
+    return true;
+}
+
+ETag current_etag(const Object& o) {
+    ETag etag;
+    char* p = etag.buf;
+    if (o.has_md5) {
+        *p++ = '"';
+        for (uint8_t b : o.md5) {
+            *p++ = hex_digits[b >> 4];
+            *p++ = hex_digits[b & 0xf];
+        }
+        if (o.etag_parts) {
+            *p++ = '-';
+            p = std::to_chars(p, std::end(etag.buf), o.etag_parts).ptr;
+        }
+        *p++ = '"';
+    } else {
+        p += snprintf(p, sizeof(etag.buf), "\"%lx-%lx\"", (unsigned long)o.last_modified, (unsigned long)o.size);
+    }
+    etag.len = p - etag.buf;
+    return etag;
+}
+
+std::string object_etag(const Object& o) {
+    if (!o.has_md5)
+        return {};
+    return std::string(current_etag(o).view());
+}
+
+static void append_contents(std::string& out, std::string_view key, time_t last_modified, size_t size, std::string_view etag) {
+    out.append("<Contents><Key>");
+    xml_escape_append(out, key);
+    out.append("</Key><LastModified>");
+    out.append(to_iso8601(last_modified));
+    out.append("</LastModified>");
+    if (!etag.empty()) {
+        out.append("<ETag>");
+        xml_escape_append(out, etag);
+        out.append("</ETag>");
+    }
+    out.append("<Size>");
+    out.append(std::to_string(size));
+    out.append("</Size><StorageClass>STANDARD</StorageClass></Contents>");
+}
+
+static void append_common_prefix(std::string& out, std::string_view prefix) {
+    out.append("<CommonPrefixes><Prefix>");
+    xml_escape_append(out, prefix);
+    out.append("</Prefix></CommonPrefixes>");
+}
+
+bool parse_list_request(const QueryParams& params, ListRequest& lr) {
+    lr.prefix = params["prefix"];
+    lr.delimiter = !params["delimiter"].empty();
+
+    if (auto* v = params.find("max-keys")) {
+        size_t max_keys;
+        auto [ptr, ec] = std::from_chars(v->data(), v->data() + v->size(), max_keys);
+        if (ec != std::errc() || ptr != v->data() + v->size())
+            return false;
+        lr.max_keys = std::min(max_keys, lr.max_keys);
+    }
+
+    if (auto* v = params.find("start-after")) {
+        lr.start_after = *v;
+        // smallest key strictly greater than start-after
+        lr.from = lr.start_after + '\0';
+    }
+
+    // The token wins over start-after, it's further down the listing anyway
+    if (auto* v = params.find("continuation-token")) {
+        lr.continuation_token = *v;
+        if (!hex_decode(lr.continuation_token, lr.from))
+            return false;
+    }
+
+    if (lr.from < lr.prefix)
+        lr.from = lr.prefix;
+    return true;
+}
+
+// Returns a generator producing the ListObjectsV2 XML a few entries at a time.
+// The index is walked again from the last key for every piece so no lock is
+// held while the response is being sent.
+std::function<bool(std::string&)> list_objects_xml(const IndexStore* index, std::string bucket, ListRequest lr,
+                                                   std::optional<std::vector<FsListEntry>> fs_entries) {
+    struct state {
+        std::string bucket;
+        ListRequest lr;
+        enum { header, entries, trailer } step = header;
+        size_t count = 0;
+        bool truncated = false;
+        bool use_index = false;
+        std::vector<FsListEntry> fs_entries;
+        size_t fs_pos = 0;
+    };
+    auto st = std::make_shared<state>();
+    st->bucket = std::move(bucket);
+    st->lr = std::move(lr);
+    st->use_index = !fs_entries;
+    if (fs_entries)
+        st->fs_entries = std::move(*fs_entries);
+
+    return [index, st](std::string& out) {
+        auto& lr = st->lr;
+        // How many entries go in a single chunk
+        size_t budget = 256;
+
+        switch (st->step) {
+        case state::header:
+            out.append(
+                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+                "<Name>");
+            xml_escape_append(out, st->bucket);
+            out.append("</Name><Prefix>");
+            xml_escape_append(out, lr.prefix);
+            out.append("</Prefix><MaxKeys>" + std::to_string(lr.max_keys) + "</MaxKeys>");
+            if (lr.delimiter)
+                out.append("<Delimiter>/</Delimiter>");
+            st->step = state::entries;
+            return true;
+
+        case state::entries:
+            if (st->use_index) {
+                enum { exhausted, paused, seek, full } stop;
+                do {
+                    stop = exhausted;
+                    index->for_each_prefix(lr.prefix, lr.from, [&](const std::string& key, const Object& o) {
+                        if (o.type != 'f')
+                            return true; // directories aren't objects
+                        if (st->count == lr.max_keys) {
+                            stop = full;
+                            return false;
+                        }
+                        if (budget == 0) {
+                            stop = paused;
+                            return false;
+                        }
+                        st->count++;
+                        budget--;
+                        if (lr.delimiter) {
+                            auto pos = key.find('/', lr.prefix.size());
+                            if (pos != std::string::npos) {
+                                append_common_prefix(out, std::string_view(key).substr(0, pos + 1));
+                                // '/' + 1, jumps over everything under this prefix
+                                lr.from = key.substr(0, pos + 1);
+                                lr.from.back()++;
+                                stop = seek;
+                                return false;
+                            }
+                        }
+                        append_contents(out, key, o.last_modified, o.size, object_etag(o));
+                        lr.from = key;
+                        lr.from.push_back('\0');
+                        return true;
+                    });
+                } while (stop == seek);
+
+                st->truncated = stop == full;
+                if (stop == paused)
+                    return true;
+            } else {
+                auto& entries = st->fs_entries;
+                for (; st->fs_pos < entries.size() && budget > 0; ++st->fs_pos) {
+                    auto& e = entries[st->fs_pos];
+                    if (st->count == lr.max_keys)
+                        break;
+                    if (e.prefix) {
+                        append_common_prefix(out, e.key);
+                        lr.from = e.key;
+                        lr.from.back()++;
+                    } else {
+                        append_contents(out, e.key, e.last_modified, e.size, e.etag);
+                        lr.from = e.key;
+                        lr.from.push_back('\0');
+                    }
+                    st->count++;
+                    budget--;
+                }
+                st->truncated = st->count == lr.max_keys && st->fs_pos < entries.size();
+                if (st->fs_pos < entries.size() && !st->truncated)
+                    return true;
+            }
+            st->step = state::trailer;
+            return true;
+
+        case state::trailer:
+            out.append("<KeyCount>" + std::to_string(st->count) + "</KeyCount>");
+            out.append(st->truncated ? "<IsTruncated>true</IsTruncated>" : "<IsTruncated>false</IsTruncated>");
+            if (st->truncated)
+                out.append("<NextContinuationToken>" + hex_encode(lr.from) + "</NextContinuationToken>");
+            if (!lr.continuation_token.empty()) {
+                out.append("<ContinuationToken>");
+                xml_escape_append(out, lr.continuation_token);
+                out.append("</ContinuationToken>");
+            }
+            if (!lr.start_after.empty()) {
+                out.append("<StartAfter>");
+                xml_escape_append(out, lr.start_after);
+                out.append("</StartAfter>");
+            }
+            out.append("</ListBucketResult>");
+            return false;
+        }
+        return false;
+    };
+}
+
+// %XX and '+' as a space, like Boost.URL's params(). Only copies into the
+// arena when there's something to decode.
+static bool decode_param(std::string_view s, std::pmr::memory_resource* arena, std::string_view& out) {
+    if (s.find_first_of("%+") == std::string_view::npos) {
+        out = s;
+        return true;
+    }
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        c = ascii_lower(c);
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    };
+    char* buf = static_cast<char*>(arena->allocate(s.size(), 1));
+    size_t n = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '+') {
+            buf[n++] = ' ';
+        } else if (s[i] == '%') {
+            if (i + 2 >= s.size())
+                return false;
+            int hi = nibble(s[i + 1]), lo = nibble(s[i + 2]);
+            if (hi < 0 || lo < 0)
+                return false;
+            buf[n++] = (char)(hi << 4 | lo);
+            i += 2;
+        } else {
+            buf[n++] = s[i];
+        }
+    }
+    out = std::string_view(buf, n);
+    return true;
+}
+
+bool QueryParams::parse(std::string_view target, std::pmr::memory_resource* arena) {
+    count = 0;
+    auto url = boost::urls::parse_relative_ref(target);
+    if (!url)
+        return false;
+
+    std::string_view query = url->encoded_query();
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        auto param = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+        if (param.empty())
+            continue;
+        if (count == max_params)
+            return false;
+
+        auto eq = param.find('=');
+        auto& [key, value] = params[count];
+        if (!decode_param(param.substr(0, eq), arena, key))
+            return false;
+        value = {};
+        if (eq != std::string_view::npos && !decode_param(param.substr(eq + 1), arena, value))
+            return false;
+        if (!find(key))
+            count++;
+    }
+    return true;
+}
+
+const std::string_view* QueryParams::find(std::string_view key) const {
+    for (size_t i = 0; i < count; ++i) {
+        if (params[i].first == key)
+            return &params[i].second;
+    }
+    return nullptr;
+}
+
+std::string_view target_key(std::string_view target, std::string_view bucket_name) {
+    if (target.starts_with('/') && target.substr(1).starts_with(bucket_name))
+        target.remove_prefix(bucket_name.size() + 1); // removes `/bucketname`
+
+    // The query string isn't part of the key
+    target = target.substr(0, target.find('?'));
+
+    // We have a /something, erase the /
+    if (target.starts_with('/'))
+        target.remove_prefix(1);
+    return target;
+}
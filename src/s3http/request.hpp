@@ -0,0 +1,175 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/fields.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/parser.hpp>
+
+#include "../index/index.hpp"
+
+// The parts of serving a request that need neither a socket nor the
+// filesystem: parsing the target, picking headers, rendering listings.
+// Kept apart from the server so bench/request_bench can time them alone.
+
+// Scratch memory for everything that lives as long as one request on a
+// connection: its headers, the response's, decoded query parameters. Bump
+// allocated, freed all at once by reset() before the next request, so a
+// HEAD or small GET never goes to malloc. Requests with unusually large
+// headers spill over to the heap until the next reset.
+class RequestArena {
+    public:
+        RequestArena() : pool(buffer.data(), buffer.size(), std::pmr::new_delete_resource()) {}
+        RequestArena(const RequestArena&) = delete;
+        RequestArena& operator=(const RequestArena&) = delete;
+
+        std::pmr::memory_resource* resource() { return &pool; }
+        void reset() { pool.release(); }
+
+    private:
+        alignas(std::max_align_t) std::array<std::byte, 16 << 10> buffer;
+        std::pmr::monotonic_buffer_resource pool;
+};
+
+// Allocates from a RequestArena, or the heap when default constructed.
+// Unlike std::pmr's allocator it follows the container around on moves,
+// a request moved out of its parser keeps its headers where they are.
+template <class T>
+class ArenaAllocator {
+    public:
+        using value_type = T;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+
+        ArenaAllocator() = default;
+        ArenaAllocator(std::pmr::memory_resource* r) : r(r) {}
+        template <class U>
+        ArenaAllocator(const ArenaAllocator<U>& other) : r(other.resource()) {}
+
+        T* allocate(size_t n) { return static_cast<T*>(r->allocate(n * sizeof(T), alignof(T))); }
+        void deallocate(T* p, size_t n) { r->deallocate(p, n * sizeof(T), alignof(T)); }
+        std::pmr::memory_resource* resource() const { return r; }
+
+        template <class U>
+        bool operator==(const ArenaAllocator<U>& other) const { return r == other.resource(); }
+
+    private:
+        std::pmr::memory_resource* r = std::pmr::new_delete_resource();
+};
+
+// Requests and the HEAD/GET responses keep their headers in the
+// connection's RequestArena
+using arena_fields = boost::beast::http::basic_fields<ArenaAllocator<char>>;
+template <class Body>
+using arena_request = boost::beast::http::request<Body, arena_fields>;
+template <class Body>
+using arena_response = boost::beast::http::response<Body, arena_fields>;
+template <class Body>
+using arena_parser = boost::beast::http::request_parser<Body, ArenaAllocator<char>>;
+
+// ListObjectsV2 parameters
+struct ListRequest {
+    std::string prefix;
+    // First key to consider (inclusive), from start-after or the token
+    std::string from;
+    std::string continuation_token;
+    std::string start_after;
+    size_t max_keys = 1000;
+    // Only '/' is supported, no delimiter means a recursive listing
+    bool delimiter = false;
+};
+
+// A listing entry read off the filesystem when the index isn't there
+struct FsListEntry {
+    std::string key;
+    bool prefix; // directory, rendered as a CommonPrefix
+    size_t size = 0;
+    time_t last_modified = 0;
+    std::string etag{};
+};
+
+// Query string parameters of a request target, decoded. The values point
+// into the target, or into the arena for the few that had to be decoded.
+// Duplicates keep their first value.
+class QueryParams {
+    public:
+        // More than any S3 request sends
+        static constexpr size_t max_params = 32;
+
+        // False if `target` isn't a valid target or has too many parameters
+        bool parse(std::string_view target, std::pmr::memory_resource* arena);
+
+        // nullptr when the parameter isn't there
+        const std::string_view* find(std::string_view key) const;
+        bool contains(std::string_view key) const { return find(key) != nullptr; }
+        // Empty when the parameter isn't there
+        std::string_view operator[](std::string_view key) const {
+            auto* v = find(key);
+            return v ? *v : std::string_view{};
+        }
+        bool empty() const { return count == 0; }
+
+    private:
+        std::array<std::pair<std::string_view, std::string_view>, max_params> params;
+        size_t count = 0;
+};
+
+// The object key a request target is about: no /bucket, no query string
+std::string_view target_key(std::string_view target, std::string_view bucket_name);
+bool parse_list_request(const QueryParams& params, ListRequest& lr);
+
+// "Sun, 06 Nov 1994 08:49:37 GMT", formatted without strftime or the heap
+struct HttpDate {
+    char buf[29];
+    std::string_view view() const { return {buf, sizeof(buf)}; }
+};
+
+// An ETag, quotes included, formatted without the heap
+struct ETag {
+    char buf[48];
+    uint8_t len = 0;
+    std::string_view view() const { return {buf, len}; }
+};
+
+std::string_view mime_type(std::string_view path);
+HttpDate to_rfc1123(time_t t);
+// The time now as a Date header value, formatted once a second per thread
+std::string_view http_date_now();
+// Same, as a whole "Date: ...\r\n" header line
+std::string_view http_date_line_now();
+std::string to_iso8601(time_t t);
+std::string hex_encode(std::string_view s);
+bool hex_decode(std::string_view s, std::string& out);
+// S3 ETag of `o`, empty when lobos never computed its MD5
+std::string object_etag(const Object& o);
+// ETag sent on HEAD/GET and checked by conditional requests. Files lobos
+// has no MD5 for get one made of their mtime and size, it changes whenever
+// they're rewritten.
+ETag current_etag(const Object& o);
+
+// Headers HEAD and GET send about `key`
+template <class Fields>
+void set_object_headers(Fields& fields, std::string_view key, time_t last_modified, std::string_view etag) {
+    namespace http = boost::beast::http;
+    fields.set(http::field::content_type, mime_type(key));
+    fields.set(http::field::last_modified, to_rfc1123(last_modified).view());
+    fields.set(http::field::accept_ranges, "bytes");
+    fields.set(http::field::etag, etag);
+}
+
+// Returns a generator producing the ListObjectsV2 XML of `bucket` a few
+// entries at a time, from `fs_entries` if given or else from `index`
+std::function<bool(std::string&)> list_objects_xml(const IndexStore* index, std::string bucket, ListRequest lr,
+                                                   std::optional<std::vector<FsListEntry>> fs_entries);
@@ -0,0 +1,643 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "checksum.hpp"
+#include "segment_store.hpp"
+
+// Segments are sealed past this size, compaction works on whole segments
+#define SEGMENT_BYTES (256ULL << 20)
+// Sealed segments with at least that much dead space get compacted
+#define COMPACT_DEAD_PCT 50
+#define COMPACT_POLL_SEC 10
+#define READ_BUFFER (4 << 20)
+
+#define RECORD_MAGIC 0x4b41504cU // "LPAK"
+#define RECORD_TOMBSTONE 1
+
+struct SegmentStore::RecordHeader {
+    uint32_t magic;
+    uint32_t crc;       // crc32c of everything after it, key and data included
+    uint64_t seq;
+    int64_t  mtime_ns;
+    uint64_t size;      // of the data, 0 for tombstones
+    uint16_t key_len;
+    uint8_t  flags;
+    uint8_t  has_md5;
+    uint32_t etag_parts;
+    uint8_t  md5[16];
+};
+static_assert(sizeof(SegmentStore::RecordHeader) == 56);
+
+static boost::system::error_code last_error() {
+    return boost::system::error_code(errno, boost::system::system_category());
+}
+
+static int64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// pwritev(2) until everything is written
+static int pwrite_all(int fd, iovec* iov, int iovcnt, uint64_t offset) {
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, iovcnt, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+namespace {
+
+// Walks the records of a segment in order through a big buffer. Stops at the
+// end or at the first torn or corrupt record, position() is then where the
+// good ones end.
+class RecordReader {
+    public:
+        using RecordHeader = SegmentStore::RecordHeader;
+
+        RecordReader(int fd, uint64_t end) : fd(fd), end(end), buf(READ_BUFFER) {}
+
+        // `key` and `data` are only valid until the next call
+        bool next(uint64_t& offset, RecordHeader& hdr, std::string_view& key, std::string_view& data) {
+            if (!fill(sizeof(hdr)))
+                return false;
+            std::memcpy(&hdr, buf.data() + (pos - buf_off), sizeof(hdr));
+            if (hdr.magic != RECORD_MAGIC || hdr.size > end)
+                return false;
+            uint64_t len = sizeof(hdr) + hdr.key_len + hdr.size;
+            if (!fill(len))
+                return false;
+            const char* p = buf.data() + (pos - buf_off);
+            constexpr size_t covered = offsetof(RecordHeader, seq);
+            if (crc32c_update(0, p + covered, len - covered) != hdr.crc)
+                return false;
+            offset = pos;
+            key = {p + sizeof(hdr), hdr.key_len};
+            data = {p + sizeof(hdr) + hdr.key_len, hdr.size};
+            pos += len;
+            return true;
+        }
+
+        uint64_t position() const { return pos; }
+        bool failed() const { return error; }
+
+    private:
+        // Makes sure the `n` bytes at `pos` are in the buffer
+        bool fill(uint64_t n) {
+            if (pos + n > end)
+                return false;
+            if (pos >= buf_off && pos + n <= buf_off + buf_len)
+                return true;
+            if (buf.size() < n)
+                buf.resize(n);
+            buf_off = pos;
+            buf_len = 0;
+            while (buf_len < n) {
+                size_t want = std::min<uint64_t>(buf.size() - buf_len, end - buf_off - buf_len);
+                ssize_t r = pread(fd, buf.data() + buf_len, want, buf_off + buf_len);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0) {
+                    error = r < 0;
+                    return false;
+                }
+                buf_len += r;
+            }
+            return true;
+        }
+
+        int fd;
+        uint64_t end;
+        uint64_t pos = 0;
+        std::vector<char> buf;
+        uint64_t buf_off = 0;
+        size_t buf_len = 0;
+        bool error = false;
+};
+
+}
+
+SegmentStore::Segment::~Segment() {
+    if (fd >= 0)
+        close(fd);
+}
+
+SegmentStore::SegmentStore(std::string dir, int writers, IndexStore& index)
+    : dir(std::move(dir)), index(index)
+{
+    if (mkdir(this->dir.c_str(), 0755) != 0 && errno != EEXIST)
+        std::cerr << "Failed to create " << this->dir << ": " << std::strerror(errno) << std::endl;
+    for (int i = 0; i < std::max(writers, 1); ++i)
+        this->writers.push_back(std::make_unique<Writer>());
+}
+
+SegmentStore::~SegmentStore() {
+    {
+        std::lock_guard lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+std::string SegmentStore::segment_path(uint32_t id) const {
+    char name[16];
+    snprintf(name, sizeof(name), "%08u.seg", id);
+    return dir + "/" + name;
+}
+
+std::shared_ptr<SegmentStore::Segment> SegmentStore::find(uint32_t id) const {
+    std::shared_lock lock(segments_mtx);
+    auto it = segments.find(id);
+    return it == segments.end() ? nullptr : it->second;
+}
+
+SegmentStore::Writer& SegmentStore::writer() {
+    // Server threads stick to one writer each
+    static std::atomic<unsigned> next_slot{0};
+    thread_local unsigned slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+    return *writers[slot % writers.size()];
+}
+
+void SegmentStore::recover() {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<uint32_t> ids;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (auto* e = readdir(d)) {
+            std::string_view name = e->d_name;
+            if (name.size() == 12 && name.ends_with(".seg"))
+                ids.push_back(std::strtoul(e->d_name, nullptr, 10));
+        }
+        closedir(d);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    // Newest record of every key across all segments
+    struct Latest {
+        uint32_t segment;
+        uint64_t offset;
+        uint64_t len;
+        RecordHeader hdr;
+    };
+    std::unordered_map<std::string, Latest> latest;
+    uint64_t max_seq = 0;
+
+    for (auto id : ids) {
+        auto path = segment_path(id);
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "Can't open segment " << path << ": " << std::strerror(errno) << std::endl;
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        // A spare nobody got to use
+        if (st.st_size == 0) {
+            close(fd);
+            unlink(path.c_str());
+            continue;
+        }
+        auto seg = std::make_shared<Segment>();
+        seg->id = id;
+        seg->fd = fd;
+        seg->sealed = true;
+        segments.emplace(id, seg);
+
+        RecordReader reader(fd, st.st_size);
+        uint64_t off;
+        RecordHeader hdr;
+        std::string_view key, data;
+        while (reader.next(off, hdr, key, data)) {
+            uint64_t len = sizeof(hdr) + key.size() + data.size();
+            bool tombstone = hdr.flags & RECORD_TOMBSTONE;
+            max_seq = std::max(max_seq, hdr.seq);
+            seg->min_seq = std::min(seg->min_seq.load(), hdr.seq);
+
+            auto [it, inserted] = latest.try_emplace(std::string(key));
+            if (!inserted && it->second.hdr.seq >= hdr.seq) {
+                if (!tombstone)
+                    seg->dead += len;
+                continue;
+            }
+            if (!inserted && !(it->second.hdr.flags & RECORD_TOMBSTONE))
+                mark_dead(it->second.segment, it->second.len);
+            it->second = {id, off + sizeof(hdr) + key.size(), len, hdr};
+        }
+
+        // Only the tail can be torn, it's what was being written on a crash
+        uint64_t good = reader.position();
+        if (good < (uint64_t)st.st_size) {
+            std::cerr << "Segment " << path << ": dropping " << (st.st_size - good)
+                      << " bytes of torn records" << std::endl;
+            if (ftruncate(fd, good) != 0)
+                std::cerr << "Can't truncate " << path << ": " << std::strerror(errno) << std::endl;
+        }
+        seg->size = good;
+    }
+    next_id = ids.empty() ? 1 : ids.back() + 1;
+    next_seq = max_seq + 1;
+
+    uint64_t recovered = 0, stale = 0;
+    for (auto& [key, l] : latest) {
+        if (l.hdr.flags & RECORD_TOMBSTONE)
+            continue;
+        Object cur;
+        if (index.get(key, cur)) {
+            if (cur.type == 'd') {
+                mark_dead(l.segment, l.len);
+                continue;
+            }
+            // A plain file written after the packed copy wins, one from
+            // before is what a PUT crashed before removing
+            struct stat st;
+            if (lstat(key.c_str(), &st) == 0) {
+                int64_t file_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+                if (file_ns > l.hdr.mtime_ns) {
+                    mark_dead(l.segment, l.len);
+                    continue;
+                }
+                unlink(key.c_str());
+                stale++;
+            }
+        }
+        Object o{l.hdr.size, (time_t)(l.hdr.mtime_ns / 1000000000LL), 'f'};
+        o.has_md5 = l.hdr.has_md5;
+        o.etag_parts = l.hdr.etag_parts;
+        std::copy(std::begin(l.hdr.md5), std::end(l.hdr.md5), o.md5.begin());
+        o.segment = l.segment;
+        o.offset = l.offset;
+        index.add_entry(key, o);
+        recovered++;
+    }
+
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start;
+    std::cout << "Recovered " << recovered << " packed objects from " << ids.size() << " segments in "
+              << elapsed_seconds.count() << " seconds";
+    if (stale)
+        std::cout << ", " << stale << " stale files removed";
+    std::cout << std::endl;
+
+    make_spares();
+    thread = std::thread([this] { run_compactor(); });
+}
+
+std::shared_ptr<SegmentStore::Segment> SegmentStore::create_segment(boost::system::error_code& ec) {
+    uint32_t id = next_id.fetch_add(1);
+    auto path = segment_path(id);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ec = last_error();
+        return nullptr;
+    }
+    // The new name has to be as durable as what gets appended to it
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    auto seg = std::make_shared<Segment>();
+    seg->id = id;
+    seg->fd = fd;
+    {
+        std::unique_lock lock(segments_mtx);
+        segments.emplace(id, seg);
+    }
+    return seg;
+}
+
+boost::system::error_code SegmentStore::roll(Writer& w) {
+    auto seg = std::move(w.spare);
+    if (seg) {
+        {
+            std::lock_guard lock(mtx);
+            want_spares = true;
+        }
+        cv.notify_one();
+    } else {
+        // None made yet or the compactor is behind, the compactor's own
+        // writer always gets here
+        boost::system::error_code ec;
+        seg = create_segment(ec);
+        if (!seg)
+            return ec;
+    }
+    if (w.seg)
+        w.seg->sealed = true;
+    w.seg = std::move(seg);
+    return {};
+}
+
+void SegmentStore::make_spares() {
+    for (auto& w : writers) {
+        {
+            std::lock_guard lock(w->mtx);
+            if (w->spare)
+                continue;
+        }
+        // Only this thread makes spares, nobody fills the slot meanwhile
+        boost::system::error_code ec;
+        auto seg = create_segment(ec);
+        if (!seg) {
+            std::cerr << "Can't create segment in " << dir << ": " << ec.message() << std::endl;
+            return;
+        }
+        std::lock_guard lock(w->mtx);
+        w->spare = std::move(seg);
+    }
+}
+
+boost::system::error_code SegmentStore::append_record(Writer& w, RecordHeader& hdr, std::string_view key,
+                                                      std::string_view data, uint32_t& segment, uint64_t& offset) {
+    uint64_t len = sizeof(hdr) + key.size() + data.size();
+
+    std::lock_guard lock(w.mtx);
+    if (!w.seg || w.seg->size.load(std::memory_order_relaxed) + len > SEGMENT_BYTES) {
+        if (auto ec = roll(w))
+            return ec;
+    }
+    // Compaction keeps the original one
+    if (!hdr.seq)
+        hdr.seq = next_seq.fetch_add(1, std::memory_order_relaxed);
+    hdr.magic = RECORD_MAGIC;
+    hdr.key_len = key.size();
+    constexpr size_t covered = offsetof(RecordHeader, seq);
+    uint32_t crc = crc32c_update(0, reinterpret_cast<const char*>(&hdr) + covered, sizeof(hdr) - covered);
+    crc = crc32c_update(crc, key.data(), key.size());
+    hdr.crc = crc32c_update(crc, data.data(), data.size());
+
+    auto& seg = *w.seg;
+    uint64_t off = seg.size.load(std::memory_order_relaxed);
+    iovec iov[3] = {
+        {&hdr, sizeof(hdr)},
+        {const_cast<char*>(key.data()), key.size()},
+        {const_cast<char*>(data.data()), data.size()},
+    };
+    // A failed append leaves garbage past `size`, the next one overwrites it
+    if (int err = pwrite_all(seg.fd, iov, 3, off))
+        return boost::system::error_code(err, boost::system::system_category());
+    seg.size.store(off + len, std::memory_order_relaxed);
+
+    uint64_t min = seg.min_seq.load(std::memory_order_relaxed);
+    while (hdr.seq < min && !seg.min_seq.compare_exchange_weak(min, hdr.seq))
+        ;
+    segment = seg.id;
+    offset = off + sizeof(hdr) + key.size();
+    return {};
+}
+
+boost::system::error_code SegmentStore::append(std::string_view key, std::string_view data, Object& o) {
+    if (key.size() > UINT16_MAX)
+        return boost::system::errc::make_error_code(boost::system::errc::filename_too_long);
+
+    RecordHeader hdr{};
+    hdr.mtime_ns = now_ns();
+    hdr.size = data.size();
+    hdr.has_md5 = o.has_md5;
+    hdr.etag_parts = o.etag_parts;
+    std::copy(o.md5.begin(), o.md5.end(), hdr.md5);
+    if (auto ec = append_record(writer(), hdr, key, data, o.segment, o.offset))
+        return ec;
+    o.last_modified = hdr.mtime_ns / 1000000000LL;
+    appended.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard lock(pending_mtx);
+    pending[std::string(key)] = {o.segment, o.offset};
+    return {};
+}
+
+bool SegmentStore::claim(std::string_view key, const Object& o) {
+    std::lock_guard lock(pending_mtx);
+    auto it = pending.find(std::string(key));
+    if (it == pending.end() || it->second != std::pair{o.segment, o.offset})
+        return false;
+    pending.erase(it);
+    return true;
+}
+
+void SegmentStore::remove(std::string_view key, const Object& old) {
+    RecordHeader hdr{};
+    hdr.mtime_ns = now_ns();
+    hdr.flags = RECORD_TOMBSTONE;
+    uint32_t segment;
+    uint64_t offset;
+    if (auto ec = append_record(writer(), hdr, key, {}, segment, offset))
+        std::cerr << "Can't write tombstone for " << key << ", it will be back on restart: " << ec.message() << std::endl;
+    else
+        tombstones.fetch_add(1, std::memory_order_relaxed);
+    release(key, old);
+    // A PUT of `key` still waiting for durability was overtaken
+    std::lock_guard lock(pending_mtx);
+    pending.erase(std::string(key));
+}
+
+void SegmentStore::release(std::string_view key, const Object& old) {
+    mark_dead(old.segment, sizeof(RecordHeader) + key.size() + old.size);
+}
+
+void SegmentStore::mark_dead(uint32_t segment, uint64_t bytes) {
+    // Already compacted away, nothing to account for
+    if (auto seg = find(segment))
+        seg->dead.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+int SegmentStore::open(uint32_t segment) const {
+    std::shared_lock lock(segments_mtx);
+    auto it = segments.find(segment);
+    if (it == segments.end())
+        return -1;
+    return fcntl(it->second->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+boost::system::error_code SegmentStore::sync(uint32_t segment) const {
+    auto seg = find(segment);
+    if (!seg)
+        return {};
+    if (fdatasync(seg->fd) != 0)
+        return last_error();
+    return {};
+}
+
+void SegmentStore::run_compactor() {
+    // Space comes back a bit later when we're busy, that's fine
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    std::unique_lock lock(mtx);
+    while (!stopping) {
+        bool woken = cv.wait_for(lock, std::chrono::seconds(COMPACT_POLL_SEC), [&] { return stopping || want_spares; });
+        if (stopping)
+            break;
+        want_spares = false;
+        lock.unlock();
+        make_spares();
+        if (woken) {
+            lock.lock();
+            continue;
+        }
+        std::vector<std::shared_ptr<Segment>> victims;
+        {
+            std::shared_lock slock(segments_mtx);
+            for (auto& [id, seg] : segments) {
+                if (seg->sealed && seg->dead * 100 >= seg->size * COMPACT_DEAD_PCT)
+                    victims.push_back(seg);
+            }
+        }
+        for (auto& seg : victims) {
+            if (stopping)
+                break;
+            compact(seg);
+            make_spares();
+        }
+        lock.lock();
+    }
+}
+
+bool SegmentStore::compact(const std::shared_ptr<Segment>& seg) {
+    auto start = std::chrono::steady_clock::now();
+
+    // A tombstone still matters while an older record of its key may exist
+    // elsewhere
+    uint64_t min_other = UINT64_MAX;
+    {
+        std::shared_lock lock(segments_mtx);
+        for (auto& [id, s] : segments) {
+            if (id != seg->id)
+                min_other = std::min(min_other, s->min_seq.load());
+        }
+    }
+
+    struct Moved {
+        std::string key;
+        uint64_t from;
+        uint32_t segment;
+        uint64_t offset;
+        uint64_t len;
+    };
+    std::vector<Moved> moved;
+    std::vector<uint32_t> outputs;
+    uint64_t kept = 0;
+    auto fail = [&](const char* what, boost::system::error_code ec) {
+        std::cerr << "Compaction of segment " << seg->id << " failed, " << what << ": " << ec.message() << std::endl;
+        // The copies made so far are just dead weight now
+        for (auto& m : moved)
+            mark_dead(m.segment, m.len);
+        return false;
+    };
+    auto waiting = [&](std::string_view key, uint64_t offset) {
+        std::lock_guard lock(pending_mtx);
+        auto it = pending.find(std::string(key));
+        return it != pending.end() && it->second == std::pair{seg->id, offset};
+    };
+
+    RecordReader reader(seg->fd, seg->size);
+    uint64_t off;
+    RecordHeader hdr;
+    std::string_view key, data;
+    while (reader.next(off, hdr, key, data)) {
+        uint64_t from = off + sizeof(hdr) + key.size();
+        uint64_t len = sizeof(hdr) + key.size() + data.size();
+        bool tombstone = hdr.flags & RECORD_TOMBSTONE;
+        if (tombstone) {
+            if (hdr.seq <= min_other)
+                continue;
+        } else {
+            Object cur;
+            if (!index.get(key, cur) || cur.segment != seg->id || cur.offset != from) {
+                // Not in the index yet, the PUT is waiting for durability.
+                // Next round.
+                if (waiting(key, from)) {
+                    for (auto& m : moved)
+                        mark_dead(m.segment, m.len);
+                    return false;
+                }
+                continue;
+            }
+        }
+        uint32_t to;
+        uint64_t to_off;
+        if (auto ec = append_record(compact_writer, hdr, key, data, to, to_off))
+            return fail("append", ec);
+        if (outputs.empty() || outputs.back() != to)
+            outputs.push_back(to);
+        kept += len;
+        if (!tombstone)
+            moved.push_back({std::string(key), from, to, to_off, len});
+    }
+    if (reader.failed())
+        return fail("read", last_error());
+    if (reader.position() != seg->size)
+        return fail("read", boost::system::errc::make_error_code(boost::system::errc::io_error));
+
+    // The copies must be on disk before the originals go
+    for (auto id : outputs) {
+        if (auto ec = sync(id))
+            return fail("sync", ec);
+    }
+    // Whatever was overwritten or deleted meanwhile keeps its new state
+    for (auto& m : moved) {
+        if (!index.relocate(m.key, seg->id, m.from, m.segment, m.offset))
+            mark_dead(m.segment, m.len);
+    }
+    {
+        std::unique_lock lock(segments_mtx);
+        segments.erase(seg->id);
+    }
+    unlink(segment_path(seg->id).c_str());
+
+    uint64_t reclaimed = seg->size - kept;
+    compactions.fetch_add(1, std::memory_order_relaxed);
+    reclaimed_bytes.fetch_add(reclaimed, std::memory_order_relaxed);
+    std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - start;
+    std::cout << "Compacted segment " << seg->id << ": " << moved.size() << " objects moved, "
+              << (reclaimed >> 20) << " MiB reclaimed in " << elapsed_seconds.count() << " seconds" << std::endl;
+    return true;
+}
+
+void SegmentStore::print_stats(std::ostream& os) const {
+    uint64_t count = 0, bytes = 0, dead = 0;
+    {
+        std::shared_lock lock(segments_mtx);
+        for (auto& [id, seg] : segments) {
+            count++;
+            bytes += seg->size;
+            dead += seg->dead;
+        }
+    }
+    os << "Segments: count=" << count
+       << " bytes=" << bytes
+       << " dead=" << dead
+       << " appended=" << appended.load(std::memory_order_relaxed)
+       << " tombstones=" << tombstones.load(std::memory_order_relaxed)
+       << " compactions=" << compactions.load(std::memory_order_relaxed)
+       << " reclaimed=" << reclaimed_bytes.load(std::memory_order_relaxed) << std::endl;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/system/error_code.hpp>
+
+#include "../index/index.hpp"
+
+// Small objects packed into append-only segment files (--pack-max-kb).
+//
+// Below a few dozen KiB a PUT is mostly create_directories, open, close and
+// a new inode. Packed objects are appended to a segment in .lobos-segments/
+// instead, one writer per server thread so appends don't contend, and the
+// index maps their key to (segment, offset). GETs read them at that offset,
+// sendfile included.
+//
+// Each record carries its key, mtime, MD5 and a sequence number so the index
+// can be rebuilt from the segments alone. Deletes, and plain files written
+// over a packed object, append a tombstone. On recovery the highest sequence
+// number of a key wins and a torn record ends its segment. For that to agree
+// with what GETs saw, the records of a key are appended under its index shard
+// lock, tombstones together with the index change, and a PUT only publishes
+// its record if nothing newer was appended for the key while it waited for
+// durability.
+//
+// A compactor thread rewrites sealed segments that are mostly dead: the live
+// records are appended to a new segment, the index is moved over entry by
+// entry (only where it still points to the old copy) and the old file goes.
+// GETs hold their own fd on the segment so that's safe under them.
+class SegmentStore {
+    public:
+        // Segments live in `dir`, relative to the bucket, appended to by
+        // `writers` writers
+        SegmentStore(std::string dir, int writers, IndexStore& index);
+        ~SegmentStore();
+
+        // Puts the packed objects back in the index, the index must be
+        // ready. Where a plain file has the same key the newest one wins,
+        // a stale file is removed.
+        void recover();
+
+        // Appends `data` as `key`, with the ETag and mtime of `o`. Fills in
+        // `o.segment` and `o.offset`. Under the index shard lock of `key`.
+        boost::system::error_code append(std::string_view key, std::string_view data, Object& o);
+        // Under the index shard lock of `key`, right before `o`, appended
+        // earlier, goes in the index: false if a newer record of `key` was
+        // appended since, `o` must then be released instead
+        bool claim(std::string_view key, const Object& o);
+        // `old`, the packed copy of `key`, was deleted or replaced by a plain
+        // file and must not come back on restart. Under the index shard lock
+        // of `key`, together with that change.
+        void remove(std::string_view key, const Object& old);
+        // `old` was replaced by a newer packed copy, its space is reclaimable
+        void release(std::string_view key, const Object& old);
+
+        // A new fd on `segment` for the caller to read and close, -1 if the
+        // segment was compacted away
+        int open(uint32_t segment) const;
+        // Makes what was appended to `segment` durable, for --durability=sync
+        boost::system::error_code sync(uint32_t segment) const;
+
+        void print_stats(std::ostream& os) const;
+
+        // On-disk layout of a record, followed by its key and data
+        struct RecordHeader;
+
+    private:
+        struct Segment {
+            uint32_t id = 0;
+            int fd = -1;
+            std::atomic<uint64_t> size{0};
+            // Bytes of records nothing points to anymore
+            std::atomic<uint64_t> dead{0};
+            // Oldest record in there, tombstones can only be dropped once
+            // nothing older is left anywhere
+            std::atomic<uint64_t> min_seq{UINT64_MAX};
+            // Full, never appended to again
+            std::atomic<bool> sealed{false};
+            ~Segment();
+        };
+
+        struct Writer {
+            std::mutex mtx;
+            std::shared_ptr<Segment> seg;
+            // Created ahead by the compactor thread, so that server threads
+            // rolling over don't open files and fsync the directory
+            std::shared_ptr<Segment> spare;
+        };
+
+        std::string segment_path(uint32_t id) const;
+        std::shared_ptr<Segment> find(uint32_t id) const;
+        Writer& writer();
+        std::shared_ptr<Segment> create_segment(boost::system::error_code& ec);
+        boost::system::error_code roll(Writer& w);
+        void make_spares();
+        boost::system::error_code append_record(Writer& w, RecordHeader& hdr, std::string_view key,
+                                                std::string_view data, uint32_t& segment, uint64_t& offset);
+        void mark_dead(uint32_t segment, uint64_t bytes);
+
+        void run_compactor();
+        bool compact(const std::shared_ptr<Segment>& seg);
+
+        std::string dir;
+        IndexStore& index;
+
+        mutable std::shared_mutex segments_mtx;
+        std::map<uint32_t, std::shared_ptr<Segment>> segments;
+        std::vector<std::unique_ptr<Writer>> writers;
+        // The compactor's own, live records are copied through it
+        Writer compact_writer;
+        std::atomic<uint32_t> next_id{1};
+        std::atomic<uint64_t> next_seq{1};
+        // Where the newest record of a key waiting to be claimed is
+        std::mutex pending_mtx;
+        std::unordered_map<std::string, std::pair<uint32_t, uint64_t>> pending;
+
+        std::atomic<uint64_t> appended{0};
+        std::atomic<uint64_t> tombstones{0};
+        std::atomic<uint64_t> compactions{0};
+        std::atomic<uint64_t> reclaimed_bytes{0};
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        // A writer used its spare, under `mtx`
+        bool want_spares = false;
+        std::atomic<bool> stopping{false};
+        std::thread thread;
+};
@@ -1,17 +1,44 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <random>
 #include <tuple>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <pthread.h>
 #include <sched.h>
-
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <boost/asio/detached.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/write.hpp>
+#ifdef BOOST_ASIO_HAS_IO_URING
+#include <boost/asio/as_tuple.hpp>
+#include <boost/asio/random_access_file.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write_at.hpp>
+#endif
 #include <boost/filesystem.hpp>
-#include <boost/range/iterator_range.hpp>
 #include <boost/url.hpp>
 
+#include "put_body.hpp"
 #include "server.hpp"
+#include "xml.hpp"
 
 #define SERVER_NAME "LOBOS BB"
 // Set to ext4 max file size (16TiB)
 #define MAX_OBJ_SIZE 16ULL<<40
 #define PATH_DELIM '/'
+#define PATH_DELIM_STR "/"
 
 namespace beast = boost::beast;
 namespace http  = beast::http;
@@ -30,220 +57,373 @@ void pin_thread_to_core(int core_id) {
     );
 }
 
-// Return a reasonable mime type based on the extension of a file.
-beast::string_view S3HttpServer::mime_type(beast::string_view path) {
-    using beast::iequals;
-    auto const ext = [&path]
-    {
-        auto const pos = path.rfind(".");
-        if(pos == beast::string_view::npos)
-            return beast::string_view{};
-        return path.substr(pos);
-    }();
-    if(iequals(ext, ".htm"))  return "text/html";
-    if(iequals(ext, ".html")) return "text/html";
-    if(iequals(ext, ".php"))  return "text/html";
-    if(iequals(ext, ".css"))  return "text/css";
-    if(iequals(ext, ".txt"))  return "text/plain";
-    if(iequals(ext, ".js"))   return "application/javascript";
-    if(iequals(ext, ".json")) return "application/json";
-    if(iequals(ext, ".xml"))  return "application/xml";
-    if(iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-    if(iequals(ext, ".flv"))  return "video/x-flv";
-    if(iequals(ext, ".png"))  return "image/png";
-    if(iequals(ext, ".jpe"))  return "image/jpeg";
-    if(iequals(ext, ".jpeg")) return "image/jpeg";
-    if(iequals(ext, ".jpg"))  return "image/jpeg";
-    if(iequals(ext, ".gif"))  return "image/gif";
-    if(iequals(ext, ".bmp"))  return "image/bmp";
-    if(iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-    if(iequals(ext, ".tiff")) return "image/tiff";
-    if(iequals(ext, ".tif"))  return "image/tiff";
-    if(iequals(ext, ".svg"))  return "image/svg+xml";
-    if(iequals(ext, ".svgz")) return "image/svg+xml";
-    return "application/text";
-}
-
-std::string S3HttpServer::to_rfc1123(time_t t) {
-    std::tm tm{};
-    gmtime_r(&t, &tm);
+static std::string_view strip_quotes(std::string_view s) {
+    if (s.size() >= 2 && s.front() == '"' && s.back() == '"')
+        return s.substr(1, s.size() - 2);
+    return s;
+}
+
 
-    char buf[30];
-    std::strftime(buf, sizeof(buf),
-                  "%a, %d %b %Y %H:%M:%S GMT",
-                  &tm);
-    return buf; 
+static bool key_less(const FsListEntry& a, const FsListEntry& b) {
+    return a.key < b.key;
 }
 
-std::string S3HttpServer::do_list_objects(std::string prefix) {
-    std::string data;
-    data.reserve(8192); //idk man 8k feels plenty provided we do the max-keys 1000 thing
-    data.append(
-        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
-        "<ListBucketResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
-        "<Name>" + bucket_name + "</Name>"
-        "<Prefix>" + prefix + "</Prefix>"
-        "<MaxKeys>1000</MaxKeys><IsTruncated>false</IsTruncated>"
-    );
-    if(index_store_) {
-        std::unordered_set<std::string> seen;
-        std::string last_entry;
+// The first `want` keys of the listing past `from` (`from` included unless
+// `after`), sorted. Whatever sorts later is dropped as the walk goes so a
+// page of a huge subtree doesn't hold all of it.
+static std::vector<FsListEntry> walk_fs(const ListRequest& lr, const std::string& from, bool after, size_t want) {
+    std::vector<FsListEntry> entries;
+    auto trim = [&] {
+        std::nth_element(entries.begin(), entries.begin() + want, entries.end(), key_less);
+        entries.resize(want);
+    };
 
-        auto it = index_store_->index.lower_bound(prefix);
-        for (; it != index_store_->index.end(); ++it) {
-            if (it->first.compare(0, prefix.size(), prefix) != 0)
-                break;
-            std::string entry = it->first;
-        
-            // Prevent from listing recursively
-            size_t pos = entry.find(PATH_DELIM, prefix.size());
-            if (pos != std::string::npos) {
-                entry = it->first.substr(0, pos);
-                if(entry == last_entry) {
+    auto slash = lr.prefix.rfind(PATH_DELIM);
+    std::vector<std::string> dirs;
+    dirs.push_back(slash == std::string::npos ? "" : lr.prefix.substr(0, slash + 1));
+
+    while (!dirs.empty()) {
+        std::string dir = std::move(dirs.back());
+        dirs.pop_back();
+
+        DIR* dp = opendir(dir.empty() ? "." : dir.c_str());
+        if (!dp)
+            continue;
+        while (auto* de = readdir(dp)) {
+            const char* name = de->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (is_lobos_internal(name))
+                continue;
+
+            std::string key = dir + name;
+            unsigned char type = de->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dirfd(dp), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
                     continue;
-                }
-            }
-            last_entry = entry;
-            if (it->second.type == 'd') {
-                data.append(
-                    "<CommonPrefixes>"
-                    "<Prefix>" + entry + PATH_DELIM + "</Prefix>"
-                    "</CommonPrefixes>"
-                );
-            } else if (seen.insert(entry).second) {
-                data.append(
-                    "<Contents>"
-                    "<Key>" + entry + "</Key>"
-                    "<LastModified>" + std::to_string(it->second.last_modified) + "</LastModified>"
-                    "<Size>" + std::to_string(it->second.size) + "</Size>"
-                    "</Contents>"
-                );
-            }
-        }
-    } else {
-        // Check if prefix exists. If it doesn't, go one up in the dir hierarchy
-        // and list everything that _starts_ with prefix
-        fs::path path = prefix;
-        if (!fs::exists(path)) {
-            auto pos = path.string().find(PATH_DELIM);
-            if (pos == beast::string_view::npos) {
-                path.clear();
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
             }
-            else {
-                path = prefix.substr(0, pos);
-                prefix = prefix.substr(pos+1);
+
+            if (type == DT_DIR) {
+                key.push_back(PATH_DELIM);
+                if (!lr.delimiter) {
+                    // Recursive listing, only walk what can hold matching keys
+                    if (key.starts_with(lr.prefix) || lr.prefix.starts_with(key))
+                        dirs.push_back(std::move(key));
+                    continue;
+                }
+            } else if (type != DT_REG) {
+                continue; // skip anything else
             }
-        } else {
-            prefix.clear();
+
+            if (!key.starts_with(lr.prefix) || key < from || (after && key == from))
+                continue;
+            entries.push_back({std::move(key), type == DT_DIR});
+            if (entries.size() >= 2 * want)
+                trim();
         }
+        closedir(dp);
+    }
 
-        if (path.empty())
-            path = fs::current_path();
+    if (entries.size() > want)
+        trim();
+    std::sort(entries.begin(), entries.end(), key_less);
+    return entries;
+}
 
-        for (auto& entry : boost::make_iterator_range(fs::directory_iterator(path), {})) {
-            if (!prefix.empty()) {
-                auto s = path.string() + '/' + prefix;
-                if (!entry.path().string().starts_with(s)) {
-                    continue;
-                }
+// Sorted listing straight from the filesystem, used when the index is off
+// or not built yet. Names and types come from readdir (d_type), only the
+// max-keys entries that get rendered are stat'ed. Runs on the blocking pool,
+// the response generator must not touch the filesystem.
+std::vector<FsListEntry> S3HttpServer::list_fs(const ListRequest& lr) {
+    std::vector<FsListEntry> entries;
+    size_t rendered = 0;
+    std::string from = lr.from;
+    bool after = false;
+
+    // One entry past max-keys tells the listing is truncated. Objects gone
+    // by the time they're stat'ed leave room for the keys after the ones
+    // walked, so we walk again from there.
+    for (;;) {
+        size_t want = lr.max_keys - rendered + 1;
+        auto batch = walk_fs(lr, from, after, want);
+        if (batch.size() == want) {
+            from = batch.back().key;
+            after = true;
+        }
+        for (auto& e : batch) {
+            if (rendered == lr.max_keys) {
+                entries.push_back(std::move(e));
+                return entries;
             }
-            if (fs::is_directory(entry.path())) {
-                data.append(
-                    "<CommonPrefixes>"
-                    "<Prefix>" + entry.path().filename().string() + PATH_DELIM + "</Prefix>"
-                    "</CommonPrefixes>"
-                );
-            } else {
-                data.append(
-                    "<Contents>"
-                    "<Key>" + entry.path().filename().string() + "</Key>"
-                    "<LastModified>" + std::to_string(fs::last_write_time(entry)) + "</LastModified>"
-                    "<Size>" + std::to_string(fs::file_size(entry.path())) + "</Size>"
-                    "</Contents>"
-            );
+            if (!e.prefix) {
+                struct stat sb;
+                if (stat(e.key.c_str(), &sb) != 0)
+                    continue; // gone already
+                e.size = sb.st_size;
+                e.last_modified = sb.st_mtime;
+                Object o{e.size, e.last_modified, 'f'};
+                if (load_object_md5(-1, e.key.c_str(), sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec, o))
+                    e.etag = object_etag(o);
             }
+            rendered++;
+            entries.push_back(std::move(e));
         }
+        if (batch.size() < want)
+            return entries;
     }
-    return data.append("<Marker></Marker></ListBucketResult>");
 }
 
-auto S3HttpServer::do_metadata_req(boost::string_view path) {
-    size_t size;
-    time_t last_modified;
 
-    if (index_store_) {
-        auto it = index_store_->index.find(path);
-        if (it == index_store_->index.end()) {
-            size = last_modified = 0;
-        } else {
-            size = it->second.size;
-            last_modified = it->second.last_modified;
-        }
-    } else {
-        try {
-            size = fs::file_size(path);
-            last_modified = fs::last_write_time(path);
-        } catch (const fs::filesystem_error& e) {
-            size = last_modified = 0;
-        }
+// Object metadata from the index or a single stat, false when there's no
+// such object. No exceptions, a 404 is the common case for some clients.
+bool S3HttpServer::do_metadata_req(beast::string_view path, Object& o) {
+    if (index_ready())
+        return index_store_->get(path, o);
+
+    struct stat st;
+    std::string p(path);
+    if (::stat(p.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    o = Object{(size_t)st.st_size, st.st_mtime, 'f'};
+    load_object_md5(-1, p.c_str(), st.st_mtim.tv_sec, st.st_mtim.tv_nsec, o);
+    return true;
+}
+
+
+// Keys going through lobos' internal names would let clients read or clobber
+// in-flight uploads
+static bool is_reserved_key(std::string_view key) {
+    size_t pos = 0;
+    for (;;) {
+        auto end = key.find(PATH_DELIM, pos);
+        if (is_lobos_internal(key.substr(pos, end - pos)))
+            return true;
+        if (end == std::string_view::npos)
+            return false;
+        pos = end + 1;
     }
+}
 
-    return std::tuple{size, last_modified};
+// Keys that don't come from the request target (copy sources, batch
+// deletes) weren't normalized by anyone, they must stay inside the bucket
+static bool has_dot_dot(std::string_view key) {
+    size_t pos = 0;
+    for (;;) {
+        auto end = key.find(PATH_DELIM, pos);
+        if (key.substr(pos, end - pos) == "..")
+            return true;
+        if (end == std::string_view::npos)
+            return false;
+        pos = end + 1;
+    }
 }
 
-bool S3HttpServer::parse_aws_params(std::string_view t, std::unordered_map<std::string, std::string>& aws_params) {
-      
-    auto target = boost::urls::parse_relative_ref(t);
-    if (!target) {
+// In-flight PUTs are written next to their object under an internal name and
+// renamed over it once complete, same directory so the rename is atomic.
+// Leftovers of a crash are `.lobos-tmp.*` files, safe to delete.
+static std::string temp_object_path(const std::string& object) {
+    static std::atomic<uint64_t> seq{0};
+    auto slash = object.rfind(PATH_DELIM);
+    std::string path = slash == std::string::npos ? std::string() : object.substr(0, slash + 1);
+    path += ".lobos-tmp." + std::to_string(getpid()) + "." + std::to_string(seq.fetch_add(1, std::memory_order_relaxed));
+    return path;
+}
+
+// The x-amz-checksum-* a PUT came with, or the algorithm the SDK says it's
+// using when the value is in a trailer we don't see
+static ChecksumAlgo requested_checksum(const arena_fields& fields) {
+    for (auto algo : {ChecksumAlgo::crc32, ChecksumAlgo::crc32c, ChecksumAlgo::sha256}) {
+        if (fields.count("x-amz-checksum-" + std::string(checksum_name(algo))))
+            return algo;
+    }
+    auto sdk = fields["x-amz-sdk-checksum-algorithm"];
+    for (auto algo : {ChecksumAlgo::crc32, ChecksumAlgo::crc32c, ChecksumAlgo::sha256}) {
+        if (beast::iequals(sdk, checksum_name(algo)))
+            return algo;
+    }
+    return ChecksumAlgo::none;
+}
+
+// Whatever the client told us the body hashes to must match
+static bool digests_match(const arena_fields& fields, const ObjectHasher& hasher) {
+    auto md5 = fields[http::field::content_md5];
+    if (!md5.empty() && md5 != base64_encode(hasher.md5().data(), hasher.md5().size()))
         return false;
+    if (hasher.algo() == ChecksumAlgo::none)
+        return true;
+    auto expected = fields["x-amz-checksum-" + std::string(checksum_name(hasher.algo()))];
+    return expected.empty() || expected == hasher.checksum();
+}
+
+// Keeps the ETag and checksum with the file for HEAD, GET and the index.
+// `st` gets the file's size and mtime as they'll be once it's renamed in.
+static void store_sums(int fd, const ObjectHasher& hasher, struct stat& st) {
+    if (fstat(fd, &st) != 0)
+        st = {};
+    if (!hasher.has_md5() && hasher.algo() == ChecksumAlgo::none)
+        return;
+    ObjectSums sums{};
+    sums.has_md5 = hasher.has_md5();
+    std::copy(hasher.md5().begin(), hasher.md5().end(), sums.md5);
+    if (hasher.algo() != ChecksumAlgo::none) {
+        std::strncpy(sums.checksum_algo, checksum_name(hasher.algo()), sizeof(sums.checksum_algo) - 1);
+        sums.checksum_len = hasher.checksum_size();
+        std::copy(hasher.checksum_data(), hasher.checksum_data() + hasher.checksum_size(), sums.checksum);
     }
-    
-    boost::urls::url_view u = *target;
-    for (auto const& param : u.params()) {
-        aws_params.emplace(param.key, param.value);
+    store_object_sums(fd, sums);
+}
+
+// Best effort, not every filesystem supports it
+static void preallocate(int fd, std::uint64_t len) {
+    if (len > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len);
+}
+
+static beast::error_code last_error() {
+    return beast::error_code(errno, beast::system_category());
+}
+
+// `no_replace` fails with EEXIST instead of replacing an existing object, for
+// If-None-Match: * PUTs. Atomic either way, no check-then-rename race.
+static beast::error_code rename_object(const std::string& tmp, const std::string& object, bool no_replace) {
+    if (!no_replace) {
+        if (rename(tmp.c_str(), object.c_str()) != 0)
+            return last_error();
+        return {};
     }
-    return true;
+    if (renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, object.c_str(), RENAME_NOREPLACE) == 0)
+        return {};
+    if (errno != EINVAL && errno != ENOSYS)
+        return last_error();
+    // The filesystem doesn't do RENAME_NOREPLACE, link() refuses to replace too
+    if (link(tmp.c_str(), object.c_str()) != 0)
+        return last_error();
+    unlink(tmp.c_str());
+    return {};
+}
+
+// --durability=sync: the data, then the new name, are on disk when it returns
+static beast::error_code sync_commit(const std::string& tmp, const std::string& object, bool no_replace) {
+    int fd = open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return last_error();
+    beast::error_code ec;
+    if (fdatasync(fd) != 0)
+        ec = last_error();
+    close(fd);
+    if (ec)
+        return ec;
+
+    if ((ec = rename_object(tmp, object, no_replace)))
+        return ec;
+
+    auto slash = object.rfind(PATH_DELIM);
+    std::string dir = slash == std::string::npos ? "." : object.substr(0, slash);
+    fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return last_error();
+    if (fsync(fd) != 0)
+        ec = last_error();
+    close(fd);
+    return ec;
 }
 
-void S3HttpServer::sanitize_target_path(std::string& target) {
-    if (target.starts_with("/" + bucket_name))
-        target.erase(0, bucket_name.size() + 1); // removes `/bucketname`
+// Moves a fully received PUT from its temp file over the object, as durable
+// as --durability asks for
+net::awaitable<beast::error_code> S3HttpServer::commit_put(const std::string& tmp, const std::string& object, bool no_replace) {
+    switch (opts_.durability) {
+        case Durability::sync:
+            co_return co_await blocking_->run(BlockingOp::sync, [&] { return sync_commit(tmp, object, no_replace); });
+
+        case Durability::batch: {
+            // The data must be on disk before the rename can expose it, and
+            // the rename before we ack. Both ride on the next group commit.
+            if (auto ec = co_await group_commit_->wait())
+                co_return ec;
+            if (auto ec = co_await blocking_->run(BlockingOp::rename, [&] { return rename_object(tmp, object, no_replace); }))
+                co_return ec;
+            co_return co_await group_commit_->wait();
+        }
 
-    // since we know we don't have extra filepath info we remove it all
-    if (target.front() == '?')
-        target.erase();
+        case Durability::none:
+            break;
+    }
+    co_return co_await blocking_->run(BlockingOp::rename, [&] { return rename_object(tmp, object, no_replace); });
+}
 
-    // We have a /something, erase the /
-    if (target.front() == PATH_DELIM)
-        target.erase(0, 1);
+// Set on the directories lobos makes for its keys, DeleteObjects only ever
+// removes those
+#define LOBOS_DIR_XATTR "user.lobos.dir"
+
+// mkdir -p marking what it creates. Returns false when it was all there
+// already, throws like fs::create_directories.
+static bool make_dirs(const std::string& path) {
+    if (mkdir(path.c_str(), 0777) == 0) {
+        // Best effort, no user xattrs just means nothing gets pruned
+        setxattr(path.c_str(), LOBOS_DIR_XATTR, "", 0, 0);
+        return true;
+    }
+    if (errno == EEXIST)
+        return false;
+    auto slash = path.rfind(PATH_DELIM);
+    if (errno != ENOENT || slash == std::string::npos || slash == 0)
+        throw fs::filesystem_error("mkdir", path, boost::system::error_code(errno, boost::system::system_category()));
+    make_dirs(path.substr(0, slash));
+    return make_dirs(path);
 }
 
-std::string S3HttpServer::create_dest_dirs_if_not_exist(std::string object) {
-    sanitize_target_path(object);
+net::awaitable<void> S3HttpServer::create_parent_dirs(const std::string& path) {
+    bool created = co_await blocking_->run(BlockingOp::mkdir, [&path] {
+        return make_dirs(path);
+    });
+    // Staging dirs and such aren't objects, listings must not see them
+    bool internal = is_lobos_internal(std::string_view(path).substr(0, path.find(PATH_DELIM)));
+    if (index_store_ && !internal && (created || index_ready())) {
+        // Register every parent so listings get their CommonPrefixes
+        std::time_t now = std::time(nullptr);
+        for (auto p = path.find(PATH_DELIM); ; p = path.find(PATH_DELIM, p + 1)) {
+            auto parent = path.substr(0, p);
+            if (!index_store_->contains(parent))
+                index_store_->add_entry(parent, Object{0, now, 'd'});
+            if (p == std::string::npos)
+                break;
+        }
+    }
+}
 
-    bool path_exist = true;
+net::awaitable<std::string> S3HttpServer::create_dest_dirs_if_not_exist(std::string object) {
     //We need to ensure all the parents directories exist before anything
     auto pos = object.rfind(PATH_DELIM);
     if (pos != beast::string_view::npos) {
         auto path = object.substr(0, pos);
-        if (index_store_) {
-            auto it = index_store_->index.find(path);
-            if (it == index_store_->index.end())
-                path_exist = false;
-        } else if (!fs::exists(path)) {
-            path_exist = false;
-        }
-        if (!path_exist) {
-            fs::create_directories(path);
-            //TODO missing index add;
-        }
+        bool path_exist = index_ready() && index_store_->contains(path);
+        if (!path_exist)
+            co_await create_parent_dirs(path);
     } // else this is just `/key` so we don't care? I think?
 
-    return object;
+    co_return object;
+}
+
+// S3 error document, `keep_alive` must be false when the request body may
+// still be on the wire
+http::message_generator S3HttpServer::error_res(http::status status, beast::string_view code, beast::string_view resource, unsigned version, bool keep_alive) {
+    http::response<http::string_body> res{status, version};
+    res.set(http::field::server, SERVER_NAME);
+    res.set(http::field::content_type, "application/xml");
+    res.keep_alive(keep_alive);
+    res.body() = "<?xml version=\"1.0\" encoding=\"UTF-8\"?><Error><Code>";
+    res.body().append(code);
+    res.body().append("</Code><Resource>");
+    xml_escape_append(res.body(), resource);
+    res.body().append("</Resource><RequestId>DEADBEEF</RequestId></Error>");
+    res.prepare_payload();
+    return res;
 }
 
 // TODO this isn't used
-http::message_generator S3HttpServer::not_found_bucket_res(beast::string_view bucket, http::request<http::file_body>&& req) {
+http::message_generator S3HttpServer::not_found_bucket_res(beast::string_view bucket, arena_request<http::file_body>&& req) {
     http::response<http::string_body> res{http::status::not_found, req.version()};
     res.set(http::field::server, SERVER_NAME);
     res.set(http::field::content_type, "application/xml");
@@ -257,7 +437,7 @@ http::message_generator S3HttpServer::not_found_bucket_res(beast::string_view bu
     return res;
 }
 
-http::message_generator S3HttpServer::not_found_key_res(beast::string_view target, http::request<http::file_body>&& req) {
+http::message_generator S3HttpServer::not_found_key_res(beast::string_view target, arena_request<http::file_body>&& req) {
     http::response<http::string_body> res{http::status::not_found, req.version()};
     res.set(http::field::server, SERVER_NAME);
     res.set(http::field::content_type, "application/xml");
@@ -271,55 +451,470 @@ http::message_generator S3HttpServer::not_found_key_res(beast::string_view targe
     return res;
 }
 
-http::message_generator S3HttpServer::handle_head_object(beast::string_view object, http::request<http::file_body>&& req) {
+// x-amz-checksum-mode: ENABLED asks for the additional checksum on GET/HEAD
+static bool checksum_mode(const arena_request<http::file_body>& req) {
+    return beast::iequals(req["x-amz-checksum-mode"], "ENABLED");
+}
 
-    auto [size, last_modified] = do_metadata_req(object);
+static bool load_current_sums(const std::string& path, ObjectSums& sums) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0
+        && load_object_sums(-1, path.c_str(), st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, sums);
+}
 
-    if (last_modified == 0 && size == 0)
-        return not_found_key_res(object, std::move(req));
+template <class Fields>
+static void set_checksum_header(Fields& fields, const ObjectSums& sums) {
+    if (sums.checksum_algo[0] == '\0' || sums.checksum_len > sizeof(sums.checksum))
+        return;
+    std::string_view algo(sums.checksum_algo, strnlen(sums.checksum_algo, sizeof(sums.checksum_algo)));
+    fields.set("x-amz-checksum-" + std::string(algo), base64_encode(sums.checksum, sums.checksum_len));
+}
 
-    http::response<http::string_body> res{http::status::ok, req.version()};
+// Conditional requests, RFC 9110 section 13
+static bool has_preconditions(const arena_fields& fields) {
+    return fields.count(http::field::if_match) || fields.count(http::field::if_none_match)
+        || fields.count(http::field::if_modified_since) || fields.count(http::field::if_unmodified_since);
+}
+
+// Only the IMF-fixdate form, the one every client sends. Anything else makes
+// the header ignored, as the RFC wants for invalid dates.
+static bool parse_http_date(beast::string_view s, time_t& t) {
+    if (s.empty())
+        return false;
+    std::tm tm{};
+    std::string date(s);
+    const char* end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end)
+        return false;
+    t = timegm(&tm);
+    return true;
+}
+
+// If-Match/If-None-Match hold "*" or a list of entity tags. `weak` is the
+// comparison If-None-Match uses, W/"x" matches "x". Clients that drop the
+// quotes are let through.
+static bool etag_matches(beast::string_view header, std::string_view etag, bool weak) {
+    for (;;) {
+        auto comma = header.find(',');
+        auto tag = header.substr(0, comma);
+        while (!tag.empty() && tag.front() == ' ')
+            tag.remove_prefix(1);
+        while (!tag.empty() && tag.back() == ' ')
+            tag.remove_suffix(1);
+        if (tag == "*")
+            return true;
+        bool is_weak = tag.starts_with("W/");
+        if (is_weak)
+            tag.remove_prefix(2);
+        if ((weak || !is_weak) && strip_quotes(tag) == strip_quotes(etag))
+            return true;
+        if (comma == beast::string_view::npos)
+            return false;
+        header.remove_prefix(comma + 1);
+    }
+}
+
+enum class precondition { pass, not_modified, failed };
+
+// `read` for GET/HEAD, they get a 304 where writes fail. If-Unmodified-Since
+// and If-Modified-Since only count without their ETag counterpart.
+static precondition check_preconditions(const arena_fields& fields, bool read, bool exists, std::string_view etag, time_t last_modified) {
+    time_t date;
+    auto if_match = fields[http::field::if_match];
+    if (!if_match.empty()) {
+        if (!exists || !etag_matches(if_match, etag, false))
+            return precondition::failed;
+    } else if (exists && parse_http_date(fields[http::field::if_unmodified_since], date) && last_modified > date) {
+        return precondition::failed;
+    }
+
+    auto if_none_match = fields[http::field::if_none_match];
+    if (!if_none_match.empty()) {
+        if (exists && etag_matches(if_none_match, etag, true))
+            return read ? precondition::not_modified : precondition::failed;
+    } else if (read && exists && parse_http_date(fields[http::field::if_modified_since], date) && last_modified <= date) {
+        return precondition::not_modified;
+    }
+    return precondition::pass;
+}
+
+// A response to `req` with its headers in the same arena
+template <class Body>
+static arena_response<Body> arena_res(http::status status, const arena_request<http::file_body>& req) {
+    arena_response<Body> res{std::piecewise_construct, std::make_tuple(), std::make_tuple(req.get_allocator())};
+    res.result(status);
+    res.version(req.version());
+    return res;
+}
+
+static arena_response<http::empty_body> not_modified_res(std::string_view etag, time_t last_modified, const arena_request<http::file_body>& req) {
+    auto res = arena_res<http::empty_body>(http::status::not_modified, req);
+    res.set(http::field::server, SERVER_NAME);
+    res.set(http::field::date, http_date_now());
+    res.set(http::field::etag, etag);
+    res.set(http::field::last_modified, to_rfc1123(last_modified).view());
+    res.keep_alive(req.keep_alive());
+    return res;
+}
+
+// The object a conditional PUT is checked against, false when there's none
+static bool current_object(const std::string& path, Object& o) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    o = Object{(size_t)st.st_size, st.st_mtime, 'f'};
+    load_object_md5(-1, path.c_str(), st.st_mtim.tv_sec, st.st_mtim.tv_nsec, o);
+    return true;
+}
+
+net::awaitable<bool> S3HttpServer::put_preconditions_pass(const std::string& object, const arena_fields& fields) {
+    if (!has_preconditions(fields))
+        co_return true;
+    // Packed objects only exist in the index
+    Object o{};
+    bool exists = segments_ && index_store_->get(object, o) && o.segment;
+    if (!exists) {
+        o = Object{};
+        exists = co_await blocking_->run(BlockingOp::stat, [&] { return current_object(object, o); });
+    }
+    auto etag = exists ? current_etag(o) : ETag{};
+    co_return check_preconditions(fields, false, exists, etag.view(), o.last_modified) == precondition::pass;
+}
+
+net::awaitable<S3HttpServer::response> S3HttpServer::handle_head_object(beast::string_view object, arena_request<http::file_body> req) {
+
+    Object o;
+    bool found;
+    auto cached = StatCache::lookup::miss;
+    if (index_ready()) {
+        found = do_metadata_req(object, o);
+    } else if (stat_cache_ && (cached = stat_cache_->get(object, o)) != StatCache::lookup::miss) {
+        found = cached == StatCache::lookup::found;
+    } else {
+        uint64_t gen = stat_cache_ ? stat_cache_->generation(object) : 0;
+        found = co_await blocking_->run(BlockingOp::stat, [&] { return do_metadata_req(object, o); });
+        if (stat_cache_)
+            stat_cache_->put(object, found, o, gen);
+    }
+
+    if (!found)
+        co_return not_found_key_res(object, std::move(req));
+    auto res = head_object_res(object, o, req);
+    auto* hdr = std::get_if<arena_response<http::empty_body>>(&res);
+    if (hdr && hdr->result() == http::status::ok && checksum_mode(req)) {
+        ObjectSums sums;
+        bool found = co_await blocking_->run(BlockingOp::stat, [&] {
+            return load_current_sums(std::string(object), sums);
+        });
+        if (found)
+            set_checksum_header(*hdr, sums);
+    }
+    co_return res;
+}
+
+S3HttpServer::response S3HttpServer::head_object_res(beast::string_view object, const Object& o,
+                                                     const arena_request<http::file_body>& req) {
+    auto etag = current_etag(o);
+
+    switch (check_preconditions(req, true, true, etag.view(), o.last_modified)) {
+        case precondition::not_modified:
+            return not_modified_res(etag.view(), o.last_modified, req);
+        case precondition::failed: {
+            // No error document, a HEAD response can't have a body
+            http::response<http::empty_body> res{http::status::precondition_failed, req.version()};
+            res.set(http::field::server, SERVER_NAME);
+            res.keep_alive(req.keep_alive());
+            return res;
+        }
+        case precondition::pass:
+            break;
+    }
+
+    auto res = arena_res<http::empty_body>(http::status::ok, req);
     res.set(http::field::server, SERVER_NAME);
-    res.set(http::field::content_type, mime_type(object));
-    boost::string_view sv(std::to_string(last_modified));
-    res.set(http::field::last_modified, sv);
-    res.content_length(size);
+    res.set(http::field::date, http_date_now());
+    set_object_headers(res, object, o.last_modified, etag.view());
+    res.content_length(o.size);
     res.keep_alive(req.keep_alive());
     return res;
 }
 
-http::message_generator S3HttpServer::handle_list_objects(beast::string_view prefix, http::request<http::file_body>&& req) {
+std::optional<S3HttpServer::response> S3HttpServer::handle_read_now(arena_request<http::file_body>& req) {
+    bool head = req.method() == http::verb::head;
+    if (!head && req.method() != http::verb::get)
+        return std::nullopt;
+    // Anything but a plain object key is handle_request's
+    QueryParams params;
+    if (!params.parse(req.target(), req.get_allocator().resource()) || params.contains("uploadId") ||
+        params.contains("delimiter"))
+        return std::nullopt;
+    std::string_view target = target_key(req.target(), bucket_name);
+    if (target.empty() || is_reserved_key(target))
+        return std::nullopt;
+
+    if (!head)
+        return handle_get_object(target, std::move(req));
+    if (checksum_mode(req))
+        return std::nullopt;
+    Object o;
+    bool found;
+    StatCache::lookup cached;
+    if (index_ready())
+        found = do_metadata_req(target, o);
+    else if (stat_cache_ && (cached = stat_cache_->get(target, o)) != StatCache::lookup::miss)
+        found = cached == StatCache::lookup::found;
+    else
+        return std::nullopt;
+    if (!found)
+        return not_found_key_res(target, std::move(req));
+    return head_object_res(target, o, req);
+}
+
+net::awaitable<http::message_generator> S3HttpServer::handle_list_objects(ListRequest lr, arena_request<http::file_body> req) {
+    std::optional<std::vector<FsListEntry>> fs_entries;
+    if (!index_ready())
+        fs_entries = co_await blocking_->run(BlockingOp::list, [&] { return list_fs(lr); });
+    auto next = list_objects_xml(index_store_, bucket_name, std::move(lr), std::move(fs_entries));
+
+    // No chunked encoding before HTTP/1.1, render it all upfront
+    if (req.version() < 11) {
         http::response<http::string_body> res{http::status::ok, req.version()};
         res.set(http::field::server, SERVER_NAME);
         res.set(http::field::content_type, "application/xml");
         res.keep_alive(req.keep_alive());
-        auto objects =  do_list_objects(prefix);
-        res.body() = objects;
+        while (next(res.body()))
+            ;
         res.prepare_payload();
-        return res;
+        co_return res;
+    }
+
+    http::response<generator_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, SERVER_NAME);
+    res.set(http::field::content_type, "application/xml");
+    res.keep_alive(req.keep_alive());
+    res.chunked(true);
+    res.body().next = std::move(next);
+    co_return res;
 }
 
-http::message_generator S3HttpServer::handle_get_object(beast::string_view object, http::request<http::file_body>&& req) {
-        
-    auto [_, last_modified] = do_metadata_req(object);
+// Single byte range only, like S3 anything else (multiple ranges, other
+// units, garbage) is ignored and the whole object is sent.
+S3HttpServer::range_result S3HttpServer::parse_range(beast::string_view header, std::uint64_t size, std::uint64_t& first, std::uint64_t& last) {
+    if (!header.starts_with("bytes="))
+        return range_result::none;
+    auto spec = header.substr(6);
+    if (spec.find(',') != beast::string_view::npos)
+        return range_result::none;
+    auto dash = spec.find('-');
+    if (dash == beast::string_view::npos)
+        return range_result::none;
+
+    auto parse = [](beast::string_view s, std::uint64_t& v) {
+        auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+        return !s.empty() && ec == std::errc() && ptr == s.data() + s.size();
+    };
+
+    auto start = spec.substr(0, dash);
+    auto end = spec.substr(dash + 1);
+    if (start.empty()) {
+        // bytes=-N, the last N bytes
+        std::uint64_t n;
+        if (!parse(end, n))
+            return range_result::none;
+        if (n == 0 || size == 0)
+            return range_result::unsatisfiable;
+        first = n >= size ? 0 : size - n;
+        last = size - 1;
+        return range_result::ok;
+    }
 
-    if (last_modified == 0)
-        return not_found_key_res(object, std::move(req));        
-        
-    http::response<http::file_body> res{http::status::ok, req.version()};
+    if (!parse(start, first))
+        return range_result::none;
+    if (end.empty()) {
+        last = size - 1;
+    } else if (!parse(end, last) || last < first) {
+        return range_result::none;
+    }
+    if (first >= size)
+        return range_result::unsatisfiable;
+    last = std::min(last, size - 1);
+    return range_result::ok;
+}
+
+http::message_generator S3HttpServer::range_not_satisfiable_res(beast::string_view object, std::uint64_t size, arena_request<http::file_body>&& req) {
+    http::response<http::string_body> res{http::status::range_not_satisfiable, req.version()};
     res.set(http::field::server, SERVER_NAME);
-    res.set(http::field::content_type, mime_type(object));
-    res.set(http::field::last_modified, to_rfc1123(last_modified));
+    res.set(http::field::content_type, "application/xml");
+    res.set(http::field::content_range, "bytes */" + std::to_string(size));
+    res.keep_alive(req.keep_alive());
+    res.body() = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<Error><Code>InvalidRange</Code>"
+        "<Message>The requested range is not satisfiable</Message>"
+        "<Resource>" + std::string(object) + "</Resource>"
+        "<RequestId>DEADBEEF</RequestId></Error>";
+    res.prepare_payload();
+    return res;
+}
 
-    beast::error_code ec;
-    http::file_body::value_type body;
+// Reads the whole object and renders its response header once, nullptr if
+// the file changed size under us
+std::shared_ptr<const CachedObject> S3HttpServer::load_cached_object(beast::string_view object, const object_body::value_type& body, std::string_view etag) {
+    auto obj = std::make_shared<CachedObject>();
+    obj->body.resize(body.file_size());
+    size_t off = 0;
+    while (off < obj->body.size()) {
+        ssize_t n = pread(body.native_handle(), obj->body.data() + off, obj->body.size() - off, body.base() + off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return nullptr;
+        off += n;
+    }
 
-    body.open(std::string(object).c_str(), beast::file_mode::scan, ec);
+    http::response_header<> hdr;
+    hdr.version(11);
+    hdr.result(http::status::ok);
+    hdr.set(http::field::server, SERVER_NAME);
+    set_object_headers(hdr, object, body.last_modified(), etag);
+    hdr.set(http::field::content_length, std::to_string(obj->body.size()));
+    obj->etag = etag;
+    obj->last_modified = body.last_modified();
+
+    obj->header = "HTTP/1.1 200 OK\r\n";
+    for (auto const& f : hdr) {
+        obj->header.append(f.name_string());
+        obj->header.append(": ");
+        obj->header.append(f.value());
+        obj->header.append("\r\n");
+    }
+    return obj;
+}
+
+S3HttpServer::response S3HttpServer::handle_get_object(beast::string_view object, arena_request<http::file_body>&& req) {
+    // Cache hits count too, they're the hottest objects of all
+    if (evictor_ && index_ready())
+        index_store_->touch(object, std::time(nullptr));
+
+    // Ranges and HTTP/1.0 take the regular path, the cached header block is
+    // a full HTTP/1.1 200
+    bool cacheable = cache_ && req.version() == 11 && req[http::field::range].empty() && !checksum_mode(req);
+    uint64_t cache_gen = 0;
+    if (cacheable) {
+        if (auto obj = cache_->get(object)) {
+            // Revalidations are answered from the cache too
+            switch (check_preconditions(req, true, true, obj->etag, obj->last_modified)) {
+                case precondition::not_modified:
+                    return not_modified_res(obj->etag, obj->last_modified, req);
+                case precondition::failed:
+                    return error_res(http::status::precondition_failed, "PreconditionFailed", object, req.version(), req.keep_alive());
+                case precondition::pass:
+                    break;
+            }
+            return CachedResponse{std::move(obj), req.keep_alive()};
+        }
+        cache_gen = cache_->generation(object);
+    }
+
+    // Only the index or a cached 404 can save us the open() on a miss
+    bool use_stat_cache = stat_cache_ && !index_ready();
+    uint64_t stat_gen = 0;
+    Object indexed{};
+    bool have_indexed = false;
+    if (use_stat_cache) {
+        Object o;
+        if (stat_cache_->get(object, o) == StatCache::lookup::not_found)
+            return not_found_key_res(object, std::move(req));
+        stat_gen = stat_cache_->generation(object);
+    } else if (index_ready()) {
+        if (!index_store_->get(object, indexed))
+            return not_found_key_res(object, std::move(req));
+        have_indexed = true;
+    }
+
+    // A single open + fstat gets us everything we need, packed objects only
+    // need their segment
+    beast::error_code ec;
+    object_body::value_type body;
+    if (have_indexed && indexed.segment) {
+        int fd = open_packed(object, indexed);
+        if (fd >= 0)
+            body.open_packed(fd, indexed.offset, indexed.size, indexed.last_modified);
+    }
+    if (!body.is_open()) {
+        // NUL terminated on the stack, a std::string of the key would
+        // allocate for anything past 15 bytes
+        char path[PATH_MAX];
+        if (object.size() < sizeof(path)) {
+            std::memcpy(path, object.data(), object.size());
+            path[object.size()] = '\0';
+            body.open(path, ec);
+        } else {
+            ec = beast::errc::make_error_code(beast::errc::filename_too_long);
+        }
+    }
     if (ec) {
+        if (use_stat_cache)
+            stat_cache_->put(object, false, Object{}, stat_gen);
         return not_found_key_res(object, std::move(req));
     }
 
-    res.content_length(body.size());
+    // The ETag comes from the index when it's still current, else from the
+    // xattr of the file we just opened
+    Object o{body.file_size(), body.last_modified(), 'f'};
+    if (have_indexed && indexed.size == o.size && indexed.last_modified == o.last_modified) {
+        o.has_md5 = indexed.has_md5;
+        o.etag_parts = indexed.etag_parts;
+        o.md5 = indexed.md5;
+    } else {
+        load_object_md5(body.native_handle(), nullptr, body.last_modified(), body.last_modified_nsec(), o);
+    }
+    if (use_stat_cache)
+        stat_cache_->put(object, true, o, stat_gen);
+    auto etag = current_etag(o);
+
+    switch (check_preconditions(req, true, true, etag.view(), o.last_modified)) {
+        case precondition::not_modified:
+            return not_modified_res(etag.view(), o.last_modified, req);
+        case precondition::failed:
+            return error_res(http::status::precondition_failed, "PreconditionFailed", object, req.version(), req.keep_alive());
+        case precondition::pass:
+            break;
+    }
+
+    if (cacheable && body.file_size() <= cache_->max_object_size()) {
+        if (auto obj = load_cached_object(object, body, etag.view())) {
+            cache_->put(object, obj, cache_gen);
+            return CachedResponse{std::move(obj), req.keep_alive()};
+        }
+    }
+
+    auto status = http::status::ok;
+    std::uint64_t first, last;
+    switch (parse_range(req[http::field::range], body.file_size(), first, last)) {
+        case range_result::unsatisfiable:
+            return range_not_satisfiable_res(object, body.file_size(), std::move(req));
+        case range_result::ok:
+            // Only the requested bytes are ever read from disk
+            body.set_range(first, last - first + 1);
+            status = http::status::partial_content;
+            break;
+        case range_result::none:
+            break;
+    }
+
+    auto res = arena_res<object_body>(status, req);
+    res.set(http::field::server, SERVER_NAME);
+    res.set(http::field::date, http_date_now());
+    set_object_headers(res, object, body.last_modified(), etag.view());
+    if (status == http::status::partial_content) {
+        res.set(http::field::content_range,
+            "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(body.file_size()));
+    } else if (checksum_mode(req)) {
+        // Checksums cover the whole object, no point sending them for a range
+        ObjectSums sums;
+        if (load_object_sums(body.native_handle(), nullptr, body.file_size(), body.last_modified(), body.last_modified_nsec(), sums))
+            set_checksum_header(res, sums);
+    }
     res.body() = std::move(body);
     res.keep_alive(req.keep_alive());
     res.prepare_payload();
@@ -327,7 +922,922 @@ http::message_generator S3HttpServer::handle_get_object(beast::string_view objec
     return res;
 }
 
-http::message_generator S3HttpServer::handle_request(http::request<http::file_body>&& req) {
+// Multipart uploads are staged in .lobos-multipart/<upload id>/, one file per
+// part named after its number plus `key` holding the object key. To the
+// session an UploadPart is a regular PUT that lands there instead of next to
+// the object. Completion stitches the parts into the object, with reflinks
+// when the filesystem has them so it's O(metadata) rather than a rewrite.
+// Abandoned uploads stay there until aborted.
+#define MULTIPART_DIR ".lobos-multipart/"
+#define MAX_PARTS 10000
+// CompleteMultipartUpload lists at most 10000 parts, that fits easily
+#define MAX_POST_SIZE (4ULL<<20)
+
+static std::string upload_dir(std::string_view upload_id) {
+    return MULTIPART_DIR + std::string(upload_id) + "/";
+}
+
+// Upload ids end up in paths, only accept what we hand out
+static bool valid_upload_id(std::string_view id) {
+    return id.size() == 32 && std::all_of(id.begin(), id.end(), [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+}
+
+static std::string new_upload_id() {
+    std::random_device rd;
+    std::string raw(16, '\0');
+    for (auto& c : raw)
+        c = (char)rd();
+    return hex_encode(raw);
+}
+
+// True when `upload_id` is an upload in progress for `key`
+static bool upload_matches(std::string_view upload_id, std::string_view key) {
+    if (!valid_upload_id(upload_id))
+        return false;
+    int fd = open((upload_dir(upload_id) + "key").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n >= 0 && std::string_view(buf, n) == key;
+}
+
+static bool parse_part_number(std::string_view s, int& n) {
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+    return ec == std::errc() && ptr == s.data() + s.size() && n >= 1 && n <= MAX_PARTS;
+}
+
+// For files lobos has no MD5 for (ranged UploadPartCopy). Changes whenever
+// the file is written again, which is all clients need to hand part ETags
+// back on completion.
+static std::string file_etag(const struct stat& st) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\"%lx-%lx%09lx\"", (unsigned long)st.st_ino,
+             (unsigned long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec);
+    return buf;
+}
+
+// ETag of the part at `path`, with its MD5 in `o` when there's one
+static std::string part_etag(const std::string& path, const struct stat& st, Object& o) {
+    o = Object{(size_t)st.st_size, st.st_mtime, 'f'};
+    if (load_object_md5(-1, path.c_str(), st.st_mtim.tv_sec, st.st_mtim.tv_nsec, o))
+        return object_etag(o);
+    return file_etag(st);
+}
+
+// Copies `len` bytes of `in` at `src_offset` to `out` at `dst_offset`. A
+// reflink when the filesystem can (XFS, btrfs) and the offsets are block
+// aligned, the data isn't touched at all. copy_file_range otherwise which
+// stays in the kernel, and a plain copy as a last resort.
+static beast::error_code copy_range(int out, int in, uint64_t src_offset, uint64_t dst_offset, uint64_t len) {
+    if (len == 0)
+        return {};
+
+    struct file_clone_range clone{};
+    clone.src_fd = in;
+    clone.src_offset = src_offset;
+    clone.src_length = len;
+    clone.dest_offset = dst_offset;
+    if (ioctl(out, FICLONERANGE, &clone) == 0)
+        return {};
+
+    loff_t src = src_offset, dst = dst_offset;
+    uint64_t left = len;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, &src, out, &dst, left, 0);
+        if (n > 0) {
+            left -= n;
+            continue;
+        }
+        if (n == 0)
+            return http::error::short_read;
+        if (errno == EINTR)
+            continue;
+        if (errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
+            return last_error();
+        break;
+    }
+
+    std::vector<char> buf(std::min<uint64_t>(left, 1 << 20));
+    while (left > 0) {
+        ssize_t n = pread(in, buf.data(), std::min<uint64_t>(left, buf.size()), src);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return last_error();
+        if (n == 0)
+            return http::error::short_read;
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = pwrite(out, buf.data() + done, n - done, dst + done);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0)
+                return last_error();
+            done += w;
+        }
+        src += n;
+        dst += n;
+        left -= n;
+    }
+    return {};
+}
+
+// Concatenates `parts` into a new file at `tmp`, removed on failure. `sums`
+// are recorded for it when given. `done` gets the file's size and mtime as
+// they'll be once it's renamed in.
+static beast::error_code assemble_parts(const std::string& tmp, const std::vector<std::string>& parts, ObjectSums* sums, struct stat& done) {
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0)
+        return last_error();
+
+    beast::error_code ec;
+    uint64_t total = 0;
+    for (auto& part : parts) {
+        int in = open(part.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (in < 0 || fstat(in, &st) != 0) {
+            ec = last_error();
+            if (in >= 0)
+                close(in);
+            break;
+        }
+        ec = copy_range(out, in, 0, total, st.st_size);
+        close(in);
+        if (ec)
+            break;
+        total += st.st_size;
+    }
+    if (!ec && sums)
+        store_object_sums(out, *sums);
+    if (!ec && fstat(out, &done) != 0)
+        ec = last_error();
+    close(out);
+    if (ec)
+        unlink(tmp.c_str());
+    return ec;
+}
+
+static http::response<http::string_body> xml_res(std::string body, unsigned version, bool keep_alive) {
+    http::response<http::string_body> res{http::status::ok, version};
+    res.set(http::field::server, SERVER_NAME);
+    res.set(http::field::content_type, "application/xml");
+    res.keep_alive(keep_alive);
+    res.body() = std::move(body);
+    res.prepare_payload();
+    return res;
+}
+
+net::awaitable<http::message_generator> S3HttpServer::create_multipart_upload(std::string key, unsigned version, bool keep_alive) {
+    auto upload_id = new_upload_id();
+    auto ec = co_await blocking_->run(BlockingOp::mkdir, [&] {
+        auto dir = upload_dir(upload_id);
+        if (mkdir(MULTIPART_DIR, 0755) != 0 && errno != EEXIST)
+            return last_error();
+        if (mkdir(dir.c_str(), 0755) != 0)
+            return last_error();
+        int fd = open((dir + "key").c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return last_error();
+        beast::error_code ec;
+        if (write(fd, key.data(), key.size()) != (ssize_t)key.size())
+            ec = beast::error_code(EIO, beast::system_category());
+        close(fd);
+        return ec;
+    });
+    if (ec) {
+        std::cerr << "CreateMultipartUpload " << key << " failed: " << ec.message() << std::endl;
+        co_return error_res(http::status::internal_server_error, "InternalError", key, version, keep_alive);
+    }
+
+    std::string body =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<InitiateMultipartUploadResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+        "<Bucket>";
+    xml_escape_append(body, bucket_name);
+    body.append("</Bucket><Key>");
+    xml_escape_append(body, key);
+    body.append("</Key><UploadId>" + upload_id + "</UploadId></InitiateMultipartUploadResult>");
+    co_return xml_res(std::move(body), version, keep_alive);
+}
+
+// The part is already in place, the session wrote it like any PUT
+net::awaitable<http::message_generator> S3HttpServer::upload_part_res(std::string part_path, const ObjectHasher* hasher, unsigned version, bool keep_alive) {
+    std::string etag;
+    bool found = co_await blocking_->run(BlockingOp::stat, [&] {
+        struct stat st;
+        if (stat(part_path.c_str(), &st) != 0)
+            return false;
+        Object o;
+        etag = hasher && hasher->has_md5() ? hasher->etag() : part_etag(part_path, st, o);
+        return true;
+    });
+    if (!found)
+        co_return error_res(http::status::not_found, "NoSuchUpload", part_path, version, keep_alive);
+
+    http::response<http::string_body> res{http::status::ok, version};
+    res.set(http::field::server, SERVER_NAME);
+    res.set(http::field::etag, etag);
+    if (hasher && hasher->algo() != ChecksumAlgo::none)
+        res.set("x-amz-checksum-" + std::string(checksum_name(hasher->algo())), hasher->checksum());
+    res.content_length(0);
+    res.keep_alive(keep_alive);
+    co_return res;
+}
+
+net::awaitable<http::message_generator> S3HttpServer::complete_multipart_upload(std::string key, std::string upload_id, std::string body, unsigned version, bool keep_alive) {
+    // Parts as the client wants them, ascending part numbers
+    std::vector<std::pair<int, std::string>> wanted;
+    size_t pos = 0;
+    std::string_view part;
+    while (xml_next(body, "Part", pos, part)) {
+        int n;
+        if (!parse_part_number(xml_value(part, "PartNumber"), n))
+            co_return error_res(http::status::bad_request, "InvalidPart", key, version, keep_alive);
+        if (!wanted.empty() && n <= wanted.back().first)
+            co_return error_res(http::status::bad_request, "InvalidPartOrder", key, version, keep_alive);
+        wanted.emplace_back(n, xml_value(part, "ETag"));
+    }
+    if (wanted.empty())
+        co_return error_res(http::status::bad_request, "MalformedXML", key, version, keep_alive);
+
+    enum { ok, no_upload, bad_part } check;
+    auto dir = upload_dir(upload_id);
+    std::vector<std::string> paths;
+    // S3's multipart ETag: MD5 of the parts' binary MD5s, "-<parts>"
+    Md5 md5_of_md5s;
+    bool all_md5 = true;
+    check = co_await blocking_->run(BlockingOp::stat, [&] {
+        if (!upload_matches(upload_id, key))
+            return no_upload;
+        for (auto& [n, etag] : wanted) {
+            struct stat st;
+            Object o;
+            auto path = dir + std::to_string(n);
+            if (stat(path.c_str(), &st) != 0 || strip_quotes(part_etag(path, st, o)) != strip_quotes(etag))
+                return bad_part;
+            md5_of_md5s.update(o.md5.data(), o.md5.size());
+            all_md5 &= o.has_md5;
+            paths.push_back(std::move(path));
+        }
+        return ok;
+    });
+    if (check == no_upload)
+        co_return error_res(http::status::not_found, "NoSuchUpload", key, version, keep_alive);
+    if (check == bad_part)
+        co_return error_res(http::status::bad_request, "InvalidPart", key, version, keep_alive);
+
+    Object o{0, 0, 'f'};
+    ObjectSums sums{};
+    if (all_md5) {
+        auto digest = md5_of_md5s.finish();
+        std::copy(digest.begin(), digest.end(), sums.md5);
+        sums.has_md5 = true;
+        sums.etag_parts = wanted.size();
+        o.has_md5 = true;
+        o.md5 = digest;
+        o.etag_parts = wanted.size();
+    }
+
+    auto object = co_await create_dest_dirs_if_not_exist(key);
+    auto tmp = temp_object_path(object);
+    struct stat done{};
+    auto ec = co_await blocking_->run(BlockingOp::copy, [&] {
+        return assemble_parts(tmp, paths, all_md5 ? &sums : nullptr, done);
+    });
+    o.size = done.st_size;
+    o.last_modified = done.st_mtime;
+    if (!ec && (ec = co_await commit_put(tmp, object)))
+        unlink(tmp.c_str());
+    if (ec) {
+        std::cerr << "CompleteMultipartUpload " << key << " failed: " << ec.message() << std::endl;
+        co_return error_res(http::status::internal_server_error, "InternalError", key, version, keep_alive);
+    }
+
+    co_await blocking_->run(BlockingOp::remove, [&dir] {
+        boost::system::error_code ec;
+        return fs::remove_all(dir, ec);
+    });
+
+    if (cache_)
+        cache_->invalidate(object);
+    if (stat_cache_)
+        stat_cache_->invalidate(object);
+    index_plain_object(object, o);
+
+    auto etag = object_etag(o);
+    if (etag.empty()) {
+        // Some parts were range copies we have no MD5 for, same shape at least
+        std::string joined;
+        for (auto& [n, part] : wanted)
+            joined.append(strip_quotes(part));
+        char buf[64];
+        snprintf(buf, sizeof(buf), "\"%016zx-%zu\"", std::hash<std::string>{}(joined), wanted.size());
+        etag = buf;
+    }
+
+    std::string res_body =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<CompleteMultipartUploadResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+        "<Location>/";
+    xml_escape_append(res_body, bucket_name + "/" + object);
+    res_body.append("</Location><Bucket>");
+    xml_escape_append(res_body, bucket_name);
+    res_body.append("</Bucket><Key>");
+    xml_escape_append(res_body, object);
+    res_body.append("</Key><ETag>");
+    xml_escape_append(res_body, etag);
+    res_body.append("</ETag></CompleteMultipartUploadResult>");
+    co_return xml_res(std::move(res_body), version, keep_alive);
+}
+
+net::awaitable<http::message_generator> S3HttpServer::abort_multipart_upload(std::string key, std::string upload_id, unsigned version, bool keep_alive) {
+    bool found = co_await blocking_->run(BlockingOp::remove, [&] {
+        if (!upload_matches(upload_id, key))
+            return false;
+        boost::system::error_code ec;
+        fs::remove_all(upload_dir(upload_id), ec);
+        return true;
+    });
+    if (!found)
+        co_return error_res(http::status::not_found, "NoSuchUpload", key, version, keep_alive);
+
+    http::response<http::string_body> res{http::status::no_content, version};
+    res.set(http::field::server, SERVER_NAME);
+    res.keep_alive(keep_alive);
+    co_return res;
+}
+
+net::awaitable<http::message_generator> S3HttpServer::list_parts(std::string key, QueryParams params, unsigned version, bool keep_alive) {
+    auto upload_id = params["uploadId"];
+    int marker = 0;
+    auto marker_param = params["part-number-marker"];
+    if (!marker_param.empty() && !parse_part_number(marker_param, marker))
+        co_return error_res(http::status::bad_request, "InvalidArgument", key, version, keep_alive);
+    size_t max_parts = 1000;
+    if (auto* v = params.find("max-parts")) {
+        auto [ptr, ec] = std::from_chars(v->data(), v->data() + v->size(), max_parts);
+        if (ec != std::errc() || ptr != v->data() + v->size())
+            co_return error_res(http::status::bad_request, "InvalidArgument", key, version, keep_alive);
+        max_parts = std::min<size_t>(max_parts, 1000);
+    }
+
+    struct PartInfo {
+        int number;
+        size_t size;
+        time_t last_modified;
+        std::string etag;
+    };
+    bool found = true;
+    auto parts = co_await blocking_->run(BlockingOp::list, [&] {
+        std::vector<PartInfo> parts;
+        if (!upload_matches(upload_id, key)) {
+            found = false;
+            return parts;
+        }
+        auto dir = upload_dir(upload_id);
+        DIR* dp = opendir(dir.c_str());
+        if (!dp)
+            return parts;
+        while (auto* de = readdir(dp)) {
+            int n;
+            struct stat st;
+            if (!parse_part_number(de->d_name, n) || n <= marker)
+                continue;
+            if (fstatat(dirfd(dp), de->d_name, &st, 0) != 0)
+                continue;
+            Object o;
+            parts.push_back({n, (size_t)st.st_size, st.st_mtime, part_etag(dir + de->d_name, st, o)});
+        }
+        closedir(dp);
+        std::sort(parts.begin(), parts.end(), [](const PartInfo& a, const PartInfo& b) {
+            return a.number < b.number;
+        });
+        return parts;
+    });
+    if (!found)
+        co_return error_res(http::status::not_found, "NoSuchUpload", key, version, keep_alive);
+
+    bool truncated = parts.size() > max_parts;
+    if (truncated)
+        parts.resize(max_parts);
+
+    std::string body =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<ListPartsResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+        "<Bucket>";
+    xml_escape_append(body, bucket_name);
+    body.append("</Bucket><Key>");
+    xml_escape_append(body, key);
+    body.append("</Key><UploadId>").append(upload_id).append("</UploadId>");
+    body.append("<PartNumberMarker>" + std::to_string(marker) + "</PartNumberMarker>");
+    if (!parts.empty())
+        body.append("<NextPartNumberMarker>" + std::to_string(parts.back().number) + "</NextPartNumberMarker>");
+    body.append("<MaxParts>" + std::to_string(max_parts) + "</MaxParts>");
+    body.append(truncated ? "<IsTruncated>true</IsTruncated>" : "<IsTruncated>false</IsTruncated>");
+    for (auto& p : parts) {
+        body.append("<Part><PartNumber>" + std::to_string(p.number) + "</PartNumber>");
+        body.append("<LastModified>" + to_iso8601(p.last_modified) + "</LastModified><ETag>");
+        xml_escape_append(body, p.etag);
+        body.append("</ETag><Size>" + std::to_string(p.size) + "</Size></Part>");
+    }
+    body.append("</ListPartsResult>");
+    co_return xml_res(std::move(body), version, keep_alive);
+}
+
+// x-amz-copy-source is `[/]bucket/key[?versionId=...]`, url encoded
+static bool parse_copy_source(std::string_view header, std::string_view bucket, std::string& key) {
+    header = header.substr(0, header.find('?'));
+    auto decoded = boost::urls::make_pct_string_view(header);
+    if (!decoded)
+        return false;
+    std::string source = decoded->decode();
+    std::string_view sv = source;
+    if (sv.starts_with(PATH_DELIM))
+        sv.remove_prefix(1);
+    if (!sv.starts_with(bucket) || sv.size() <= bucket.size() + 1 || sv[bucket.size()] != PATH_DELIM)
+        return false;
+    sv.remove_prefix(bucket.size() + 1);
+    if (has_dot_dot(sv))
+        return false;
+    key = sv;
+    return true;
+}
+
+enum class copy_result { ok, no_source, bad_range, error };
+
+// Copies `source` (or the x-amz-copy-source-range part of it) into a new
+// file at `tmp`. Whole files are cloned with FICLONE when the filesystem
+// supports it, making multi GB copies a metadata operation. Their checksums
+// come along, `st` and `o` describe the copy. A packed source is read from
+// its segment, `packed_fd` which is closed here, where `packed` says.
+static copy_result copy_object_file(const std::string& source, int packed_fd, const Object& packed,
+                                    const std::string& tmp, beast::string_view range,
+                                    struct stat& st, Object& o, beast::error_code& ec) {
+    int in = packed_fd;
+    uint64_t base = 0, size;
+    if (packed_fd >= 0) {
+        base = packed.offset;
+        size = packed.size;
+    } else {
+        in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0 || fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+            if (in >= 0)
+                close(in);
+            return copy_result::no_source;
+        }
+        size = st.st_size;
+    }
+
+    uint64_t first = 0, len = size;
+    if (!range.empty()) {
+        // Always bytes=first-last within the source, no suffixes or open ends
+        uint64_t last;
+        auto dash = range.find('-');
+        auto parse = [](beast::string_view s, uint64_t& v) {
+            auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), v);
+            return !s.empty() && ec == std::errc() && ptr == s.data() + s.size();
+        };
+        if (!range.starts_with("bytes=") || dash == beast::string_view::npos ||
+            !parse(range.substr(6, dash - 6), first) || !parse(range.substr(dash + 1), last) ||
+            last < first || last >= size) {
+            close(in);
+            return copy_result::bad_range;
+        }
+        len = last - first + 1;
+    }
+
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) {
+        ec = last_error();
+        close(in);
+        return copy_result::error;
+    }
+    // Packed objects have no sums to carry, just their MD5
+    ObjectSums sums;
+    bool has_sums = range.empty() && packed_fd < 0
+        && load_object_sums(in, nullptr, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec, sums);
+    if (!range.empty() || packed_fd >= 0 || ioctl(out, FICLONE, in) != 0)
+        ec = copy_range(out, in, base + first, 0, len);
+    if (!ec && has_sums)
+        store_object_sums(out, sums);
+    if (!ec && fstat(out, &st) != 0)
+        ec = last_error();
+    close(in);
+    close(out);
+    if (ec) {
+        unlink(tmp.c_str());
+        return copy_result::error;
+    }
+    o = Object{(size_t)st.st_size, st.st_mtime, 'f'};
+    if (has_sums && sums.has_md5) {
+        o.has_md5 = true;
+        o.etag_parts = sums.etag_parts;
+        std::copy(std::begin(sums.md5), std::end(sums.md5), o.md5.begin());
+    } else if (packed_fd >= 0 && range.empty() && packed.has_md5) {
+        o.has_md5 = true;
+        o.etag_parts = packed.etag_parts;
+        o.md5 = packed.md5;
+    }
+    return copy_result::ok;
+}
+
+// CopyObject and UploadPartCopy, the bytes never leave the server
+net::awaitable<S3HttpServer::response> S3HttpServer::handle_copy(arena_request<http::empty_body> req) {
+    QueryParams params;
+    if (!params.parse(req.target(), req.get_allocator().resource()))
+        co_return error_res(http::status::bad_request, "InvalidRequest", req.target(), req.version(), req.keep_alive());
+    std::string target(target_key(req.target(), bucket_name));
+
+    std::string source;
+    if (!parse_copy_source(req["x-amz-copy-source"], bucket_name, source))
+        co_return error_res(http::status::bad_request, "InvalidArgument", target, req.version(), req.keep_alive());
+    if (target.empty() || is_reserved_key(target) || is_reserved_key(source))
+        co_return error_res(http::status::bad_request, "InvalidArgument", target, req.version(), req.keep_alive());
+
+    std::string object;
+    auto* upload = params.find("uploadId");
+    bool part_copy = upload != nullptr;
+    if (part_copy) {
+        int part;
+        if (!parse_part_number(params["partNumber"], part))
+            co_return error_res(http::status::bad_request, "InvalidArgument", target, req.version(), req.keep_alive());
+        bool found = co_await blocking_->run(BlockingOp::stat, [&] {
+            return upload_matches(*upload, target);
+        });
+        if (!found)
+            co_return error_res(http::status::not_found, "NoSuchUpload", target, req.version(), req.keep_alive());
+        object = upload_dir(*upload) + std::to_string(part);
+    } else {
+        object = co_await create_dest_dirs_if_not_exist(target);
+    }
+
+    // Ranges only make sense for parts
+    beast::string_view range = part_copy ? req["x-amz-copy-source-range"] : beast::string_view{};
+    auto tmp = temp_object_path(object);
+    struct stat st;
+    Object o;
+    beast::error_code ec;
+    Object packed;
+    int packed_fd = open_packed(source, packed);
+    auto result = co_await blocking_->run(BlockingOp::copy, [&] {
+        return copy_object_file(source, packed_fd, packed, tmp, range, st, o, ec);
+    });
+    if (result == copy_result::no_source)
+        co_return error_res(http::status::not_found, "NoSuchKey", source, req.version(), req.keep_alive());
+    if (result == copy_result::bad_range)
+        co_return error_res(http::status::bad_request, "InvalidArgument", source, req.version(), req.keep_alive());
+    if (!ec && (ec = co_await commit_put(tmp, object)))
+        unlink(tmp.c_str());
+    if (ec) {
+        std::cerr << "Copy " << source << " to " << object << " failed: " << ec.message() << std::endl;
+        co_return error_res(http::status::internal_server_error, "InternalError", target, req.version(), req.keep_alive());
+    }
+
+    if (!part_copy) {
+        if (cache_)
+            cache_->invalidate(object);
+        if (stat_cache_)
+            stat_cache_->invalidate(object);
+        index_plain_object(object, o);
+    }
+
+    // The rename doesn't change the inode or mtime, the ETag stays valid
+    auto etag = object_etag(o);
+    if (etag.empty())
+        etag = file_etag(st);
+    std::string body = part_copy ? "<?xml version=\"1.0\" encoding=\"UTF-8\"?><CopyPartResult>"
+                                 : "<?xml version=\"1.0\" encoding=\"UTF-8\"?><CopyObjectResult>";
+    body.append("<LastModified>" + to_iso8601(st.st_mtime) + "</LastModified><ETag>");
+    xml_escape_append(body, etag);
+    body.append(part_copy ? "</ETag></CopyPartResult>" : "</ETag></CopyObjectResult>");
+    co_return xml_res(std::move(body), req.version(), req.keep_alive());
+}
+
+static beast::error_code unlink_object(const std::string& key) {
+    if (unlink(key.c_str()) != 0)
+        return last_error();
+    return {};
+}
+
+// After DeleteObjects unlinked `key`: S3 has no directories, a prefix goes
+// away with its last object. Only directories lobos made are removed, and
+// rmdir only removes empty ones, so we stop at the first one that's someone
+// else's or still in use. Removed directories are appended to `dirs`.
+static void prune_dirs(const std::string& key, std::vector<std::string>& dirs) {
+    for (auto slash = key.rfind(PATH_DELIM); slash != std::string::npos && slash > 0;
+         slash = key.rfind(PATH_DELIM, slash - 1)) {
+        auto dir = key.substr(0, slash);
+        if (lgetxattr(dir.c_str(), LOBOS_DIR_XATTR, nullptr, 0) < 0 || rmdir(dir.c_str()) != 0)
+            break;
+        dirs.push_back(std::move(dir));
+    }
+}
+
+// Runs on the evictor's thread. The object must still be the one the index
+// saw, one rewritten since then is hot again.
+bool S3HttpServer::evict_object(const std::string& key, const Object& o) {
+    if (o.segment) {
+        if (!index_store_->remove_entry_at(key, o.segment, o.offset, [&] { segments_->remove(key, o); }))
+            return false;
+        if (cache_)
+            cache_->invalidate(key);
+        if (stat_cache_)
+            stat_cache_->invalidate(key);
+        return true;
+    }
+
+    // Moved out of the way before looking at it, a PUT renaming a new
+    // object in from now on can't be the one we unlink
+    auto tmp = temp_object_path(key);
+    if (rename(key.c_str(), tmp.c_str()) != 0) {
+        // Deleted behind our back, the index just didn't know yet
+        if (errno == ENOENT)
+            index_store_->remove_file_entry_if(key, o.size, o.last_modified);
+        return errno == ENOENT;
+    }
+    struct stat st;
+    if (lstat(tmp.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size != o.size
+        || st.st_mtime > o.last_modified) {
+        // Rewritten since the index saw it, put it back unless something
+        // newer took its place meanwhile
+        auto ec = rename_object(tmp, key, true);
+        if (ec == beast::errc::file_exists)
+            unlink(tmp.c_str());
+        else if (ec)
+            std::cerr << "Evictor: can't put " << key << " back from " << tmp << ": " << ec.message() << std::endl;
+        return false;
+    }
+
+    unlink(tmp.c_str());
+    if (cache_)
+        cache_->invalidate(key);
+    if (stat_cache_)
+        stat_cache_->invalidate(key);
+    // A PUT that got in after the rename has its own entry by now
+    index_store_->remove_file_entry_if(key, o.size, o.last_modified);
+    return true;
+}
+
+// Where packed objects live, see segment_store.hpp
+#define SEGMENTS_DIR ".lobos-segments"
+
+bool S3HttpServer::packable(const arena_parser<http::file_body>& parser, const std::string& key) const {
+    if (!segments_ || key.empty() || !parser.content_length() || *parser.content_length() > opts_.pack_max_bytes)
+        return false;
+    // If-None-Match: * is settled by the rename, and a directory can't
+    // become an object
+    Object o;
+    return !has_preconditions(parser.get()) && !(index_store_->get(key, o) && o.type == 'd');
+}
+
+// Small PUTs are read whole and appended to this thread's segment, no
+// directory, file or inode is created for them. The plain file they replace
+// is removed once they're indexed.
+net::awaitable<S3HttpServer::response> S3HttpServer::put_packed(beast::tcp_stream& stream, beast::flat_buffer& buffer,
+                                                                arena_parser<http::file_body>&& header_parser, std::string key) {
+    arena_parser<http::string_body> parser{std::move(header_parser)};
+    parser.body_limit(opts_.pack_max_bytes);
+    co_await http::async_read(stream, buffer, parser);
+    auto req = parser.release();
+    auto& data = req.body();
+
+    ObjectHasher hasher(opts_.etags || req.count(http::field::content_md5), requested_checksum(req));
+    hasher.update(data.data(), data.size());
+    hasher.finish();
+    if (!digests_match(req, hasher))
+        co_return error_res(http::status::bad_request, "BadDigest", key, req.version(), req.keep_alive());
+
+    Object o{data.size(), 0, 'f'};
+    if (hasher.has_md5()) {
+        o.has_md5 = true;
+        o.md5 = hasher.md5();
+    }
+    // Numbered under the key's shard lock, a DELETE or PUT of the key
+    // landing while we wait for durability gets a later one
+    boost::system::error_code ec;
+    index_store_->with_lock(key, [&] { ec = segments_->append(key, data, o); });
+    if (ec) {
+        std::cerr << "PUT " << key << " failed: " << ec.message() << std::endl;
+        co_return error_res(http::status::internal_server_error, "InternalError", key, req.version(), req.keep_alive());
+    }
+    if (opts_.durability == Durability::sync)
+        ec = co_await blocking_->run(BlockingOp::sync, [&] { return segments_->sync(o.segment); });
+    else if (opts_.durability == Durability::batch)
+        ec = co_await group_commit_->wait();
+    if (ec) {
+        std::cerr << "PUT " << key << " failed: " << ec.message() << std::endl;
+        index_store_->with_lock(key, [&] { segments_->claim(key, o); });
+        segments_->release(key, o);
+        co_return error_res(http::status::internal_server_error, "InternalError", key, req.version(), req.keep_alive());
+    }
+
+    if (cache_)
+        cache_->invalidate(key);
+    if (stat_cache_)
+        stat_cache_->invalidate(key);
+    // Overtaken by a later PUT or DELETE of the key, which is then what
+    // both the index and a restart see
+    bool found;
+    Object old;
+    if (!index_store_->replace_entry_if(key, o, found, old,
+                                        [&](bool, const Object&) { return segments_->claim(key, o); })) {
+        segments_->release(key, o);
+    } else if (found) {
+        if (old.segment) {
+            segments_->release(key, old);
+        } else if (old.type == 'f') {
+            co_await blocking_->run(BlockingOp::remove, [&] { return unlink_object(key); });
+        }
+    }
+    if (evictor_)
+        evictor_->poke();
+
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, SERVER_NAME);
+    res.insert("x-amz-object-size", std::to_string(o.size));
+    if (o.has_md5)
+        res.set(http::field::etag, object_etag(o));
+    if (hasher.algo() != ChecksumAlgo::none)
+        res.set("x-amz-checksum-" + std::string(checksum_name(hasher.algo())), hasher.checksum());
+    res.content_length(0);
+    res.keep_alive(req.keep_alive());
+    co_return res;
+}
+
+int S3HttpServer::open_packed(std::string_view key, Object& o) {
+    // The compactor may move it between the lookup and the open, a second
+    // lookup sees where it went
+    for (int i = 0; i < 2 && segments_ && index_store_->get(key, o) && o.segment; ++i) {
+        int fd = segments_->open(o.segment);
+        if (fd >= 0)
+            return fd;
+    }
+    return -1;
+}
+
+bool S3HttpServer::remove_packed(const std::string& key) {
+    Object old;
+    while (segments_ && index_store_->get(key, old) && old.segment) {
+        if (index_store_->remove_entry_at(key, old.segment, old.offset, [&] { segments_->remove(key, old); }))
+            return true;
+    }
+    return false;
+}
+
+void S3HttpServer::index_plain_object(const std::string& key, const Object& o) {
+    if (!index_store_)
+        return;
+    if (!segments_) {
+        index_store_->add_entry(key, o);
+        return;
+    }
+    bool found;
+    Object old;
+    index_store_->replace_entry_if(key, o, found, old, [&](bool had, const Object& prev) {
+        if (had && prev.segment)
+            segments_->remove(key, prev);
+        return true;
+    });
+}
+
+// DeleteObjects, POST /?delete. Up to 1000 keys unlinked in parallel on the
+// blocking pool, DELETE_BATCH per task, and removed from the index in one go.
+// Missing keys count as deleted like in S3.
+#define MAX_DELETE_KEYS 1000
+#define DELETE_BATCH 32
+
+net::awaitable<http::message_generator> S3HttpServer::delete_objects(std::string body, std::string content_md5, unsigned version, bool keep_alive) {
+    if (!content_md5.empty()) {
+        Md5 md5;
+        md5.update(body.data(), body.size());
+        auto digest = md5.finish();
+        if (content_md5 != base64_encode(digest.data(), digest.size()))
+            co_return error_res(http::status::bad_request, "BadDigest", bucket_name, version, keep_alive);
+    }
+
+    bool quiet = xml_value(body, "Quiet") == "true";
+    std::vector<std::string> keys;
+    size_t pos = 0;
+    std::string_view object;
+    while (xml_next(body, "Object", pos, object)) {
+        if (keys.size() == MAX_DELETE_KEYS)
+            co_return error_res(http::status::bad_request, "MalformedXML", bucket_name, version, keep_alive);
+        keys.push_back(xml_value(object, "Key"));
+    }
+    if (keys.empty())
+        co_return error_res(http::status::bad_request, "MalformedXML", bucket_name, version, keep_alive);
+
+    std::vector<beast::error_code> errors(keys.size());
+    // Packed keys are out of the index already
+    std::vector<char> packed(keys.size());
+    size_t tasks = (keys.size() + DELETE_BATCH - 1) / DELETE_BATCH;
+    std::vector<std::vector<std::string>> pruned(tasks);
+    co_await blocking_->run_each(BlockingOp::remove, tasks, [&](size_t task) {
+        size_t end = std::min(keys.size(), (task + 1) * DELETE_BATCH);
+        for (size_t i = task * DELETE_BATCH; i < end; ++i) {
+            auto& key = keys[i];
+            if (key.empty() || key.front() == PATH_DELIM || has_dot_dot(key) || is_reserved_key(key)) {
+                errors[i] = beast::errc::make_error_code(beast::errc::invalid_argument);
+                continue;
+            }
+            packed[i] = remove_packed(key);
+            if (!packed[i]) {
+                errors[i] = unlink_object(key);
+                if (!errors[i])
+                    prune_dirs(key, pruned[task]);
+            }
+            if (errors[i] == beast::errc::no_such_file_or_directory)
+                errors[i] = {};
+            if (cache_)
+                cache_->invalidate(key);
+            if (stat_cache_)
+                stat_cache_->invalidate(key);
+        }
+    });
+
+    if (index_store_) {
+        std::vector<std::string> gone;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (!errors[i] && !packed[i])
+                gone.push_back(keys[i]);
+        }
+        std::vector<std::string> dirs;
+        for (auto& d : pruned)
+            dirs.insert(dirs.end(), d.begin(), d.end());
+        gone.insert(gone.end(), dirs.begin(), dirs.end());
+        index_store_->remove_entries(gone);
+
+        // A PUT may have made one of them again and registered it before
+        // we dropped it. It did mkdir first, so it shows up here.
+        if (!dirs.empty()) {
+            std::vector<char> back(dirs.size());
+            co_await blocking_->run(BlockingOp::stat, [&] {
+                struct stat st;
+                for (size_t i = 0; i < dirs.size(); ++i)
+                    back[i] = lstat(dirs[i].c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+                return true;
+            });
+            std::time_t now = std::time(nullptr);
+            for (size_t i = 0; i < dirs.size(); ++i) {
+                if (back[i] && !index_store_->contains(dirs[i]))
+                    index_store_->add_entry(dirs[i], Object{0, now, 'd'});
+            }
+        }
+    }
+
+    std::string res =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<DeleteResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">";
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!errors[i]) {
+            if (quiet)
+                continue;
+            res.append("<Deleted><Key>");
+            xml_escape_append(res, keys[i]);
+            res.append("</Key></Deleted>");
+            continue;
+        }
+        bool invalid = errors[i] == beast::errc::invalid_argument;
+        res.append("<Error><Key>");
+        xml_escape_append(res, keys[i]);
+        res.append(invalid ? "</Key><Code>InvalidArgument</Code><Message>" : "</Key><Code>InternalError</Code><Message>");
+        xml_escape_append(res, errors[i].message());
+        res.append("</Message></Error>");
+    }
+    res.append("</DeleteResult>");
+    co_return xml_res(std::move(res), version, keep_alive);
+}
+
+// POSTs carry a small XML document (or nothing), the session reads it whole
+net::awaitable<S3HttpServer::response> S3HttpServer::handle_post(arena_request<http::string_body> req) {
+    QueryParams params;
+    if (!params.parse(req.target(), req.get_allocator().resource()))
+        co_return error_res(http::status::bad_request, "InvalidRequest", req.target(), req.version(), req.keep_alive());
+    std::string target(target_key(req.target(), bucket_name));
+    if (is_reserved_key(target))
+        co_return error_res(http::status::bad_request, "InvalidArgument", target, req.version(), req.keep_alive());
+
+    if (target.empty() && params.contains("delete")) {
+        co_return co_await delete_objects(std::move(req.body()), std::string(req[http::field::content_md5]),
+                                          req.version(), req.keep_alive());
+    }
+
+    if (!target.empty()) {
+        if (params.contains("uploads"))
+            co_return co_await create_multipart_upload(target, req.version(), req.keep_alive());
+        if (auto* upload = params.find("uploadId"))
+            co_return co_await complete_multipart_upload(target, std::string(*upload), std::move(req.body()), req.version(), req.keep_alive());
+    }
+
+    std::cout << "unsupported req: " << req.method() << " " << req.target() << std::endl;
+    co_return error_res(http::status::bad_request, "InvalidRequest", target, req.version(), req.keep_alive());
+}
+
+net::awaitable<S3HttpServer::response> S3HttpServer::handle_request(arena_request<http::file_body> req, const ObjectHasher* hasher,
+                                                                   const struct stat* written) {
     // Returns a bad request response
     auto const bad_request_res =
     [&req](beast::string_view why)
@@ -351,20 +1861,20 @@ http::message_generator S3HttpServer::handle_request(http::request<http::file_bo
     };
 
     auto const bucket_ops_res =
-    [&req, this](std::unordered_map<std::string, std::string>& aws_params)
+    [&req, this](const QueryParams& params)
     {
         http::response<http::string_body> res{http::status::ok, req.version()};
         res.set(http::field::server, SERVER_NAME);
         res.set(http::field::content_type, "application/xml");
         res.keep_alive(req.keep_alive());
-        if (aws_params.contains("versioning")) {
+        if (params.contains("versioning")) {
             res.body() =
                 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
                 "<VersioningConfiguration>"
                 "<Status>Suspended</Status>"
                 "<MfaDelete>Disabled</MfaDelete>"
                 "</VersioningConfiguration>";
-        } else if (aws_params.contains("object-lock")) {
+        } else if (params.contains("object-lock")) {
             res.body() = 
                 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
                 "<ObjectLockConfiguration></ObjectLockConfiguration>";
@@ -384,22 +1894,22 @@ http::message_generator S3HttpServer::handle_request(http::request<http::file_bo
         return res;
     };
 
-    //Store aws' s3 url req params
-    std::unordered_map<std::string, std::string> aws_params;
-    if (!parse_aws_params(req.target(), aws_params)) {
-        return bad_request_res("Malformed request");
+    // aws' s3 url req params, views into the target or the arena
+    QueryParams params;
+    if (!params.parse(req.target(), req.get_allocator().resource())) {
+        co_return bad_request_res("Malformed request");
     }
 
     // Ensure only / is used as a delimiter 
-    auto it = aws_params.find("delimiter");
-    if (it != aws_params.end()) {
-        if (!it->second.empty() && it->second != std::string(1, PATH_DELIM)) {
-            return bad_request_res("/ is the only supported delimiter.");
-        }
+    auto delimiter = params["delimiter"];
+    if (!delimiter.empty() && delimiter != std::string_view(PATH_DELIM_STR)) {
+        co_return bad_request_res("/ is the only supported delimiter.");
     }
 
-    std::string target = req.target();
-    sanitize_target_path(target);
+    // Points into req's target, which stays put when req is moved
+    std::string_view target = target_key(req.target(), bucket_name);
+    if (is_reserved_key(target))
+        co_return bad_request_res("Reserved key name");
 
     // Handles HeadObject/HeadBucket requests
     if (req.method() == http::verb::head) {
@@ -408,30 +1918,68 @@ http::message_generator S3HttpServer::handle_request(http::request<http::file_bo
             res.set(http::field::server, SERVER_NAME);
             res.insert("x-amz-bucket-region", "lobos");
             res.keep_alive(req.keep_alive());
-            return res;
+            co_return res;
         }
-        return handle_head_object(target, std::move(req));
+        co_return co_await handle_head_object(target, std::move(req));
     }
 
-    if (req.method() == http::verb::put) {
-        const auto size = fs::file_size(target);
-        if (index_store_) {
-            std::time_t now = std::time(nullptr);
+    // Multipart upload ops on an object, the id is checked against the key
+    // before anything touches the staging dir
+    auto* upload = params.find("uploadId");
+    if (upload && !target.empty()) {
+        if (!valid_upload_id(*upload))
+            co_return error_res(http::status::not_found, "NoSuchUpload", target, req.version(), req.keep_alive());
+        if (req.method() == http::verb::put) {
+            // The session validated it already, the part went where its
+            // number in decimal says: partNumber=01 is part 1
+            int part = 0;
+            parse_part_number(params["partNumber"], part);
+            co_return co_await upload_part_res(upload_dir(*upload) + std::to_string(part),
+                                               hasher, req.version(), req.keep_alive());
+        }
+        if (req.method() == http::verb::get)
+            co_return co_await list_parts(std::string(target), params, req.version(), req.keep_alive());
+        if (req.method() == http::verb::delete_)
+            co_return co_await abort_multipart_upload(std::string(target), std::string(*upload), req.version(), req.keep_alive());
+    }
 
-            Object o = {
-                size,
-                now,
-                'f',
-            };
-            index_store_->add_entry(target, o);
+    if (req.method() == http::verb::put) {
+        std::string key(target);
+        // The file may be gone already if a DELETE raced with us, what the
+        // session saw before the rename is what was acknowledged
+        struct stat st;
+        if (written)
+            st = *written;
+        else if (!co_await blocking_->run(BlockingOp::stat, [&] { return ::stat(key.c_str(), &st) == 0; }))
+            co_return error_res(http::status::internal_server_error, "InternalError", key, req.version(), req.keep_alive());
+        if (cache_)
+            cache_->invalidate(key);
+        if (stat_cache_)
+            stat_cache_->invalidate(key);
+        size_t size = st.st_size;
+        Object o = {
+            size,
+            st.st_mtime,
+            'f',
+        };
+        if (hasher && hasher->has_md5()) {
+            o.has_md5 = true;
+            o.md5 = hasher->md5();
         }
+        index_plain_object(key, o);
+        if (evictor_)
+            evictor_->poke();
 
         http::response<http::string_body> res{http::status::ok, req.version()};
         res.set(http::field::server, SERVER_NAME);
         res.insert("x-amz-object-size", std::to_string(size));
+        if (o.has_md5)
+            res.set(http::field::etag, object_etag(o));
+        if (hasher && hasher->algo() != ChecksumAlgo::none)
+            res.set("x-amz-checksum-" + std::string(checksum_name(hasher->algo())), hasher->checksum());
         res.content_length(0);
         res.keep_alive(req.keep_alive());
-        return res;
+        co_return res;
     }    
 
     // Now the big one, GET. It gets f'ed up and we use params to target between
@@ -441,69 +1989,484 @@ http::message_generator S3HttpServer::handle_request(http::request<http::file_bo
         // We're look at the params to figure out what to do
         // this is naive and will not work with listobjectv1
         if (target.empty()) {
-            if (aws_params.contains("list-type"))
-                return handle_list_objects(aws_params["prefix"], std::move(req));
-            if (aws_params.contains("versioning") || 
-                aws_params.contains("object-lock") || 
-                aws_params.contains("max-buckets") ||
-                aws_params.empty())
-                return bucket_ops_res(aws_params);
+            if (params.contains("list-type")) {
+                ListRequest lr;
+                if (!parse_list_request(params, lr))
+                    co_return bad_request_res("Invalid max-keys or continuation-token");
+                co_return co_await handle_list_objects(std::move(lr), std::move(req));
+            }
+            if (params.contains("versioning") || 
+                params.contains("object-lock") || 
+                params.contains("max-buckets") ||
+                params.empty())
+                co_return bucket_ops_res(params);
         } else {
             // This is a get object probably?
-            return handle_get_object(target, std::move(req));
+            co_return handle_get_object(target, std::move(req));
         }
     }
 
     if (req.method() == http::verb::delete_) {
-        auto deleted = fs::remove(target);
-        if (!deleted)
-            return not_found_key_res(target, std::move(req));
-        if (index_store_)
-            index_store_->index.erase(target);
+        std::string key(target);
+        beast::error_code ec;
+        // Packed objects have no file to unlink
+        bool packed = remove_packed(key);
+        if (!packed) {
+            ec = co_await blocking_->run(BlockingOp::remove, [&] {
+                return unlink_object(key);
+            });
+        }
+        if (cache_)
+            cache_->invalidate(key);
+        if (stat_cache_)
+            stat_cache_->invalidate(key);
+        if (ec == beast::errc::no_such_file_or_directory)
+            co_return not_found_key_res(target, std::move(req));
+        if (ec) {
+            std::cerr << "DELETE " << target << " failed: " << ec.message() << std::endl;
+            co_return error_res(http::status::internal_server_error, "InternalError", target, req.version(), req.keep_alive());
+        }
+        if (index_store_ && !packed)
+            index_store_->remove_entry(key);
 
-        return delete_object_res();
+        co_return delete_object_res();
     }
 
     std::cout << "unsupported req: " << req.method() << " " << req.target() << std::endl;
-    return bad_request_res("unsupported req");
+    co_return bad_request_res("unsupported req");
 }
 
+// Writes the headers through Beast then hands the payload to the kernel,
+// sendfile goes from the page cache to the socket without ever copying it
+// to userspace.
+net::awaitable<void> S3HttpServer::send_object(beast::tcp_stream& stream, arena_response<object_body>& res) {
+    http::response_serializer<object_body, arena_fields> sr{res};
+    co_await http::async_write_header(stream, sr);
+
+    auto& body = res.body();
+    off_t offset = body.offset();
+    std::uint64_t remaining = body.length();
+    auto& socket = stream.socket();
+    socket.native_non_blocking(true);
+
+    while (remaining > 0) {
+        ssize_t n = ::sendfile(socket.native_handle(), body.native_handle(), &offset,
+                               std::min<std::uint64_t>(remaining, 1ULL << 30));
+        if (n > 0) {
+            remaining -= n;
+            continue;
+        }
+        if (n == 0) // file truncated under us, nothing sane left to send
+            throw beast::system_error(http::error::short_read);
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            throw beast::system_error(beast::error_code(errno, beast::system_category()));
+
+        // Socket buffer is full, wait for the client to drain it
+        co_await socket.async_wait(net::socket_base::wait_write, net::cancel_after(std::chrono::seconds(30)));
+    }
+}
+
+#ifdef BOOST_ASIO_HAS_IO_URING
+// Per-session bounce buffer for io_uring body I/O
+static constexpr size_t URING_CHUNK = 256 * 1024;
+
+// Reads a PUT body chunk by chunk and writes each chunk at its offset
+// through the ring, the thread is free to serve other connections while the
+// disk catches up. `header_parser` must have the header read and nothing else.
+net::awaitable<arena_request<http::file_body>> S3HttpServer::read_put_uring(
+    beast::tcp_stream& stream,
+    beast::flat_buffer& buffer,
+    arena_parser<http::file_body>&& header_parser,
+    const std::string& path,
+    ObjectHasher& hasher,
+    struct stat& written)
+{
+    arena_parser<http::buffer_body> parser{std::move(header_parser)};
+    net::random_access_file file(stream.get_executor(), path,
+        net::file_base::write_only | net::file_base::create | net::file_base::exclusive);
+    if (opts_.fallocate && parser.content_length())
+        preallocate(file.native_handle(), *parser.content_length());
+
+    auto chunk = std::make_unique<char[]>(URING_CHUNK);
+    std::uint64_t offset = 0;
+    while (!parser.is_done()) {
+        parser.get().body().data = chunk.get();
+        parser.get().body().size = URING_CHUNK;
+        auto [ec, _] = co_await http::async_read(stream, buffer, parser, net::as_tuple(net::use_awaitable));
+        // need_buffer just means the chunk is full
+        if (ec && ec != http::error::need_buffer)
+            throw beast::system_error(ec);
+
+        size_t n = URING_CHUNK - parser.get().body().size;
+        if (n > 0) {
+            hasher.update(chunk.get(), n);
+            co_await net::async_write_at(file, offset, net::buffer(chunk.get(), n), net::use_awaitable);
+            offset += n;
+        }
+    }
+    hasher.finish();
+    store_sums(file.native_handle(), hasher, written);
+    file.close();
+
+    // The handlers only care about the header, the data is already on disk
+    co_return arena_request<http::file_body>{std::move(parser.release().base())};
+}
+
+// Same as send_object but the payload is read through the ring instead of
+// sendfile(2), which blocks the thread when the data isn't in the page cache.
+net::awaitable<void> S3HttpServer::send_object_uring(beast::tcp_stream& stream, arena_response<object_body>& res) {
+    http::response_serializer<object_body, arena_fields> sr{res};
+    co_await http::async_write_header(stream, sr);
+
+    auto& body = res.body();
+    // The file object closes what it owns, give it its own fd
+    int fd = dup(body.native_handle());
+    if (fd < 0)
+        throw beast::system_error(beast::error_code(errno, beast::system_category()));
+    net::random_access_file file(stream.get_executor(), fd);
+
+    auto chunk = std::make_unique<char[]>(URING_CHUNK);
+    std::uint64_t offset = body.offset();
+    std::uint64_t remaining = body.length();
+    while (remaining > 0) {
+        auto want = static_cast<size_t>(std::min<std::uint64_t>(remaining, URING_CHUNK));
+        auto [ec, n] = co_await file.async_read_some_at(offset, net::buffer(chunk.get(), want),
+                                                        net::as_tuple(net::use_awaitable));
+        if (ec == net::error::eof) // file truncated under us
+            throw beast::system_error(http::error::short_read);
+        if (ec)
+            throw beast::system_error(ec);
+        co_await net::async_write(stream, net::buffer(chunk.get(), n), net::use_awaitable);
+        offset += n;
+        remaining -= n;
+    }
+}
+#endif
+
+// Sends `res` and returns whether the connection stays open
+net::awaitable<bool> S3HttpServer::write_response(beast::tcp_stream& stream, response& res) {
+    // Handling the request may have taken a while (assembling a multipart
+    // upload), don't let that eat into the time we have to send
+    stream.expires_after(std::chrono::seconds(30));
+
+    bool keep_alive;
+    if (auto* obj = std::get_if<arena_response<object_body>>(&res)) {
+        keep_alive = obj->keep_alive();
+#ifdef BOOST_ASIO_HAS_IO_URING
+        if (opts_.io_uring)
+            co_await send_object_uring(stream, *obj);
+        else
+#endif
+        if (opts_.zero_copy)
+            co_await send_object(stream, *obj);
+        else
+            co_await beast::async_write(stream, http::message_generator(std::move(*obj)));
+        // Near enough, the header is a rounding error next to the payload
+        if (metrics_)
+            metrics_->add_bytes_out(obj->body().length());
+    } else if (auto* hit = std::get_if<CachedResponse>(&res)) {
+        keep_alive = hit->keep_alive;
+        auto date = http_date_line_now();
+        std::string_view end = keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+        std::array<net::const_buffer, 4> buffers{
+            net::buffer(hit->obj->header),
+            net::buffer(date.data(), date.size()),
+            net::buffer(end.data(), end.size()),
+            net::buffer(hit->obj->body),
+        };
+        auto sent = co_await net::async_write(stream, buffers);
+        if (metrics_)
+            metrics_->add_bytes_out(sent);
+    } else if (auto* hdr = std::get_if<arena_response<http::empty_body>>(&res)) {
+        keep_alive = hdr->keep_alive();
+        http::response_serializer<http::empty_body, arena_fields> sr{*hdr};
+        auto sent = co_await http::async_write(stream, sr);
+        if (metrics_)
+            metrics_->add_bytes_out(sent);
+    } else {
+        auto& msg = std::get<http::message_generator>(res);
+        keep_alive = msg.keep_alive();
+        auto sent = co_await beast::async_write(stream, std::move(msg));
+        if (metrics_)
+            metrics_->add_bytes_out(sent);
+    }
+    co_return keep_alive;
+}
+
+static S3Op classify(const arena_request<http::file_body>& req) {
+    switch (req.method()) {
+        case http::verb::get: {
+            // Anything on the bucket itself rather than a key is a listing
+            auto path = req.target().substr(0, req.target().find('?'));
+            auto slash = path.find(PATH_DELIM, 1);
+            return slash == beast::string_view::npos || slash + 1 == path.size() ? S3Op::list : S3Op::get;
+        }
+        case http::verb::head:
+            return S3Op::head;
+        case http::verb::put:
+            return req.count("x-amz-copy-source") ? S3Op::copy : S3Op::put;
+        case http::verb::delete_:
+            return S3Op::remove;
+        case http::verb::post:
+            return S3Op::post;
+        default:
+            return S3Op::other;
+    }
+}
+
+// Counts a connection for as long as it's open
+struct ConnectionGauge {
+    Metrics* metrics;
+    explicit ConnectionGauge(Metrics* m) : metrics(m) {
+        if (metrics)
+            metrics->connection_opened();
+    }
+    ~ConnectionGauge() {
+        if (metrics)
+            metrics->connection_closed();
+    }
+};
+
+// Records a request once its response is sent, or it failed
+struct RequestTimer {
+    Metrics* metrics;
+    S3Op op;
+    uint64_t bytes_in;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ~RequestTimer() {
+        if (metrics)
+            metrics->record(op, std::chrono::steady_clock::now() - start, bytes_in);
+    }
+};
+
+// Hands a request's phases to the tracer once it's answered, or failed
+struct TracedRequest {
+    Tracer* tracer;
+    RequestTrace trace;
+
+    TracedRequest(Tracer* tracer, const arena_request<http::file_body>& req, uint64_t size) : tracer(tracer) {
+        auto method = req.method_string();
+        method.copy(trace.method, std::min(method.size(), sizeof(trace.method) - 1));
+        auto target = req.target();
+        target.copy(trace.key, std::min(target.size(), sizeof(trace.key) - 1));
+        trace.size = size;
+    }
+    ~TracedRequest() { tracer->finish(trace); }
+};
+
 // Handles an HTTP server connection
 net::awaitable<void> S3HttpServer::do_session(beast::tcp_stream stream) {
     beast::flat_buffer buffer;
+    ConnectionGauge gauge(metrics_.get());
+    // Headers in and out, reused by every request on the connection
+    RequestArena arena;
 
     for(;;)
     {
         // Set timeout
         stream.expires_after(std::chrono::seconds(30));
 
-        http::request_parser<http::file_body> parser;
+        // Whatever the previous request left is gone by now
+        arena.reset();
+        arena_parser<http::file_body> parser{std::piecewise_construct, std::make_tuple(),
+                                             std::make_tuple(ArenaAllocator<char>(arena.resource()))};
         parser.body_limit(MAX_OBJ_SIZE);
 
         // Parse headers first for PUT reqs
-        co_await http::async_read_header(stream, buffer, parser);
+        auto header_bytes = co_await http::async_read_header(stream, buffer, parser);
+        // Timed from here, not while the connection idles between requests
+        std::optional<RequestTimer> timer;
+        if (metrics_)
+            timer.emplace(metrics_.get(), classify(parser.get()), header_bytes + parser.content_length().value_or(0));
+        std::optional<TracedRequest> traced;
+        if (tracer_)
+            traced.emplace(tracer_.get(), parser.get(), parser.content_length().value_or(0));
+        auto mark = [&traced](TracePhase p) {
+            if (traced)
+                traced->trace.mark(p);
+        };
+
+        arena_request<http::file_body> req;
+        bool body_read = false;
+        // PUTs land in a temp file that's renamed over the object once it's
+        // complete, it's removed if we bail out before that
+        struct TempFile {
+            std::string path;
+            ~TempFile() {
+                if (!path.empty())
+                    unlink(path.c_str());
+            }
+        } tmp;
+        std::string object;
+        std::optional<ObjectHasher> hasher;
+        struct stat written{};
+        bool no_replace = false;
+        if (parser.get().method() == http::verb::post) {
+            arena_parser<http::string_body> post_parser{std::move(parser)};
+            post_parser.body_limit(MAX_POST_SIZE);
+            mark(TracePhase::prepare);
+            co_await http::async_read(stream, buffer, post_parser);
+            mark(TracePhase::body);
+            auto res = co_await handle_post(post_parser.release());
+            mark(TracePhase::handle);
+            if (!co_await write_response(stream, res))
+                break;
+            continue;
+        }
+
+        if (parser.get().method() == http::verb::put && parser.get().count("x-amz-copy-source")) {
+            arena_parser<http::empty_body> copy_parser{std::move(parser)};
+            mark(TracePhase::prepare);
+            co_await http::async_read(stream, buffer, copy_parser);
+            mark(TracePhase::body);
+            auto res = co_await handle_copy(copy_parser.release());
+            mark(TracePhase::handle);
+            if (!co_await write_response(stream, res))
+                break;
+            continue;
+        }
 
         if (parser.get().method() == http::verb::put) {
-            std::string target = std::string(parser.get().target());
-            auto object = create_dest_dirs_if_not_exist(target);
-            beast::error_code ec;
-            // TODO here we wanna handle checksum that some clients provide
-            // it's stored in the body 
-            parser.get().body().open(object.c_str(), beast::file_mode::write, ec);
-            if (ec) {
-                //TODO
+            QueryParams params;
+            bool params_ok = params.parse(parser.get().target(), parser.get().get_allocator().resource());
+            std::string key(target_key(parser.get().target(), bucket_name));
+            if (!params_ok || is_reserved_key(key)) {
+                co_await beast::async_write(stream, error_res(http::status::bad_request, "InvalidArgument", key, parser.get().version(), false));
+                break;
+            }
+
+            bool multipart = false;
+            if (auto* upload = params.find("uploadId")) {
+                // UploadPart, the part goes in the upload's staging dir
+                int part;
+                if (!parse_part_number(params["partNumber"], part)) {
+                    co_await beast::async_write(stream, error_res(http::status::bad_request, "InvalidArgument", key, parser.get().version(), false));
+                    break;
+                }
+                bool found = co_await blocking_->run(BlockingOp::stat, [&] {
+                    return upload_matches(*upload, key);
+                });
+                if (!found) {
+                    co_await beast::async_write(stream, error_res(http::status::not_found, "NoSuchUpload", key, parser.get().version(), false));
+                    break;
+                }
+                object = upload_dir(*upload) + std::to_string(part);
+                multipart = true;
+            } else if (packable(parser, key)) {
+                // Reads the body too, it all shows up as handle
+                mark(TracePhase::prepare);
+                auto res = co_await put_packed(stream, buffer, std::move(parser), key);
+                mark(TracePhase::handle);
+                if (!co_await write_response(stream, res))
+                    break;
+                continue;
+            } else {
+                object = co_await create_dest_dirs_if_not_exist(key);
+                // Fail conditional PUTs before the body is sent when we can
+                if (!co_await put_preconditions_pass(object, parser.get())) {
+                    co_await beast::async_write(stream, error_res(http::status::precondition_failed, "PreconditionFailed", key, parser.get().version(), false));
+                    break;
+                }
+                no_replace = parser.get()[http::field::if_none_match] == "*";
+            }
+            tmp.path = temp_object_path(object);
+            // Content-MD5 is checked even without ETags
+            hasher.emplace(opts_.etags || parser.get().count(http::field::content_md5),
+                           requested_checksum(parser.get()));
+#ifdef BOOST_ASIO_HAS_IO_URING
+            if (opts_.io_uring) {
+                mark(TracePhase::prepare);
+                req = co_await read_put_uring(stream, buffer, std::move(parser), tmp.path, *hasher, written);
+                mark(TracePhase::body);
+                body_read = true;
+            }
+#endif
+            if (!body_read) {
+                arena_parser<put_body> put_parser{std::move(parser)};
+                put_parser.body_limit(MAX_OBJ_SIZE);
+                auto& body = put_parser.get().body();
+                body.hasher = &*hasher;
+                beast::error_code ec;
+                body.file.open(tmp.path.c_str(), beast::file_mode::write_new, ec);
+                auto slash = object.rfind(PATH_DELIM);
+                if (ec == beast::errc::no_such_file_or_directory && multipart) {
+                    // Aborted since we checked, its staging dir is gone for good
+                    tmp.path.clear();
+                    co_await beast::async_write(stream, error_res(http::status::not_found, "NoSuchUpload", key, put_parser.get().version(), false));
+                    break;
+                }
+                if (ec == beast::errc::no_such_file_or_directory && slash != std::string::npos) {
+                    // DeleteObjects pruned the directory since we made sure
+                    // it's there, make and register it again
+                    co_await create_parent_dirs(object.substr(0, slash));
+                    ec = {};
+                    body.file.open(tmp.path.c_str(), beast::file_mode::write_new, ec);
+                }
+                if (ec) {
+                    std::cerr << "PUT " << object << ": can't create " << tmp.path << ": " << ec.message() << std::endl;
+                    tmp.path.clear(); // not ours
+                    co_await beast::async_write(stream, error_res(http::status::internal_server_error, "InternalError", object, put_parser.get().version(), false));
+                    break;
+                }
+                int fd = body.file.file().native_handle();
+                if (opts_.fallocate && put_parser.content_length())
+                    preallocate(fd, *put_parser.content_length());
+
+                mark(TracePhase::prepare);
+                co_await http::async_read(stream, buffer, put_parser);
+                hasher->finish();
+                store_sums(fd, *hasher, written);
+                body.file.close();
+                mark(TracePhase::body);
+                // The handlers only care about the header from here
+                req = arena_request<http::file_body>{std::move(put_parser.release().base())};
+                body_read = true;
             }
         }
 
-        co_await http::async_read(stream, buffer, parser);
-        
-        auto req = parser.release();
-        http::message_generator msg = handle_request(std::move(req));
+        if (!body_read) {
+            mark(TracePhase::prepare);
+            co_await http::async_read(stream, buffer, parser);
+            mark(TracePhase::body);
+            req = parser.release();
+        }
 
-        bool keep_alive = msg.keep_alive();
-        co_await beast::async_write(stream, std::move(msg));
+        if (!tmp.path.empty()) {
+            if (!digests_match(req, *hasher)) {
+                // The whole body was read, the connection is still usable
+                auto res = response{error_res(http::status::bad_request, "BadDigest", object, req.version(), req.keep_alive())};
+                if (!co_await write_response(stream, res))
+                    break;
+                continue;
+            }
+            // The object may have changed while the body was coming in,
+            // If-None-Match: * is settled by the rename itself
+            beast::error_code ec;
+            bool pass = co_await put_preconditions_pass(object, req);
+            if (pass)
+                ec = co_await commit_put(tmp.path, object, no_replace);
+            if (!pass || (no_replace && ec == beast::errc::file_exists)) {
+                auto res = response{error_res(http::status::precondition_failed, "PreconditionFailed", object, req.version(), req.keep_alive())};
+                if (!co_await write_response(stream, res))
+                    break;
+                continue;
+            }
+            if (ec) {
+                std::cerr << "PUT " << object << " failed: " << ec.message() << std::endl;
+                co_await beast::async_write(stream, error_res(http::status::internal_server_error, "InternalError", object, req.version(), false));
+                break;
+            }
+            tmp.path.clear();
+            mark(TracePhase::commit);
+        }
 
-        if (!keep_alive)
+        auto res = handle_read_now(req);
+        if (!res)
+            res = co_await handle_request(std::move(req), hasher ? &*hasher : nullptr, hasher ? &written : nullptr);
+        mark(TracePhase::handle);
+        if (!co_await write_response(stream, *res))
             break;
     }
 
@@ -511,6 +2474,82 @@ net::awaitable<void> S3HttpServer::do_session(beast::tcp_stream stream) {
     stream.socket().shutdown(net::ip::tcp::socket::shutdown_send);
 }
 
+std::string S3HttpServer::render_metrics() const {
+    std::string out;
+    metrics_->render(out);
+
+    if (index_store_) {
+        out += "# HELP lobos_index_objects Entries in the index, directories included\n"
+               "# TYPE lobos_index_objects gauge\n"
+               "lobos_index_objects " + std::to_string(index_store_->size()) + "\n"
+               "# HELP lobos_index_bytes Total size of the indexed objects\n"
+               "# TYPE lobos_index_bytes gauge\n"
+               "lobos_index_bytes " + std::to_string(index_store_->bytes()) + "\n";
+    }
+    if (cache_) {
+        auto s = cache_->stats();
+        out += "# HELP lobos_object_cache_hits_total GETs served from the object cache\n"
+               "# TYPE lobos_object_cache_hits_total counter\n"
+               "lobos_object_cache_hits_total " + std::to_string(s.hits) + "\n"
+               "# HELP lobos_object_cache_misses_total GETs the object cache couldn't serve\n"
+               "# TYPE lobos_object_cache_misses_total counter\n"
+               "lobos_object_cache_misses_total " + std::to_string(s.misses) + "\n"
+               "# HELP lobos_object_cache_bytes Size of the cached objects\n"
+               "# TYPE lobos_object_cache_bytes gauge\n"
+               "lobos_object_cache_bytes " + std::to_string(s.bytes) + "\n";
+    }
+    out += "# HELP lobos_blocking_ops_total Filesystem calls run off the server threads\n"
+           "# TYPE lobos_blocking_ops_total counter\n";
+    for (size_t i = 0; i < static_cast<size_t>(BlockingOp::count); ++i) {
+        auto op = static_cast<BlockingOp>(i);
+        out += "lobos_blocking_ops_total{op=\"" + std::string(BlockingPool::op_name(op)) + "\"} "
+             + std::to_string(blocking_->stats(op).completed) + "\n";
+    }
+    out += "# HELP lobos_blocking_inline_total Filesystem calls run on a server thread, the pool was full\n"
+           "# TYPE lobos_blocking_inline_total counter\n";
+    for (size_t i = 0; i < static_cast<size_t>(BlockingOp::count); ++i) {
+        auto op = static_cast<BlockingOp>(i);
+        out += "lobos_blocking_inline_total{op=\"" + std::string(BlockingPool::op_name(op)) + "\"} "
+             + std::to_string(blocking_->stats(op).inline_runs) + "\n";
+    }
+    return out;
+}
+
+net::awaitable<void> S3HttpServer::do_metrics_session(beast::tcp_stream stream) {
+    beast::flat_buffer buffer;
+    for (;;) {
+        stream.expires_after(std::chrono::seconds(30));
+        http::request<http::empty_body> req;
+        co_await http::async_read(stream, buffer, req);
+
+        http::response<http::string_body> res{http::status::ok, req.version()};
+        res.set(http::field::server, SERVER_NAME);
+        res.keep_alive(req.keep_alive());
+        if (req.method() == http::verb::get && req.target() == "/metrics") {
+            res.set(http::field::content_type, "text/plain; version=0.0.4");
+            res.body() = render_metrics();
+        } else {
+            res.result(http::status::not_found);
+        }
+        res.prepare_payload();
+        co_await beast::async_write(stream, http::message_generator(std::move(res)));
+        if (!req.keep_alive())
+            break;
+    }
+    stream.socket().shutdown(net::ip::tcp::socket::shutdown_send);
+}
+
+net::awaitable<void> S3HttpServer::do_metrics_listen(net::ip::tcp::endpoint ep) {
+    auto executor = co_await net::this_coro::executor;
+    net::ip::tcp::acceptor acceptor{executor, ep};
+
+    for (;;) {
+        net::ip::tcp::socket socket = co_await acceptor.async_accept(net::use_awaitable);
+        // Scrapers that hang up early aren't worth a log line
+        net::co_spawn(executor, do_metrics_session(beast::tcp_stream{std::move(socket)}), net::detached);
+    }
+}
+
 net::awaitable<void> S3HttpServer::do_listen(net::ip::tcp::endpoint ep) {
     auto executor = co_await net::this_coro::executor;
     net::ip::tcp::acceptor acceptor{executor};
@@ -545,6 +2584,25 @@ net::awaitable<void> S3HttpServer::do_listen(net::ip::tcp::endpoint ep) {
     }
 }
 
+// Asio gives each io_context its own ring but only sets it up on first use,
+// do it now so a kernel without io_uring (or a seccomp profile blocking it)
+// means falling back at startup rather than failing requests.
+static bool setup_io_uring([[maybe_unused]] std::vector<std::unique_ptr<net::io_context>>& ioctxs) {
+#ifdef BOOST_ASIO_HAS_IO_URING
+    try {
+        for (auto& ioc : ioctxs)
+            net::use_service<net::detail::io_uring_service>(*ioc);
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "io_uring unavailable (" << e.what() << "), using regular file I/O" << std::endl;
+        return false;
+    }
+#else
+    std::cerr << "lobos was built without io_uring support (make IO_URING=1), using regular file I/O" << std::endl;
+    return false;
+#endif
+}
+
 void S3HttpServer::start(int threads, bool pin) {
     std::cout << "Starting S3 HTTP server for bucket " << bucket_name << " at " << endpoint << std::endl;
     
@@ -554,6 +2612,41 @@ void S3HttpServer::start(int threads, bool pin) {
     for (int i = 0; i < threads; ++i)
         ioctxs.emplace_back(std::make_unique<net::io_context>(1));
 
+    if (opts_.io_uring)
+        opts_.io_uring = setup_io_uring(ioctxs);
+
+    // The index is ready by now, packed objects go back in before we serve
+    if (opts_.pack_max_bytes > 0 && index_store_) {
+        segments_ = std::make_unique<SegmentStore>(SEGMENTS_DIR, threads, *index_store_);
+        segments_->recover();
+    }
+
+    if (opts_.slow_request.count() > 0 || !opts_.trace_file.empty())
+        tracer_ = std::make_unique<Tracer>(threads, opts_.slow_request, opts_.trace_file, opts_.trace_sample);
+
+    if (opts_.metrics_port) {
+        metrics_ = std::make_unique<Metrics>(threads);
+        // Scrapes are rare enough to share a server thread
+        net::co_spawn(*ioctxs[0], do_metrics_listen({endpoint.address(), opts_.metrics_port}),
+            [](std::exception_ptr e) {
+                if (e) {
+                    try { std::rethrow_exception(e); }
+                    catch (std::exception const& ex) {
+                        std::cerr << "Metrics listener error: " << ex.what() << std::endl;
+                    }
+                }
+            });
+    }
+
+    // Stop every io_context on SIGINT/SIGTERM so main can clean up
+    net::signal_set signals(*ioctxs[0], SIGINT, SIGTERM);
+    signals.async_wait([&ioctxs](beast::error_code const& ec, int) {
+        if (ec)
+            return;
+        for (auto& ioc : ioctxs)
+            ioc->stop();
+    });
+
     std::vector<std::thread> thread_pool;
     thread_pool.reserve(threads);
 
@@ -562,6 +2655,10 @@ void S3HttpServer::start(int threads, bool pin) {
 
             if (pin)
                 pin_thread_to_core(i);
+            if (metrics_)
+                metrics_->bind_thread(i);
+            if (tracer_)
+                tracer_->bind_thread(i);
 
             net::co_spawn(
                 *ioctxs[i],
@@ -580,4 +2677,18 @@ void S3HttpServer::start(int threads, bool pin) {
 
     for (auto& t : thread_pool)
         t.join();
+    // Flushes what's left and closes the trace file
+    tracer_.reset();
+
+    blocking_->print_stats(std::cout);
+    if (cache_)
+        cache_->print_stats(std::cout);
+    if (stat_cache_)
+        stat_cache_->print_stats(std::cout);
+    if (group_commit_)
+        group_commit_->print_stats(std::cout);
+    if (segments_)
+        segments_->print_stats(std::cout);
+    if (evictor_)
+        evictor_->print_stats(std::cout);
 }
\ No newline at end of file
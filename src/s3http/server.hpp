@@ -1,5 +1,6 @@
 
 #include <boost/asio/awaitable.hpp>
+#include <boost/asio/cancel_after.hpp>
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
@@ -8,13 +9,31 @@
 #include <boost/beast/version.hpp>
 #include <boost/config.hpp>
 
+#include <chrono>
 #include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string>
 #include <thread>
-#include <unordered_set>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 #include "../index/index.hpp"
+#include "../index/evictor.hpp"
+#include "blocking_pool.hpp"
+#include "checksum.hpp"
+#include "generator_body.hpp"
+#include "group_commit.hpp"
+#include "metrics.hpp"
+#include "object_body.hpp"
+#include "object_cache.hpp"
+#include "request.hpp"
+#include "segment_store.hpp"
+#include "stat_cache.hpp"
+#include "trace.hpp"
 
 
 namespace beast = boost::beast;
@@ -22,16 +41,92 @@ namespace http  = beast::http;
 namespace net   = boost::asio;
 
 
+// How hard a PUT tries to be on disk before it's acknowledged. Every mode
+// writes to a temp file renamed over the object so readers never see a
+// partial object and a dropped upload leaves the old one in place.
+//   none:  rename, the page cache flushes whenever it does
+//   batch: group commit, one syncfs for all the PUTs of the last few ms
+//   sync:  fdatasync, rename, fsync of the directory for every PUT
+enum class Durability { none, batch, sync };
+
+struct ServerOptions {
+    // Send GetObject payloads with sendfile(2) instead of copying them
+    // through userspace
+    bool zero_copy = true;
+    // PUT and GET bodies go through the io_context's io_uring instead of
+    // blocking the thread on disk I/O. Needs a build with IO_URING=1
+    bool io_uring = false;
+    // Blocking filesystem calls (mkdir, stat, unlink, readdir) run on this
+    // many threads, at most `blocking_queue_depth` of them waiting
+    int blocking_threads = 4;
+    size_t blocking_queue_depth = 1024;
+    // Small objects served from memory, 0 disables the cache
+    size_t cache_bytes = 0;
+    size_t cache_max_object = 1 << 20;
+    // Filesystem mode HEAD/GET remember stat results, 0 disables it
+    std::chrono::milliseconds stat_cache_ttl{0};
+    size_t stat_cache_entries = 1 << 20;
+    Durability durability = Durability::none;
+    std::chrono::milliseconds batch_interval{5};
+    // Reserve Content-Length bytes for PUTs upfront
+    bool fallocate = false;
+    // MD5 every PUT for its ETag. Checksums sent by clients (Content-MD5,
+    // x-amz-checksum-*) are verified either way
+    bool etags = true;
+    // Cache mode, the least recently read objects are deleted once the
+    // bucket goes over `max_bytes` until it's under `evict_low_pct`% of it.
+    // Needs the index, 0 disables it
+    uint64_t max_bytes = 0;
+    int evict_low_pct = 90;
+    // PUTs up to that size are appended to segment files instead of getting
+    // a file of their own. Needs the index, 0 disables it
+    size_t pack_max_bytes = 0;
+    // Prometheus metrics served on that port at /metrics, 0 disables them
+    unsigned short metrics_port = 0;
+    // Requests slower than that are logged with the time spent in each
+    // phase, 0 disables the log
+    std::chrono::milliseconds slow_request{0};
+    // One request in `trace_sample` is written there in Chrome's trace
+    // format, empty disables it
+    std::string trace_file;
+    unsigned trace_sample = 100;
+};
+
+// GetObject served from the object cache
+struct CachedResponse {
+    std::shared_ptr<const CachedObject> obj;
+    bool keep_alive;
+};
+
 class S3HttpServer {
     public:
+        // GetObject responses are kept apart from the rest so the session
+        // can send their payload with sendfile or straight from the cache.
+        // Header only ones (HEAD, 304) skip message_generator's allocation.
+        using response = std::variant<http::message_generator, arena_response<object_body>,
+                                      arena_response<http::empty_body>, CachedResponse>;
+
         explicit S3HttpServer(
             std::string address, 
             unsigned short port, 
             std::string dir, 
-            IndexStore* index_store
+            IndexStore* index_store,
+            ServerOptions opts = {}
         )
-            : index_store_(index_store) 
+            : index_store_(index_store), opts_(opts),
+              blocking_(std::make_unique<BlockingPool>(opts.blocking_threads, opts.blocking_queue_depth))
         {
+            if (opts_.cache_bytes > 0)
+                cache_ = std::make_unique<ObjectCache>(opts_.cache_bytes, opts_.cache_max_object);
+            if (opts_.durability == Durability::batch)
+                group_commit_ = std::make_unique<GroupCommit>(dir, opts_.batch_interval);
+            if (opts_.stat_cache_ttl.count() > 0)
+                stat_cache_ = std::make_unique<StatCache>(opts_.stat_cache_ttl, opts_.stat_cache_entries);
+            if (opts_.max_bytes > 0 && index_store_) {
+                evictor_ = std::make_unique<Evictor>(*index_store_, opts_.max_bytes, opts_.max_bytes / 100 * opts_.evict_low_pct,
+                    [this](const std::string& key, const Object& o) { return evict_object(key, o); });
+            }
+
             auto const addr = net::ip::make_address(address);
             endpoint = {addr, port};
 
@@ -44,31 +139,103 @@ class S3HttpServer {
         ~S3HttpServer() {}; 
 
         void start(int threads, bool pin);
+
     private:
+        // bench/request_bench runs requests through the handlers directly
+        friend class RequestBench;
+
         IndexStore* index_store_;
+        ServerOptions opts_;
+        std::unique_ptr<BlockingPool> blocking_;
+        std::unique_ptr<ObjectCache> cache_;
+        std::unique_ptr<StatCache> stat_cache_;
+        std::unique_ptr<GroupCommit> group_commit_;
+        std::unique_ptr<SegmentStore> segments_;
+        std::unique_ptr<Metrics> metrics_;
+        std::unique_ptr<Tracer> tracer_;
+        // Last, it calls back into the caches until it's gone
+        std::unique_ptr<Evictor> evictor_;
+        // Reads only go through the index once it's fully built, writes
+        // are applied to it regardless
+        bool index_ready() const { return index_store_ && index_store_->ready(); }
 
         net::ip::tcp::endpoint endpoint;
         std::string bucket_name;
 
         net::awaitable<void> do_listen(net::ip::tcp::endpoint ep);
         net::awaitable<void> do_session(beast::tcp_stream stream);
-        http::message_generator handle_request(http::request<http::file_body>&& req);
-
-
-        void sanitize_target_path(std::string& target);
-        bool parse_aws_params(std::string_view t, std::unordered_map<std::string, std::string>& aws_params);
-        static std::string to_rfc1123(time_t t);
-        static beast::string_view mime_type(beast::string_view path);
-        std::string create_dest_dirs_if_not_exist(std::string object);
-        auto do_metadata_req(boost::string_view path);
-
-        std::string do_list_objects(std::string path);
-        http::message_generator handle_get_object(beast::string_view object, http::request<http::file_body>&& req);
-        http::message_generator handle_head_object(beast::string_view object, http::request<http::file_body>&& req);
-        http::message_generator handle_list_objects(beast::string_view prefix, http::request<http::file_body>&& req);
-        http::message_generator handle_put_object(beast::string_view object, http::request<http::file_body>&& req);
-
-        http::message_generator not_found_bucket_res(beast::string_view bucket, http::request<http::file_body>&& req);
-        http::message_generator not_found_key_res(beast::string_view object, http::request<http::file_body>&& req);
+        net::awaitable<void> do_metrics_listen(net::ip::tcp::endpoint ep);
+        net::awaitable<void> do_metrics_session(beast::tcp_stream stream);
+        // The request metrics plus gauges of the index and caches
+        std::string render_metrics() const;
+        net::awaitable<void> send_object(beast::tcp_stream& stream, arena_response<object_body>& res);
+#ifdef BOOST_ASIO_HAS_IO_URING
+        net::awaitable<arena_request<http::file_body>> read_put_uring(
+            beast::tcp_stream& stream,
+            beast::flat_buffer& buffer,
+            arena_parser<http::file_body>&& header_parser,
+            const std::string& path,
+            ObjectHasher& hasher,
+            struct stat& written);
+        net::awaitable<void> send_object_uring(beast::tcp_stream& stream, arena_response<object_body>& res);
+#endif
+        net::awaitable<bool> write_response(beast::tcp_stream& stream, response& res);
+        // `hasher` has what was computed over a PUT's body, `written` the
+        // size and mtime of the file it went to
+        net::awaitable<response> handle_request(arena_request<http::file_body> req, const ObjectHasher* hasher = nullptr,
+                                                const struct stat* written = nullptr);
+        net::awaitable<response> handle_post(arena_request<http::string_body> req);
+        net::awaitable<response> handle_copy(arena_request<http::empty_body> req);
+
+
+        net::awaitable<std::string> create_dest_dirs_if_not_exist(std::string object);
+        // Makes `path` and its parents whatever the index says, and indexes them
+        net::awaitable<void> create_parent_dirs(const std::string& path);
+        net::awaitable<beast::error_code> commit_put(const std::string& tmp, const std::string& object, bool no_replace = false);
+        // If-Match/If-None-Match/If-(Un)Modified-Since of a PUT against the
+        // object as it is now
+        net::awaitable<bool> put_preconditions_pass(const std::string& object, const arena_fields& fields);
+        // Unconditional PUTs small enough to be packed
+        bool packable(const arena_parser<http::file_body>& parser, const std::string& key) const;
+        net::awaitable<response> put_packed(beast::tcp_stream& stream, beast::flat_buffer& buffer,
+                                            arena_parser<http::file_body>&& header_parser, std::string key);
+        // fd on the segment holding `key` if it's packed, -1 if it's not.
+        // `o` gets its index entry.
+        int open_packed(std::string_view key, Object& o);
+        // Deletes `key` if it's packed, false if it's not
+        bool remove_packed(const std::string& key);
+        // Indexes a plain file just written as `key`, over a packed copy if any
+        void index_plain_object(const std::string& key, const Object& o);
+
+        enum class range_result { none, ok, unsatisfiable };
+        static range_result parse_range(beast::string_view header, std::uint64_t size, std::uint64_t& first, std::uint64_t& last);
+        bool do_metadata_req(beast::string_view path, Object& o);
+
+        std::vector<FsListEntry> list_fs(const ListRequest& lr);
+        std::shared_ptr<const CachedObject> load_cached_object(beast::string_view object, const object_body::value_type& body, std::string_view etag);
+        response handle_get_object(beast::string_view object, arena_request<http::file_body>&& req);
+        net::awaitable<response> handle_head_object(beast::string_view object, arena_request<http::file_body> req);
+        // The headers of a HEAD of `o`, checksums aside
+        response head_object_res(beast::string_view object, const Object& o, const arena_request<http::file_body>& req);
+        // GETs of an object, and HEADs the index or the stat cache can
+        // answer, without a coroutine: handle_request's frame is too big for
+        // asio to recycle, it would be an allocation per request. Empty when
+        // handle_request has to take it, `req` is then left alone.
+        std::optional<response> handle_read_now(arena_request<http::file_body>& req);
+        net::awaitable<http::message_generator> handle_list_objects(ListRequest lr, arena_request<http::file_body> req);
+        http::message_generator handle_put_object(beast::string_view object, arena_request<http::file_body>&& req);
+
+        net::awaitable<http::message_generator> create_multipart_upload(std::string key, unsigned version, bool keep_alive);
+        net::awaitable<http::message_generator> upload_part_res(std::string part_path, const ObjectHasher* hasher, unsigned version, bool keep_alive);
+        net::awaitable<http::message_generator> complete_multipart_upload(std::string key, std::string upload_id, std::string body, unsigned version, bool keep_alive);
+        net::awaitable<http::message_generator> abort_multipart_upload(std::string key, std::string upload_id, unsigned version, bool keep_alive);
+        bool evict_object(const std::string& key, const Object& o);
+        net::awaitable<http::message_generator> delete_objects(std::string body, std::string content_md5, unsigned version, bool keep_alive);
+        net::awaitable<http::message_generator> list_parts(std::string key, QueryParams params, unsigned version, bool keep_alive);
+
+        http::message_generator not_found_bucket_res(beast::string_view bucket, arena_request<http::file_body>&& req);
+        http::message_generator not_found_key_res(beast::string_view object, arena_request<http::file_body>&& req);
+        http::message_generator error_res(http::status status, beast::string_view code, beast::string_view resource, unsigned version, bool keep_alive);
+        http::message_generator range_not_satisfiable_res(beast::string_view object, std::uint64_t size, arena_request<http::file_body>&& req);
 
 };
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include <algorithm>
+
+#include "stat_cache.hpp"
+
+StatCache::StatCache(std::chrono::milliseconds ttl, size_t max_entries)
+    : ttl(ttl), shard_max_entries(std::max<size_t>(max_entries / shard_count, 1))
+{
+}
+
+StatCache::lookup StatCache::get(std::string_view key, Object& o) {
+    auto& shard = shard_for(key);
+    std::lock_guard lock(shard.mtx);
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end() || it->second.expires < clock::now()) {
+        shard.misses++;
+        return lookup::miss;
+    }
+    if (!it->second.exists) {
+        shard.negative_hits++;
+        return lookup::not_found;
+    }
+    shard.hits++;
+    o = it->second.o;
+    return lookup::found;
+}
+
+uint64_t StatCache::generation(std::string_view key) const {
+    return shard_for(key).generation.load(std::memory_order_acquire);
+}
+
+void StatCache::put(std::string_view key, bool exists, const Object& o, uint64_t generation) {
+    auto& shard = shard_for(key);
+    auto now = clock::now();
+    std::lock_guard lock(shard.mtx);
+    if (shard.generation.load(std::memory_order_relaxed) != generation)
+        return;
+
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end()) {
+        it->second = Entry{o, exists, now + ttl};
+        return;
+    }
+
+    if (shard.ring.size() < shard_max_entries) {
+        it = shard.entries.emplace(std::string(key), Entry{o, exists, now + ttl}).first;
+        shard.ring.push_back(it->first);
+        return;
+    }
+    // FIFO, with the same ttl for everyone the oldest entry is also the
+    // first to expire
+    auto& slot = shard.ring[shard.hand];
+    shard.entries.erase(shard.entries.find(slot));
+    it = shard.entries.emplace(std::string(key), Entry{o, exists, now + ttl}).first;
+    slot = it->first;
+    shard.hand = (shard.hand + 1) % shard.ring.size();
+}
+
+void StatCache::invalidate(std::string_view key) {
+    auto& shard = shard_for(key);
+    std::lock_guard lock(shard.mtx);
+    shard.generation.fetch_add(1, std::memory_order_release);
+    // Expired rather than erased, the ring still points at its key
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end())
+        it->second.expires = clock::time_point::min();
+}
+
+void StatCache::print_stats(std::ostream& os) const {
+    uint64_t hits = 0, negative_hits = 0, misses = 0;
+    for (auto& shard : shards) {
+        std::lock_guard lock(shard.mtx);
+        hits += shard.hits;
+        negative_hits += shard.negative_hits;
+        misses += shard.misses;
+    }
+    os << "Stat cache: hits=" << hits
+       << " negative_hits=" << negative_hits
+       << " misses=" << misses << std::endl;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../index/index.hpp"
+
+// Short lived cache of stat results for the filesystem mode (no index, or
+// the index isn't built yet). Misses are cached too: clients probing for
+// keys that aren't there (LMCache lookups) get their 404 without a syscall.
+//
+// Entries live `ttl` at most, that's how long a change made by another
+// application can go unnoticed. Lobos' own PUT/DELETE invalidate the key
+// right away, with the same per-shard generation trick as the object cache
+// so a stat racing with a PUT doesn't put the old answer back.
+class StatCache {
+    public:
+        enum class lookup { miss, found, not_found };
+
+        StatCache(std::chrono::milliseconds ttl, size_t max_entries);
+
+        lookup get(std::string_view key, Object& o);
+        uint64_t generation(std::string_view key) const;
+        // `exists` false caches a 404
+        void put(std::string_view key, bool exists, const Object& o, uint64_t generation);
+        void invalidate(std::string_view key);
+
+        void print_stats(std::ostream& os) const;
+
+    private:
+        using clock = std::chrono::steady_clock;
+        static constexpr size_t shard_count = 64;
+
+        struct Entry {
+            Object o;
+            bool exists;
+            clock::time_point expires;
+        };
+
+        // Lets string_views look entries up without building a string
+        struct key_hash {
+            using is_transparent = void;
+            size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+        };
+
+        struct alignas(64) Shard {
+            mutable std::mutex mtx;
+            std::unordered_map<std::string, Entry, key_hash, std::equal_to<>> entries;
+            // Keys of `entries` in insertion order, a full shard evicts the
+            // one at `hand`. Entries only leave the map through here so the
+            // views stay valid, the map's nodes don't move on rehash.
+            std::vector<std::string_view> ring;
+            size_t hand = 0;
+            std::atomic<uint64_t> generation{0};
+            uint64_t hits = 0;
+            uint64_t negative_hits = 0;
+            uint64_t misses = 0;
+        };
+
+        Shard& shard_for(std::string_view key) {
+            return shards[std::hash<std::string_view>{}(key) % shard_count];
+        }
+        const Shard& shard_for(std::string_view key) const {
+            return shards[std::hash<std::string_view>{}(key) % shard_count];
+        }
+
+        clock::duration ttl;
+        size_t shard_max_entries;
+        std::array<Shard, shard_count> shards;
+};
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include "trace.hpp"
+
+thread_local Tracer::Ring* Tracer::current = nullptr;
+
+static const char* phase_name(size_t p) {
+    switch (static_cast<TracePhase>(p)) {
+        case TracePhase::prepare: return "prepare";
+        case TracePhase::body:    return "body";
+        case TracePhase::commit:  return "commit";
+        case TracePhase::handle:  return "handle";
+        case TracePhase::write:   return "write";
+        default:                  return "unknown";
+    }
+}
+
+Tracer::Tracer(int threads, std::chrono::microseconds slow, std::string trace_path, unsigned sample)
+    : sample(std::max(sample, 1u))
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // rdtsc ticks at a constant rate on anything recent, measure it once
+    auto t0 = std::chrono::steady_clock::now();
+    auto c0 = RequestTrace::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - t0;
+    ticks_per_us = (RequestTrace::now() - c0) / elapsed.count();
+#else
+    ticks_per_us = std::chrono::steady_clock::period::den / 1e6 / std::chrono::steady_clock::period::num;
+#endif
+    slow_ticks = slow.count() * ticks_per_us;
+
+    for (int i = 0; i < std::max(threads, 1); ++i) {
+        rings.push_back(std::make_unique<Ring>());
+        rings.back()->id = i;
+    }
+
+    if (!trace_path.empty()) {
+        trace_file = std::fopen(trace_path.c_str(), "w");
+        if (trace_file)
+            std::fputs("[\n", trace_file);
+        else
+            std::cerr << "Can't open trace file " << trace_path << ": " << std::strerror(errno) << std::endl;
+    }
+
+    thread = std::thread([this] { run(); });
+}
+
+Tracer::~Tracer() {
+    {
+        std::lock_guard lock(mtx);
+        stopping = true;
+    }
+    cv.notify_one();
+    thread.join();
+    if (trace_file) {
+        std::fputs("\n]\n", trace_file);
+        std::fclose(trace_file);
+    }
+}
+
+void Tracer::bind_thread(int i) {
+    current = rings[i % rings.size()].get();
+}
+
+void Tracer::finish(RequestTrace& t) {
+    t.mark(TracePhase::write);
+    auto& ring = current ? *current : *rings[0];
+    bool slow = slow_ticks && t.end.back() - t.start >= slow_ticks;
+    bool sampled = trace_file && ++ring.requests % sample == 0;
+    if (!slow && !sampled)
+        return;
+
+    // Phases the request skipped end where the previous one did
+    uint64_t prev = t.start;
+    for (auto& end : t.end) {
+        if (!end)
+            end = prev;
+        prev = end;
+    }
+
+    auto tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) == ring_size) {
+        ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    ring.records[tail % ring_size] = Record{t, slow, sampled};
+    ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+void Tracer::run() {
+    for (;;) {
+        bool stop;
+        {
+            std::unique_lock lock(mtx);
+            cv.wait_for(lock, std::chrono::milliseconds(10), [this] { return stopping; });
+            stop = stopping;
+        }
+        uint64_t dropped = 0;
+        for (auto& ring : rings) {
+            drain(*ring);
+            dropped += ring->dropped.load(std::memory_order_relaxed);
+        }
+        if (dropped > reported_drops) {
+            std::cerr << "Tracer: " << dropped - reported_drops << " requests not logged, ring full" << std::endl;
+            reported_drops = dropped;
+        }
+        if (trace_file)
+            std::fflush(trace_file);
+        if (stop)
+            return;
+    }
+}
+
+void Tracer::drain(Ring& ring) {
+    auto head = ring.head.load(std::memory_order_relaxed);
+    auto tail = ring.tail.load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+        auto& r = ring.records[head % ring_size];
+        if (r.slow)
+            log_slow(ring, r.trace);
+        if (r.sampled && trace_file)
+            write_trace(ring, r.trace);
+    }
+    ring.head.store(head, std::memory_order_release);
+}
+
+void Tracer::log_slow(const Ring& ring, const RequestTrace& t) {
+    std::string line = "Slow request: ";
+    line += t.method;
+    line += ' ';
+    line += t.key;
+    line += " size=" + std::to_string(t.size);
+    line += " total_us=" + std::to_string((uint64_t)to_us(t.end.back() - t.start));
+    uint64_t prev = t.start;
+    for (size_t p = 0; p < RequestTrace::phases; ++p) {
+        line += ' ';
+        line += phase_name(p);
+        line += "_us=" + std::to_string((uint64_t)to_us(t.end[p] - prev));
+        prev = t.end[p];
+    }
+    line += " thread=" + std::to_string(ring.id);
+    std::cerr << line << std::endl;
+}
+
+static void append_json_string(std::string& out, std::string_view s) {
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void Tracer::write_trace(const Ring& ring, const RequestTrace& t) {
+    // One complete event for the request, one per phase it spent time in
+    auto event = [&](std::string& out, const char* name, uint64_t from, uint64_t to) {
+        char buf[160];
+        std::snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                      name, ring.id, to_us(from - epoch), to_us(to - from));
+        out += first_event ? "" : ",\n";
+        out += buf;
+        first_event = false;
+    };
+
+    std::string out;
+    event(out, t.method, t.start, t.end.back());
+    out += ",\"args\":{\"key\":";
+    append_json_string(out, t.key);
+    out += ",\"size\":" + std::to_string(t.size) + "}}";
+    uint64_t prev = t.start;
+    for (size_t p = 0; p < RequestTrace::phases; ++p) {
+        if (t.end[p] > prev) {
+            event(out, phase_name(p), prev, t.end[p]);
+            out += '}';
+        }
+        prev = t.end[p];
+    }
+    std::fwrite(out.data(), 1, out.size(), trace_file);
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Where a request spends its time, in order. Phases a request doesn't go
+// through (no body, nothing to commit) just take 0us.
+//   prepare: header parsed to body read, parent dirs, temp file, preconditions
+//   body:    reading the body off the socket
+//   commit:  checking digests, renaming the PUT into place
+//   handle:  handle_request and friends
+//   write:   sending the response
+enum class TracePhase { prepare, body, commit, handle, write, count };
+
+// Timestamps of one request's phases, cheap enough to take on every request:
+// one rdtsc each, converted to time only for requests that get logged.
+struct RequestTrace {
+    static constexpr size_t phases = static_cast<size_t>(TracePhase::count);
+
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    // End of phase `p`, the next one starts there
+    void mark(TracePhase p) { end[static_cast<size_t>(p)] = now(); }
+
+    uint64_t start = now();
+    std::array<uint64_t, phases> end{};
+    char method[8]{};
+    char key[120]{};
+    uint64_t size = 0;
+};
+
+// Slow request log (--slow-request-ms) and sampled Chrome trace dump
+// (--trace-file) of request phases.
+//
+// The server threads never format or write anything: a request worth
+// keeping is copied into its thread's ring and a logger thread drains the
+// rings every few ms, writing slow requests to stderr and samples to the
+// trace file. A full ring drops the record, it's counted and reported.
+// The trace file loads in chrome://tracing and ui.perfetto.dev.
+class Tracer {
+    public:
+        // Logs requests slower than `slow` (0 for none), traces one request
+        // in `sample` to `trace_path` (empty for none)
+        Tracer(int threads, std::chrono::microseconds slow, std::string trace_path, unsigned sample);
+        ~Tracer();
+
+        // Ties the calling server thread to slot `i`, before it traces anything
+        void bind_thread(int i);
+
+        // `trace` is over, its last phase ending now
+        void finish(RequestTrace& trace);
+
+    private:
+        static constexpr size_t ring_size = 1024;
+
+        struct Record {
+            RequestTrace trace;
+            bool slow;
+            bool sampled;
+        };
+
+        // Single producer (its server thread), single consumer (the logger)
+        struct alignas(64) Ring {
+            int id = 0;
+            std::array<Record, ring_size> records;
+            std::atomic<uint64_t> head{0};
+            std::atomic<uint64_t> tail{0};
+            std::atomic<uint64_t> dropped{0};
+            uint64_t requests = 0;
+        };
+
+        double to_us(uint64_t ticks) const { return ticks / ticks_per_us; }
+        void run();
+        void drain(Ring& ring);
+        void log_slow(const Ring& ring, const RequestTrace& t);
+        void write_trace(const Ring& ring, const RequestTrace& t);
+
+        std::vector<std::unique_ptr<Ring>> rings;
+        static thread_local Ring* current;
+
+        uint64_t slow_ticks = 0;
+        unsigned sample;
+        double ticks_per_us = 1000;
+        uint64_t epoch = RequestTrace::now();
+
+        FILE* trace_file = nullptr;
+        bool first_event = true;
+        uint64_t reported_drops = 0;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool stopping = false;
+        std::thread thread;
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Just enough XML for S3: escaping what we render and pulling elements out
+// of the small documents clients send (CompleteMultipartUpload, Delete).
+// No attributes, namespaces or CDATA, which S3 clients don't send anyway.
+
+inline void xml_escape_append(std::string& out, std::string_view s) {
+    for (char c : s) {
+        switch (c) {
+            case '&':  out.append("&amp;"); break;
+            case '<':  out.append("&lt;"); break;
+            case '>':  out.append("&gt;"); break;
+            case '"':  out.append("&quot;"); break;
+            case '\'': out.append("&apos;"); break;
+            default:   out.push_back(c);
+        }
+    }
+}
+
+inline std::string xml_unescape(std::string_view s) {
+    static constexpr std::pair<std::string_view, char> entities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''},
+    };
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '&') {
+            bool found = false;
+            for (auto& [entity, c] : entities) {
+                if (s.substr(i).starts_with(entity)) {
+                    out.push_back(c);
+                    i += entity.size() - 1;
+                    found = true;
+                    break;
+                }
+            }
+            if (found)
+                continue;
+        }
+        out.push_back(s[i]);
+    }
+    return out;
+}
+
+// Finds the next <tag>...</tag> at or after `pos` and returns what's between
+// them, still escaped. `pos` is moved past the closing tag. Returns false
+// when there's no such element left.
+inline bool xml_next(std::string_view doc, std::string_view tag, size_t& pos, std::string_view& inner) {
+    std::string open = "<" + std::string(tag) + ">";
+    std::string close = "</" + std::string(tag) + ">";
+    auto start = doc.find(open, pos);
+    if (start == std::string_view::npos)
+        return false;
+    start += open.size();
+    auto end = doc.find(close, start);
+    if (end == std::string_view::npos)
+        return false;
+    inner = doc.substr(start, end - start);
+    pos = end + close.size();
+    return true;
+}
+
+// First <tag> in `doc`, unescaped, empty if there's none
+inline std::string xml_value(std::string_view doc, std::string_view tag) {
+    size_t pos = 0;
+    std::string_view inner;
+    if (!xml_next(doc, tag, pos, inner))
+        return {};
+    return xml_unescape(inner);
+}